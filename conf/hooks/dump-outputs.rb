@@ -4,13 +4,20 @@
 # Distributed under the terms of the GNU General Public License v2
 
 # Dump outputs
+# Changed outputs are listed using environment variables like:
+# MPD_OUTPUT_%d_CHANGE = added|removed|modified
+# MPD_OUTPUT_%d_ID = OUTPUT_ID
+# MPD_OUTPUT_%d_NAME = OUTPUT_NAME
+# MPD_OUTPUT_%d_ENABLED = 0|1
 puts "=== MPD OUTPUTS ==="
 i = 1
 loop do
-  env_output = "MPD_OUTPUT_ID_#{i}"
+  env_output = "MPD_OUTPUT_#{i}_ID"
   break unless ENV[env_output]
+  puts "output[#{i}].change = #{ENV["MPD_OUTPUT_#{i}_CHANGE"]}"
   puts "output[#{i}].id = #{ENV[env_output]}"
-  puts "output[#{i}].enabled = #{ENV["MPD_OUTPUT_ID_#{i}_ENABLED"]}"
+  puts "output[#{i}].name = #{ENV["MPD_OUTPUT_#{i}_NAME"]}"
+  puts "output[#{i}].enabled = #{ENV["MPD_OUTPUT_#{i}_ENABLED"]}"
   i += 1
 end
 puts "==================="
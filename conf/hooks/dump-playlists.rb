@@ -4,7 +4,8 @@
 # Distributed under the terms of the GNU General Public License v2
 
 # Dump playlists
-# Playlists are listed using environment variables like:
+# Changed playlists are listed using environment variables like:
+# MPD_PLAYLIST_%d_CHANGE = added|removed|modified
 # MPD_PLAYLIST_%d_PATH = /path/to/playlist
 # MPD_PLAYLIST_%d_LAST_MODIFIED = PLAYLIST_LAST_MODIFIED_DATE
 
@@ -14,6 +15,7 @@ loop do
   envp  = "MPD_PLAYLIST_#{i}_PATH"
   envlm = "MPD_PLAYLIST_#{i}_LAST_MODIFIED"
   break unless ENV[envp]
+  puts "playlist[#{i}].change = #{ENV["MPD_PLAYLIST_#{i}_CHANGE"]}"
   puts "playlist[#{i}].path = #{ENV[envp]}"
   puts "playlist[#{i}].last_modified = #{ENV[envlm]}"
   i += 1
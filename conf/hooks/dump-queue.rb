@@ -3,12 +3,20 @@
 # Copyright 2009 Ali Polatel <alip@exherbo.org>
 # Distributed under the terms of the GNU General Public License v2
 
-# Dump queue
+# Dump queue changes
+# Songs which were added, moved or modified are listed using environment
+# variables like MPD_SONG_%d_URI, MPD_SONG_%d_CHANGE is one of added, moved or
+# modified. Ids of removed songs are listed in MPD_QUEUE_REMOVED.
 puts "=== MPD QUEUE ==="
+puts "version = #{ENV["MPD_QUEUE_OLD_VERSION"]} -> #{ENV["MPD_QUEUE_VERSION"]}"
+puts "length = #{ENV["MPD_QUEUE_LENGTH"]}"
+puts "removed = #{ENV["MPD_QUEUE_REMOVED"]}"
 i = 1
 loop do
   env_uri = "MPD_SONG_#{i}_URI"
   break unless ENV[env_uri]
+  puts "song[#{i}].change = #{ENV["MPD_SONG_#{i}_CHANGE"]}"
+  puts "song[#{i}].old_pos = #{ENV["MPD_SONG_#{i}_OLD_POS"]}"
   puts "song[#{i}].uri = #{ENV[env_uri]}"
   puts "song[#{i}].last_modified = #{ENV["MPD_SONG_#{i}_LAST_MODIFIED]"]}"
   puts "song[#{i}].duration = #{ENV["MPD_SONG_#{i}_DURATION"]}"
@@ -0,0 +1,468 @@
+/* vim: set cino= fo=croql sw=8 ts=8 sts=0 noet cin fdm=syntax : */
+
+/*
+ * Copyright (c) 2013 Ali Polatel <alip@exherbo.org>
+ *
+ * This file is part of the mpdcron mpd client. mpdcron is free software;
+ * you can redistribute it and/or modify it under the terms of the GNU General
+ * Public License version 2, as published by the Free Software Foundation.
+ *
+ * mpdcron is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+ * Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+
+/* Synthetic event storm for the daemon core, see `make bench'. Events are
+ * built from fake Mpd replies and dispatched with event_dispatch() the way
+ * event_run() does after fetching them. Hooks are not run. */
+
+#include "cron-defs.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <mpd/client.h>
+
+#ifdef __GLIBC__
+/* Count allocations by overriding malloc in the executable, the libraries
+ * we link against, GLib included, call these as well. */
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+
+static unsigned long allocations;
+
+void *malloc(size_t size);
+void *calloc(size_t nmemb, size_t size);
+void *realloc(void *ptr, size_t size);
+
+void *
+malloc(size_t size)
+{
+	__atomic_add_fetch(&allocations, 1, __ATOMIC_RELAXED);
+	return __libc_malloc(size);
+}
+
+void *
+calloc(size_t nmemb, size_t size)
+{
+	__atomic_add_fetch(&allocations, 1, __ATOMIC_RELAXED);
+	return __libc_calloc(nmemb, size);
+}
+
+void *
+realloc(void *ptr, size_t size)
+{
+	__atomic_add_fetch(&allocations, 1, __ATOMIC_RELAXED);
+	return __libc_realloc(ptr, size);
+}
+
+#define allocations_now()	__atomic_load_n(&allocations, __ATOMIC_RELAXED)
+#else
+#define allocations_now()	0UL
+#endif /* __GLIBC__ */
+
+GMainLoop *loop = NULL;
+
+static int optevents = 100000, optrate, optsongs = 20;
+static char *optmodpath;
+static char **optmodules;
+
+static GOptionEntry options[] = {
+	{"events", 'e', 0, G_OPTION_ARG_INT, &optevents, "Number of events to dispatch (default: 100000)", "N"},
+	{"rate", 'r', 0, G_OPTION_ARG_INT, &optrate, "Events per second, 0 for as fast as possible", "N"},
+	{"songs", 's', 0, G_OPTION_ARG_INT, &optsongs, "Player events per song (default: 20)", "N"},
+	{"module", 'm', 0, G_OPTION_ARG_STRING_ARRAY, &optmodules, "Load module, may be repeated", "NAME"},
+	{"module-path", 'M', 0, G_OPTION_ARG_FILENAME, &optmodpath, "Look for user modules in DIR", "DIR"},
+	{NULL, 0, 0, 0, NULL, NULL, NULL},
+};
+
+/* Wakeups are cycled through in this order, most of them player events as
+ * on a real server. */
+static const enum mpd_idle storm[] = {
+	MPD_IDLE_PLAYER,
+	MPD_IDLE_PLAYER | MPD_IDLE_MIXER,
+	MPD_IDLE_PLAYER,
+	MPD_IDLE_OPTIONS,
+	MPD_IDLE_PLAYER,
+	MPD_IDLE_DATABASE | MPD_IDLE_UPDATE,
+};
+
+static unsigned long hooks;
+
+/* Hooks fork and exec, which would hide everything else */
+void
+hooker_count(G_GNUC_UNUSED enum mpd_idle events)
+{
+}
+
+int
+hooker_run_hook(G_GNUC_UNUSED const char *name)
+{
+	hooks++;
+	return 0;
+}
+
+/* There is no server, the pool stays empty */
+bool
+loop_online(void)
+{
+	return false;
+}
+
+static gint64
+bench_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (gint64)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void
+bench_feed(void (*feed)(void *, const struct mpd_pair *), void *obj,
+		const char *name, const char *value)
+{
+	struct mpd_pair pair = { name, value };
+
+	feed(obj, &pair);
+}
+
+static void
+status_feed(void *obj, const struct mpd_pair *pair)
+{
+	mpd_status_feed(obj, pair);
+}
+
+static void
+song_feed(void *obj, const struct mpd_pair *pair)
+{
+	mpd_song_feed(obj, pair);
+}
+
+static void
+stats_feed(void *obj, const struct mpd_pair *pair)
+{
+	mpd_stats_feed(obj, pair);
+}
+
+/* The position stays at the start of the song, the wakeups come faster
+ * than Mpd would advance it and play tracking would see seeks. */
+static struct mpd_status *
+bench_status(unsigned n)
+{
+	char buf[64];
+	struct mpd_status *status;
+
+	status = mpd_status_begin();
+	bench_feed(status_feed, status, "volume", "80");
+	bench_feed(status_feed, status, "repeat", "0");
+	bench_feed(status_feed, status, "random", "1");
+	bench_feed(status_feed, status, "playlist", "42");
+	bench_feed(status_feed, status, "playlistlength", "1000");
+	bench_feed(status_feed, status, "state", "play");
+	g_snprintf(buf, sizeof(buf), "%u", n % 1000);
+	bench_feed(status_feed, status, "song", buf);
+	g_snprintf(buf, sizeof(buf), "%u", n);
+	bench_feed(status_feed, status, "songid", buf);
+	bench_feed(status_feed, status, "time", "0:300");
+	bench_feed(status_feed, status, "elapsed", "0.000");
+	bench_feed(status_feed, status, "bitrate", "320");
+	bench_feed(status_feed, status, "audio", "44100:16:2");
+	return status;
+}
+
+static struct mpd_song *
+bench_song(unsigned n)
+{
+	char buf[64];
+	struct mpd_pair pair;
+	struct mpd_song *song;
+
+	g_snprintf(buf, sizeof(buf), "bench/%04u.flac", n);
+	pair.name = "file";
+	pair.value = buf;
+	song = mpd_song_begin(&pair);
+	g_snprintf(buf, sizeof(buf), "Artist %u", n % 37);
+	bench_feed(song_feed, song, "Artist", buf);
+	g_snprintf(buf, sizeof(buf), "Album %u", n % 11);
+	bench_feed(song_feed, song, "Album", buf);
+	g_snprintf(buf, sizeof(buf), "Title %u", n);
+	bench_feed(song_feed, song, "Title", buf);
+	bench_feed(song_feed, song, "Genre", "Benchmark");
+	bench_feed(song_feed, song, "Time", "300");
+	g_snprintf(buf, sizeof(buf), "%u", n % 1000);
+	bench_feed(song_feed, song, "Pos", buf);
+	g_snprintf(buf, sizeof(buf), "%u", n);
+	bench_feed(song_feed, song, "Id", buf);
+	return song;
+}
+
+static struct mpd_stats *
+bench_stats(void)
+{
+	struct mpd_stats *stats;
+
+	stats = mpd_stats_begin();
+	bench_feed(stats_feed, stats, "artists", "37");
+	bench_feed(stats_feed, stats, "albums", "11");
+	bench_feed(stats_feed, stats, "songs", "1000");
+	bench_feed(stats_feed, stats, "uptime", "3600");
+	bench_feed(stats_feed, stats, "playtime", "1800");
+	bench_feed(stats_feed, stats, "db_playtime", "300000");
+	bench_feed(stats_feed, stats, "db_update", "1356998400");
+	return stats;
+}
+
+/* Objects event_snapshot_fetch() would have received for these events */
+static struct event_snapshot *
+bench_snapshot(enum mpd_idle events, unsigned n)
+{
+	unsigned song;
+	struct event_snapshot *snap;
+
+	song = n / optsongs;
+	snap = g_new0(struct event_snapshot, 1);
+	snap->ref = 1;
+	if (events & (MPD_IDLE_PLAYER | MPD_IDLE_MIXER | MPD_IDLE_OPTIONS |
+				MPD_IDLE_UPDATE | MPD_IDLE_QUEUE))
+		snap->status = bench_status(song);
+	if (events & MPD_IDLE_DATABASE)
+		snap->stats = bench_stats();
+	if (events & MPD_IDLE_PLAYER)
+		snap->song = bench_song(song);
+	return snap;
+}
+
+static int
+bench_compare(gconstpointer a, gconstpointer b)
+{
+	gint64 x = *(const gint64 *)a, y = *(const gint64 *)b;
+
+	return (x > y) - (x < y);
+}
+
+static double
+bench_quantile(GArray *latencies, double q)
+{
+	unsigned i;
+
+	i = (unsigned)(q * (latencies->len - 1));
+	return g_array_index(latencies, gint64, i) / 1000.0;
+}
+
+static int
+bench_run(void)
+{
+	int ret;
+	unsigned long allocs, start_allocs;
+	gint64 start, wall, total, elapsed, due;
+	enum mpd_idle events;
+	GArray *latencies;
+	struct event_snapshot *snap;
+
+	latencies = g_array_sized_new(FALSE, FALSE, sizeof(gint64), optevents);
+	allocs = 0;
+	total = 0;
+	wall = bench_now();
+	for (int n = 0; n < optevents; n++) {
+		if (optrate > 0) {
+			due = wall + (gint64)n * 1000000000 / optrate;
+			if ((elapsed = due - bench_now()) > 0)
+				g_usleep(elapsed / 1000);
+		}
+
+		events = storm[n % G_N_ELEMENTS(storm)];
+		snap = bench_snapshot(events, n);
+
+		start_allocs = allocations_now();
+		start = bench_now();
+		if (events & MPD_IDLE_PLAYER)
+			snap->play = play_update(snap->status, snap->song);
+		ret = event_dispatch(NULL, events, snap);
+		event_snapshot_unref(snap);
+		elapsed = bench_now() - start;
+		allocs += allocations_now() - start_allocs;
+
+		if (ret < 0) {
+			g_printerr("Dispatch failed at event %d\n", n);
+			g_array_free(latencies, TRUE);
+			return -1;
+		}
+		total += elapsed;
+		g_array_append_val(latencies, elapsed);
+
+		/* Let module timers and workers run between wakeups */
+		while (g_main_context_iteration(NULL, FALSE))
+			;
+	}
+	wall = bench_now() - wall;
+
+	g_array_sort(latencies, bench_compare);
+	printf("events: %d in %.3fs, %.0f events/s dispatching, %.0f events/s wall\n",
+			optevents, wall / 1e9,
+			optevents / (total / 1e9), optevents / (wall / 1e9));
+	printf("dispatch: p50 %.1fus p99 %.1fus max %.1fus\n",
+			bench_quantile(latencies, 0.5),
+			bench_quantile(latencies, 0.99),
+			bench_quantile(latencies, 1.0));
+#ifdef __GLIBC__
+	printf("allocations: %.1f per event\n", (double)allocs / optevents);
+#endif /* __GLIBC__ */
+	printf("hooks: %lu skipped\n", hooks);
+	g_array_free(latencies, TRUE);
+	return 0;
+}
+
+#ifdef HAVE_GMODULE
+/* Configuration of the standard modules: the scrobbler needs an account,
+ * its server is unreachable so nothing is submitted, and stats listens on
+ * a Unix socket instead of the port of a running daemon. */
+static GKeyFile *
+bench_keyfile(const char *home)
+{
+	char *path;
+	const char *addrs[2];
+	GKeyFile *kfd;
+
+	kfd = g_key_file_new();
+
+	g_key_file_set_string(kfd, "last.fm", "url", "http://127.0.0.1:1/");
+	g_key_file_set_string(kfd, "last.fm", "username", "bench");
+	g_key_file_set_string(kfd, "last.fm", "password", "bench");
+	path = g_build_filename(home, "scrobbler.journal", NULL);
+	g_key_file_set_string(kfd, "last.fm", "journal", path);
+	g_free(path);
+
+	path = g_build_filename(home, "stats.socket", NULL);
+	addrs[0] = path;
+	addrs[1] = NULL;
+	g_key_file_set_string_list(kfd, "stats", "bind_to_addresses", addrs, 1);
+	g_free(path);
+
+	return kfd;
+}
+#endif /* HAVE_GMODULE */
+
+static void
+bench_cleanup(const char *home)
+{
+	GDir *dir;
+	const char *name;
+	char *path;
+
+	/* Modules leave their files behind */
+	if ((dir = g_dir_open(home, 0, NULL)) != NULL) {
+		while ((name = g_dir_read_name(dir)) != NULL) {
+			path = g_build_filename(home, name, NULL);
+			g_unlink(path);
+			g_free(path);
+		}
+		g_dir_close(dir);
+	}
+	g_rmdir(home);
+}
+
+int
+main(int argc, char **argv)
+{
+	int ret;
+	char *home, *modules;
+#ifdef HAVE_GMODULE
+	GString *loaded;
+	GKeyFile *kfd;
+#endif /* HAVE_GMODULE */
+	GOptionContext *ctx;
+	GError *error = NULL;
+
+	ctx = g_option_context_new("");
+	g_option_context_add_main_entries(ctx, options, PACKAGE);
+	g_option_context_set_summary(ctx, PACKAGE"-bench-"VERSION GITHEAD
+			" - dispatch synthetic events");
+	if (!g_option_context_parse(ctx, &argc, &argv, &error)) {
+		g_printerr("option parsing failed: %s\n", error->message);
+		g_option_context_free(ctx);
+		g_error_free(error);
+		return EXIT_FAILURE;
+	}
+	g_option_context_free(ctx);
+	if (optevents <= 0 || optsongs <= 0 || optrate < 0) {
+		g_printerr("Invalid number of events, songs or rate\n");
+		return EXIT_FAILURE;
+	}
+
+	/* Keep modules away from the real home directory */
+	if ((home = g_dir_make_tmp(PACKAGE"-bench-XXXXXX", &error)) == NULL) {
+		g_printerr("Failed to create home directory: %s\n", error->message);
+		g_error_free(error);
+		return EXIT_FAILURE;
+	}
+	g_setenv(ENV_HOME_DIR, home, 1);
+	if (conf_init() < 0) {
+		bench_cleanup(home);
+		g_free(home);
+		return EXIT_FAILURE;
+	}
+	loop = g_main_loop_new(NULL, FALSE);
+
+	ret = 0;
+#ifdef HAVE_GMODULE
+	if (optmodpath != NULL) {
+		g_free(conf.mod_path);
+		conf.mod_path = g_strdup(optmodpath);
+	}
+	/* Modules which fail to initialize are skipped, the rest of the
+	 * storm is still worth measuring */
+	loaded = g_string_new(NULL);
+	kfd = bench_keyfile(home);
+	for (unsigned i = 0; optmodules != NULL && optmodules[i] != NULL; i++) {
+		if (module_load(optmodules[i], kfd) < 0) {
+			printf("skipped: %s, failed to load\n", optmodules[i]);
+			continue;
+		}
+		if (loaded->len > 0)
+			g_string_append_c(loaded, ',');
+		g_string_append(loaded, optmodules[i]);
+	}
+	g_key_file_free(kfd);
+	modules = g_string_free(loaded, loaded->len == 0);
+	if (modules == NULL)
+		modules = g_strdup("none");
+#else
+	if (optmodules != NULL) {
+		g_printerr("Module support is disabled\n");
+		ret = -1;
+	}
+	modules = g_strdup("none");
+#endif /* HAVE_GMODULE */
+	printf("modules: %s\n", modules);
+
+	if (ret == 0)
+		ret = bench_run();
+
+#ifdef HAVE_GMODULE
+	module_close(1);
+#endif /* HAVE_GMODULE */
+	play_free();
+	env_free();
+	metrics_free();
+	conf_free();
+	g_main_loop_unref(loop);
+	bench_cleanup(home);
+	g_free(home);
+	g_free(modules);
+	g_free(optmodpath);
+	g_strfreev(optmodules);
+	return (ret < 0) ? EXIT_FAILURE : EXIT_SUCCESS;
+}
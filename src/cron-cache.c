@@ -0,0 +1,309 @@
+/* vim: set cino= fo=croql sw=8 ts=8 sts=0 noet cin fdm=syntax : */
+
+/*
+ * Copyright (c) 2013 Ali Polatel <alip@exherbo.org>
+ *
+ * This file is part of the mpdcron mpd client. mpdcron is free software;
+ * you can redistribute it and/or modify it under the terms of the GNU General
+ * Public License version 2, as published by the Free Software Foundation.
+ *
+ * mpdcron is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+ * Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include "cron-defs.h"
+
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+
+#include <glib.h>
+#include <mpd/client.h>
+
+/* Cached stored playlists, maps paths to last modification times */
+static GHashTable *playlists = NULL;
+static GArray *playlist_changes = NULL;
+static GStringChunk *playlist_strings = NULL;
+static struct mpdcron_playlist_delta playlist_delta;
+
+/* Cached outputs, maps ids to struct cache_output */
+struct cache_output {
+	char *name;
+	bool enabled;
+};
+
+static GHashTable *outputs = NULL;
+static GArray *output_changes = NULL;
+static GStringChunk *output_strings = NULL;
+static struct mpdcron_output_delta output_delta;
+
+static void
+cache_output_free(gpointer data)
+{
+	struct cache_output *output = (struct cache_output *)data;
+
+	g_free(output->name);
+	g_free(output);
+}
+
+static void
+cache_init(void)
+{
+	if (playlists != NULL)
+		return;
+
+	playlists = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+	playlist_changes = g_array_new(FALSE, FALSE, sizeof(struct mpdcron_playlist_change));
+	outputs = g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL, cache_output_free);
+	output_changes = g_array_new(FALSE, FALSE, sizeof(struct mpdcron_output_change));
+	playlist_strings = g_string_chunk_new(1024);
+	output_strings = g_string_chunk_new(256);
+}
+
+static void
+cache_playlists_free(GPtrArray *list)
+{
+	for (unsigned i = 0; i < list->len; i++)
+		mpd_playlist_free(g_ptr_array_index(list, i));
+	g_ptr_array_free(list, TRUE);
+}
+
+static void
+cache_outputs_free(GPtrArray *list)
+{
+	for (unsigned i = 0; i < list->len; i++)
+		mpd_output_free(g_ptr_array_index(list, i));
+	g_ptr_array_free(list, TRUE);
+}
+
+GPtrArray *
+cache_playlists_recv(struct mpd_connection *conn)
+{
+	GPtrArray *list;
+	struct mpd_playlist *playlist;
+
+	list = g_ptr_array_new();
+	while ((playlist = mpd_recv_playlist(conn)) != NULL)
+		g_ptr_array_add(list, playlist);
+	if (mpd_connection_get_error(conn) != MPD_ERROR_SUCCESS) {
+		cache_playlists_free(list);
+		return NULL;
+	}
+	return list;
+}
+
+/* Stored playlists are sent on their own as Mpd answers with an error when
+ * they're disabled, which would abort a command list. That's treated as an
+ * empty list. */
+GPtrArray *
+cache_playlists_fetch(struct mpd_connection *conn)
+{
+	GPtrArray *list;
+
+	g_debug("Sending listplaylists command to Mpd server");
+	if (!mpd_send_list_playlists(conn))
+		return NULL;
+
+	if ((list = cache_playlists_recv(conn)) == NULL) {
+		if (mpd_connection_get_error(conn) != MPD_ERROR_SERVER ||
+				!mpd_connection_clear_error(conn))
+			return NULL;
+		return g_ptr_array_new();
+	}
+	if (!mpd_response_finish(conn)) {
+		cache_playlists_free(list);
+		return NULL;
+	}
+	return list;
+}
+
+GPtrArray *
+cache_outputs_recv(struct mpd_connection *conn)
+{
+	GPtrArray *list;
+	struct mpd_output *output;
+
+	list = g_ptr_array_new();
+	while ((output = mpd_recv_output(conn)) != NULL)
+		g_ptr_array_add(list, output);
+	if (mpd_connection_get_error(conn) != MPD_ERROR_SUCCESS) {
+		cache_outputs_free(list);
+		return NULL;
+	}
+	return list;
+}
+
+const struct mpdcron_playlist_delta *
+cache_playlists_update(GPtrArray *list)
+{
+	const char *path;
+	time_t mtime, *old;
+	GHashTable *current;
+	GHashTableIter iter;
+	gpointer key, value;
+	struct mpd_playlist *playlist;
+	struct mpdcron_playlist_change change;
+
+	cache_init();
+	g_array_set_size(playlist_changes, 0);
+	g_string_chunk_clear(playlist_strings);
+
+	current = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+	for (unsigned i = 0; i < list->len; i++) {
+		playlist = g_ptr_array_index(list, i);
+		path = mpd_playlist_get_path(playlist);
+		mtime = mpd_playlist_get_last_modified(playlist);
+
+		old = g_hash_table_lookup(playlists, path);
+		if (old == NULL || *old != mtime) {
+			change.type = (old == NULL)
+				? MPDCRON_CHANGE_ADDED
+				: MPDCRON_CHANGE_MODIFIED;
+			change.path = g_string_chunk_insert(playlist_strings, path);
+			change.last_modified = mtime;
+			g_array_append_val(playlist_changes, change);
+		}
+		if (old != NULL)
+			g_hash_table_remove(playlists, path);
+
+		g_hash_table_insert(current, g_strdup(path),
+				g_memdup(&mtime, sizeof(time_t)));
+	}
+
+	/* Whatever is left in the old cache is gone */
+	g_hash_table_iter_init(&iter, playlists);
+	while (g_hash_table_iter_next(&iter, &key, &value)) {
+		change.type = MPDCRON_CHANGE_REMOVED;
+		change.path = g_string_chunk_insert(playlist_strings, key);
+		change.last_modified = 0;
+		g_array_append_val(playlist_changes, change);
+	}
+	g_hash_table_destroy(playlists);
+	playlists = current;
+	cache_playlists_free(list);
+
+	playlist_delta.count = playlist_changes->len;
+	playlist_delta.changes = (const struct mpdcron_playlist_change *)playlist_changes->data;
+	g_debug("Stored playlists: %u changes", playlist_delta.count);
+	return &playlist_delta;
+}
+
+const struct mpdcron_output_delta *
+cache_outputs_update(GPtrArray *list)
+{
+	unsigned id;
+	const char *name;
+	bool enabled;
+	GHashTable *current;
+	GHashTableIter iter;
+	gpointer key, value;
+	struct mpd_output *output;
+	struct cache_output *old, *cached;
+	struct mpdcron_output_change change;
+
+	cache_init();
+	g_array_set_size(output_changes, 0);
+	g_string_chunk_clear(output_strings);
+
+	current = g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL, cache_output_free);
+	for (unsigned i = 0; i < list->len; i++) {
+		output = g_ptr_array_index(list, i);
+		id = mpd_output_get_id(output);
+		name = mpd_output_get_name(output);
+		enabled = mpd_output_get_enabled(output);
+
+		old = g_hash_table_lookup(outputs, GUINT_TO_POINTER(id));
+		if (old == NULL || old->enabled != enabled || strcmp(old->name, name) != 0) {
+			change.type = (old == NULL)
+				? MPDCRON_CHANGE_ADDED
+				: MPDCRON_CHANGE_MODIFIED;
+			change.id = id;
+			change.name = g_string_chunk_insert(output_strings, name);
+			change.enabled = enabled;
+			g_array_append_val(output_changes, change);
+		}
+		if (old != NULL)
+			g_hash_table_remove(outputs, GUINT_TO_POINTER(id));
+
+		cached = g_new(struct cache_output, 1);
+		cached->name = g_strdup(name);
+		cached->enabled = enabled;
+		g_hash_table_insert(current, GUINT_TO_POINTER(id), cached);
+	}
+
+	/* Whatever is left in the old cache is gone */
+	g_hash_table_iter_init(&iter, outputs);
+	while (g_hash_table_iter_next(&iter, &key, &value)) {
+		old = (struct cache_output *)value;
+		change.type = MPDCRON_CHANGE_REMOVED;
+		change.id = GPOINTER_TO_UINT(key);
+		change.name = g_string_chunk_insert(output_strings, old->name);
+		change.enabled = false;
+		g_array_append_val(output_changes, change);
+	}
+	g_hash_table_destroy(outputs);
+	outputs = current;
+	cache_outputs_free(list);
+
+	output_delta.count = output_changes->len;
+	output_delta.changes = (const struct mpdcron_output_change *)output_changes->data;
+	g_debug("Outputs: %u changes", output_delta.count);
+	return &output_delta;
+}
+
+int
+cache_prime(struct mpd_connection *conn)
+{
+	GPtrArray *list;
+
+	cache_clear();
+
+	if ((list = cache_playlists_fetch(conn)) == NULL)
+		return -1;
+	cache_playlists_update(list);
+
+	g_debug("Sending outputs command to Mpd server");
+	if (!mpd_send_outputs(conn))
+		return -1;
+	if ((list = cache_outputs_recv(conn)) == NULL)
+		return -1;
+	cache_outputs_update(list);
+	return mpd_response_finish(conn) ? 0 : -1;
+}
+
+void
+cache_clear(void)
+{
+	if (playlists == NULL)
+		return;
+
+	g_hash_table_remove_all(playlists);
+	g_hash_table_remove_all(outputs);
+	g_array_set_size(playlist_changes, 0);
+	g_array_set_size(output_changes, 0);
+	g_string_chunk_clear(playlist_strings);
+	g_string_chunk_clear(output_strings);
+}
+
+void
+cache_free(void)
+{
+	if (playlists == NULL)
+		return;
+
+	g_hash_table_destroy(playlists);
+	g_hash_table_destroy(outputs);
+	g_array_free(playlist_changes, TRUE);
+	g_array_free(output_changes, TRUE);
+	g_string_chunk_free(playlist_strings);
+	g_string_chunk_free(output_strings);
+	playlists = outputs = NULL;
+	playlist_changes = output_changes = NULL;
+	playlist_strings = output_strings = NULL;
+}
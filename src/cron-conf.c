@@ -79,6 +79,7 @@ conf_free(void)
 	g_free(conf.home_path);
 	g_free(conf.conf_path);
 	g_free(conf.pid_path);
+	g_free(conf.metrics_path);
 #ifdef HAVE_GMODULE
 	g_free(conf.mod_path);
 #endif /* HAVE_GMODULE */
@@ -40,8 +40,22 @@
 
 #define DEFAULT_PID_KILL_WAIT	3
 #define DEFAULT_MPD_RECONNECT	5
+#define DEFAULT_MPD_RECONNECT_MAX	60
+#define DEFAULT_MPD_CONNECT_TIMEOUT	30000
 #define DEFAULT_MPD_TIMEOUT	0
+#define DEFAULT_MPD_COALESCE	0
+#define DEFAULT_MPD_POOL	1
+#define DEFAULT_MPD_POOL_PING	30
 #define DEFAULT_LOG_LEVEL	0
+#define DEFAULT_MODULE_QUEUE	64
+#define DEFAULT_MODULE_BUDGET	0
+#define DEFAULT_MODULE_STRIKES	3
+#define DEFAULT_HOOK_CONCURRENCY	1
+#define DEFAULT_HOOK_QUEUE	16
+#define DEFAULT_HOOK_TIMEOUT	0
+#define DEFAULT_HOOK_BACKLOG	256
+#define DEFAULT_QUEUE_ENV_MAX	256
+#define DEFAULT_HOOK_RESTART_MAX	60
 
 #define DEFAULT_DATE_FORMAT		"%Y-%m-%dT%H:%M:%S%z"
 #define DEFAULT_DATE_FORMAT_SIZE	32
@@ -0,0 +1,333 @@
+/* vim: set cino= fo=croql sw=8 ts=8 sts=0 noet cin fdm=syntax : */
+
+/*
+ * Copyright (c) 2013 Ali Polatel <alip@exherbo.org>
+ *
+ * This file is part of the mpdcron mpd client. mpdcron is free software;
+ * you can redistribute it and/or modify it under the terms of the GNU General
+ * Public License version 2, as published by the Free Software Foundation.
+ *
+ * mpdcron is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+ * Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include "cron-defs.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/un.h>
+
+#include <glib.h>
+#include <mpd/client.h>
+
+/* Mpd sends a single welcome line after accepting the connection */
+#define CONNECT_WELCOME_MAX	256
+
+struct connect_request {
+	int fd;
+	struct addrinfo *ai_list, *ai;
+	guint io_sid, timeout_sid, idle_sid;
+	GString *welcome;
+	char *error;
+
+	connect_func func;
+	gpointer userdata;
+};
+
+static void
+connect_close(struct connect_request *req)
+{
+	if (req->io_sid != 0) {
+		g_source_remove(req->io_sid);
+		req->io_sid = 0;
+	}
+	if (req->fd >= 0) {
+		close(req->fd);
+		req->fd = -1;
+	}
+}
+
+static void
+connect_free(struct connect_request *req)
+{
+	connect_close(req);
+	if (req->timeout_sid != 0)
+		g_source_remove(req->timeout_sid);
+	if (req->idle_sid != 0)
+		g_source_remove(req->idle_sid);
+	if (req->ai_list != NULL)
+		freeaddrinfo(req->ai_list);
+	g_string_free(req->welcome, TRUE);
+	g_free(req->error);
+	g_free(req);
+}
+
+static void
+connect_finish(struct connect_request *req, struct mpd_connection *conn)
+{
+	connect_func func;
+	gpointer userdata;
+	char *error;
+
+	func = req->func;
+	userdata = req->userdata;
+	error = req->error;
+	req->error = NULL;
+	connect_free(req);
+
+	func(conn, error, userdata);
+	g_free(error);
+}
+
+static gboolean
+connect_report(gpointer data)
+{
+	struct connect_request *req = (struct connect_request *)data;
+
+	req->idle_sid = 0;
+	connect_finish(req, NULL);
+	return FALSE;
+}
+
+static void
+connect_fail(struct connect_request *req, const char *fmt, ...)
+{
+	char *error;
+	va_list ap;
+
+	va_start(ap, fmt);
+	error = g_strdup_vprintf(fmt, ap);
+	va_end(ap);
+	g_free(req->error);
+	req->error = error;
+
+	/* Report from the main loop so that the caller never gets called
+	 * back before connect_async() returns. */
+	connect_close(req);
+	if (req->idle_sid == 0)
+		req->idle_sid = g_idle_add(connect_report, req);
+}
+
+static guint
+connect_watch(struct connect_request *req, GIOCondition condition, GIOFunc func)
+{
+	guint sid;
+	GIOChannel *channel;
+
+	channel = g_io_channel_unix_new(req->fd);
+	sid = g_io_add_watch(channel, condition, func, req);
+	g_io_channel_unref(channel);
+	return sid;
+}
+
+static gboolean
+connect_readable(G_GNUC_UNUSED GIOChannel *source,
+		G_GNUC_UNUSED GIOCondition condition,
+		gpointer data)
+{
+	ssize_t n;
+	char buf[CONNECT_WELCOME_MAX], *eol;
+	struct mpd_async *async;
+	struct mpd_connection *conn;
+	struct connect_request *req = (struct connect_request *)data;
+
+	n = read(req->fd, buf, sizeof(buf));
+	if (n < 0 && (errno == EAGAIN || errno == EINTR))
+		return TRUE;
+	if (n > 0)
+		g_string_append_len(req->welcome, buf, n);
+
+	eol = strchr(req->welcome->str, '\n');
+	if (n > 0 && eol == NULL && req->welcome->len < CONNECT_WELCOME_MAX)
+		return TRUE;
+
+	req->io_sid = 0;
+	if (n < 0) {
+		connect_fail(req, "Failed to read welcome: %s", g_strerror(errno));
+		return FALSE;
+	}
+	else if (n == 0) {
+		connect_fail(req, "Connection closed by server");
+		return FALSE;
+	}
+	else if (eol == NULL) {
+		connect_fail(req, "Malformed welcome from server");
+		return FALSE;
+	}
+	*eol = '\0';
+
+	/* The socket now belongs to libmpdclient */
+	if ((async = mpd_async_new(req->fd)) == NULL) {
+		g_critical("Error creating mpd connection: out of memory");
+		exit(EXIT_FAILURE);
+	}
+	req->fd = -1;
+	if ((conn = mpd_connection_new_async(async, req->welcome->str)) == NULL) {
+		g_critical("Error creating mpd connection: out of memory");
+		exit(EXIT_FAILURE);
+	}
+	if (conf.timeout > 0)
+		mpd_connection_set_timeout(conn, conf.timeout);
+
+	connect_finish(req, conn);
+	return FALSE;
+}
+
+static void connect_next(struct connect_request *req);
+
+static gboolean
+connect_writable(G_GNUC_UNUSED GIOChannel *source,
+		G_GNUC_UNUSED GIOCondition condition,
+		gpointer data)
+{
+	int err;
+	socklen_t len;
+	struct connect_request *req = (struct connect_request *)data;
+
+	req->io_sid = 0;
+	len = sizeof(err);
+	if (getsockopt(req->fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0)
+		err = errno;
+	if (err != 0) {
+		close(req->fd);
+		req->fd = -1;
+		g_free(req->error);
+		req->error = g_strdup(g_strerror(err));
+		if (req->ai_list == NULL) {
+			/* Local socket, there's nothing else to try */
+			connect_fail(req, "%s", req->error);
+			return FALSE;
+		}
+		req->ai = req->ai->ai_next;
+		connect_next(req);
+		return FALSE;
+	}
+
+	req->io_sid = connect_watch(req, G_IO_IN | G_IO_HUP | G_IO_ERR, connect_readable);
+	return FALSE;
+}
+
+static int
+connect_socket(int family, const struct sockaddr *addr, socklen_t addrlen, int *fd_r)
+{
+	int fd;
+
+	if ((fd = socket(family, SOCK_STREAM, 0)) < 0)
+		return -errno;
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+	fcntl(fd, F_SETFD, FD_CLOEXEC);
+
+	*fd_r = fd;
+	if (connect(fd, addr, addrlen) < 0 && errno != EINPROGRESS)
+		return -errno;
+	return 0;
+}
+
+static void
+connect_next(struct connect_request *req)
+{
+	int ret;
+	struct sockaddr_un sun;
+
+	g_assert(req->fd < 0);
+
+	if (req->ai_list == NULL) {
+		/* Local socket */
+		memset(&sun, 0, sizeof(sun));
+		sun.sun_family = AF_UNIX;
+		g_strlcpy(sun.sun_path, conf.hostname, sizeof(sun.sun_path));
+		if ((ret = connect_socket(AF_UNIX, (struct sockaddr *)&sun,
+						sizeof(sun), &req->fd)) < 0) {
+			connect_fail(req, "%s", g_strerror(-ret));
+			return;
+		}
+	}
+	else {
+		for (;;) {
+			if (req->ai == NULL) {
+				connect_fail(req, "%s", req->error ? req->error
+						: "No address to connect to");
+				return;
+			}
+			ret = connect_socket(req->ai->ai_family, req->ai->ai_addr,
+					req->ai->ai_addrlen, &req->fd);
+			if (ret == 0)
+				break;
+			if (req->fd >= 0) {
+				close(req->fd);
+				req->fd = -1;
+			}
+			g_free(req->error);
+			req->error = g_strdup(g_strerror(-ret));
+			req->ai = req->ai->ai_next;
+		}
+	}
+
+	req->io_sid = connect_watch(req, G_IO_OUT | G_IO_HUP | G_IO_ERR, connect_writable);
+}
+
+static gboolean
+connect_expire(gpointer data)
+{
+	struct connect_request *req = (struct connect_request *)data;
+
+	req->timeout_sid = 0;
+	connect_fail(req, "Timeout");
+	return FALSE;
+}
+
+struct connect_request *
+connect_async(connect_func func, gpointer userdata)
+{
+	int ret;
+	struct addrinfo hints;
+	struct connect_request *req;
+
+	req = g_new0(struct connect_request, 1);
+	req->fd = -1;
+	req->welcome = g_string_sized_new(64);
+	req->func = func;
+	req->userdata = userdata;
+	req->timeout_sid = g_timeout_add(conf.timeout > 0
+			? (guint)conf.timeout
+			: DEFAULT_MPD_CONNECT_TIMEOUT,
+			connect_expire, req);
+
+	if (conf.hostname[0] != '/') {
+		/* Name resolution is still synchronous, though for the usual
+		 * localhost or numeric address it doesn't hit the network. */
+		memset(&hints, 0, sizeof(hints));
+		hints.ai_family = AF_UNSPEC;
+		hints.ai_socktype = SOCK_STREAM;
+		if ((ret = getaddrinfo(conf.hostname, conf.port, &hints, &req->ai_list)) != 0) {
+			req->ai_list = NULL;
+			connect_fail(req, "Failed to resolve host `%s': %s",
+					conf.hostname, gai_strerror(ret));
+			return req;
+		}
+		req->ai = req->ai_list;
+	}
+
+	connect_next(req);
+	return req;
+}
+
+void
+connect_cancel(struct connect_request *req)
+{
+	connect_free(req);
+}
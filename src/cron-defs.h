@@ -22,12 +22,104 @@
 
 #include "cron-config.h"
 
+#include <stdbool.h>
+
 #include <glib.h>
 #include <mpd/client.h>
 
+enum hook_policy {
+	HOOK_POLICY_DROP_OLDEST = 0,
+	HOOK_POLICY_DROP_NEWEST,
+	HOOK_POLICY_MERGE,
+};
+
+enum module_quarantine {
+	MODULE_QUARANTINE_DISABLE = 0,
+	MODULE_QUARANTINE_THREAD,
+};
+
+struct module_config {
+	int budget;
+	int strikes;
+	enum module_quarantine quarantine;
+};
+
+struct hooker_config {
+	int concurrency;
+	int queue;
+	enum hook_policy policy;
+	int timeout;
+	int backlog;
+};
+
+#define METRICS_BUCKETS	14
+
+struct metrics_histogram {
+	char *name;
+	guint64 count;
+	gint64 sum, max;
+	guint64 buckets[METRICS_BUCKETS];
+};
+
+struct metrics_counter {
+	char *name;
+	guint64 value;
+};
+
+/* Objects fetched from Mpd once per wakeup and shared by all events.
+ * Snapshots are immutable once fetched and may be handed to module threads,
+ * the deltas however point into the mirrors and are only valid until the
+ * next wakeup. */
+struct event_snapshot {
+	gint ref;
+	struct mpd_status *status;
+	struct mpd_stats *stats;
+	struct mpd_song *song;
+	const struct mpdcron_queue_delta *queue;
+	const struct mpdcron_playlist_delta *playlists;
+	const struct mpdcron_output_delta *outputs;
+	const struct mpdcron_play_delta *play;
+};
+
+struct connect_request;
+typedef void (*connect_func)(struct mpd_connection *conn, const char *error,
+		gpointer userdata);
+
 extern struct mpdcron_config conf;
+extern struct hooker_config hooker_conf;
+extern struct module_config module_conf;
 extern GMainLoop *loop;
 
+GPtrArray *
+cache_playlists_recv(struct mpd_connection *conn);
+
+GPtrArray *
+cache_playlists_fetch(struct mpd_connection *conn);
+
+GPtrArray *
+cache_outputs_recv(struct mpd_connection *conn);
+
+const struct mpdcron_playlist_delta *
+cache_playlists_update(GPtrArray *list);
+
+const struct mpdcron_output_delta *
+cache_outputs_update(GPtrArray *list);
+
+int
+cache_prime(struct mpd_connection *conn);
+
+void
+cache_clear(void);
+
+void
+cache_free(void);
+
+struct connect_request *
+connect_async(connect_func func, gpointer userdata);
+
+void
+connect_cancel(struct connect_request *req);
+
 const char *
 conf_pid_file_proc(void);
 
@@ -38,19 +130,62 @@ void
 conf_free(void);
 
 void
-env_clearenv(void);
+env_begin(void);
+
+void
+env_setenv(const char *name, const char *value);
+
+void
+env_stats(const struct mpd_stats *stats);
+
+void
+env_status(const struct mpd_status *status);
+
+void
+env_song(const struct mpd_song *song);
+
+void
+env_queue(const struct mpdcron_queue_delta *delta);
 
 void
-env_stats(struct mpd_stats *stats);
+env_playlists(const struct mpdcron_playlist_delta *delta);
 
 void
-env_status(struct mpd_status *status);
+env_outputs(const struct mpdcron_output_delta *delta);
+
+gchar **
+env_end(void);
+
+gchar **
+env_envp(void);
+
+gchar **
+env_dup(void);
+
+void
+env_free(void);
+
+struct event_snapshot *
+event_snapshot_ref(struct event_snapshot *snap);
 
 void
-env_status_currentsong(struct mpd_song *song, struct mpd_status *status);
+event_snapshot_unref(struct event_snapshot *snap);
 
 int
-event_run(struct mpd_connection *conn, enum mpd_idle event);
+event_dispatch(struct mpd_connection *conn, enum mpd_idle events,
+		struct event_snapshot *snap);
+
+int
+event_run(struct mpd_connection *conn, enum mpd_idle events);
+
+int
+hooker_persistent_start(const char *name);
+
+void
+hooker_close(void);
+
+void
+hooker_count(enum mpd_idle events);
 
 int
 hooker_run_hook(const char *name);
@@ -58,11 +193,50 @@ hooker_run_hook(const char *name);
 int
 keyfile_load(GKeyFile **cfd_r);
 
+int
+keyfile_load_hooks(GKeyFile **cfd_r);
+
+int
+keyfile_reload_hooks(GKeyFile **cfd_r);
+
 #ifdef HAVE_GMODULE
 int
 keyfile_load_modules(GKeyFile **cfd_r);
+
+int
+keyfile_reload_modules(GKeyFile **cfd_r);
 #endif /* HAVE_GMODULE */
 
+unsigned
+queue_version(void);
+
+const struct mpdcron_queue_delta *
+queue_update(const struct mpd_status *status, GPtrArray *changed);
+
+int
+queue_prime(struct mpd_connection *conn);
+
+void
+queue_clear(void);
+
+void
+queue_free(void);
+
+void
+pool_init(void);
+
+void
+pool_flush(void);
+
+void
+pool_free(void);
+
+const struct mpdcron_play_delta *
+play_update(const struct mpd_status *status, const struct mpd_song *song);
+
+void
+play_free(void);
+
 void
 log_handler(const gchar *domain, GLogLevelFlags level, const gchar *message,
 	gpointer userdata);
@@ -73,37 +247,57 @@ loop_connect(void);
 void
 loop_disconnect(void);
 
-#ifdef HAVE_GMODULE
-int
-module_load(const char *modname, GKeyFile *config_fd);
+bool
+loop_online(void);
+
+#define metrics_now()		g_get_monotonic_time()
+#define metrics_inc(counter)	((counter)->value++)
+
+struct metrics_histogram *
+metrics_histogram(const char *name);
+
+struct metrics_counter *
+metrics_counter(const char *name);
+
+gint64
+metrics_observe(struct metrics_histogram *hist, gint64 start);
 
 void
-module_close(int gclose);
+metrics_histogram_add(struct metrics_histogram *total,
+		const struct metrics_histogram *hist);
 
-int
-module_database_run(const struct mpd_connection *conn, const struct mpd_stats *stats);
+gint64
+metrics_quantile(const struct metrics_histogram *hist, double q);
 
-int
-module_stored_playlist_run(const struct mpd_connection *conn);
+char *
+metrics_dump(void);
 
 int
-module_queue_run(const struct mpd_connection *conn);
+metrics_listen(const char *path);
 
-int
-module_player_run(const struct mpd_connection *conn, const struct mpd_song *song,
-	const struct mpd_status *status);
+void
+metrics_free(void);
 
+#ifdef HAVE_GMODULE
 int
-module_mixer_run(const struct mpd_connection *conn, const struct mpd_status *status);
+module_load(const char *modname, GKeyFile *config_fd);
 
 int
-module_output_run(const struct mpd_connection *conn);
+module_reload(char **names, GKeyFile *config_fd);
+
+void
+module_close(int gclose);
+
+void
+module_dump(void);
 
 int
-module_options_run(const struct mpd_connection *conn, const struct mpd_status *status);
+module_batch_run(const struct mpd_connection *conn, struct event_snapshot *snap,
+		enum mpd_idle events);
 
 int
-module_update_run(const struct mpd_connection *conn, const struct mpd_status *status);
+module_event_run(const struct mpd_connection *conn, enum mpd_idle event,
+		struct event_snapshot *snap);
 #endif /* HAVE_GMODULE */
 
 #endif /* !MPDCRON_GUARD_CRON_DEFS_H */
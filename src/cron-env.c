@@ -19,11 +19,65 @@
 
 #include "cron-defs.h"
 
+#include <stdarg.h>
+#include <string.h>
 #include <time.h>
 
 #include <glib.h>
 #include <mpd/client.h>
 
+extern char **environ;
+
+/* The environment of hooks is built once per wakeup into a single block:
+ * envbuf: Scratch buffer of NUL separated NAME=VALUE strings.
+ * envcount: Number of strings in the scratch buffer.
+ * envp: The NULL terminated vector followed by a copy of the strings.
+ */
+static GString *envbuf = NULL;
+static unsigned envcount = 0;
+static gsize envsize = 0;
+static gchar **envp = NULL;
+
+static void
+env_add(const char *name, const char *value)
+{
+	g_string_append(envbuf, name);
+	g_string_append_c(envbuf, '=');
+	g_string_append(envbuf, value);
+	g_string_append_c(envbuf, '\0');
+	envcount++;
+}
+
+G_GNUC_PRINTF(2, 3)
+static void
+env_addf(const char *name, const char *fmt, ...)
+{
+	va_list args;
+
+	g_string_append(envbuf, name);
+	g_string_append_c(envbuf, '=');
+	va_start(args, fmt);
+	g_string_append_vprintf(envbuf, fmt, args);
+	va_end(args);
+	g_string_append_c(envbuf, '\0');
+	envcount++;
+}
+
+static gchar **
+env_layout(gchar **vec, const char *strings, unsigned count, gsize len)
+{
+	char *p;
+
+	p = (char *)(vec + count + 1);
+	memcpy(p, strings, len);
+	for (unsigned i = 0; i < count; i++) {
+		vec[i] = p;
+		p += strlen(p) + 1;
+	}
+	vec[count] = NULL;
+	return vec;
+}
+
 static const char *
 env_strstate(enum mpd_state state)
 {
@@ -48,163 +102,200 @@ env_strstate(enum mpd_state state)
 	return strstate;
 }
 
-static void
-env_export_status(struct mpd_status *status)
+void
+env_status(const struct mpd_status *status)
 {
-	char *envstr;
 	const struct mpd_audio_format *fmt;
 
-	envstr = g_strdup_printf("%d", mpd_status_get_volume(status));
-	g_setenv("MPD_STATUS_VOLUME", envstr, 1);
-	g_free(envstr);
-
-	envstr = g_strdup_printf("%d", mpd_status_get_repeat(status));
-	g_setenv("MPD_STATUS_REPEAT", envstr, 1);
-	g_free(envstr);
-
-	envstr = g_strdup_printf("%d", mpd_status_get_random(status));
-	g_setenv("MPD_STATUS_RANDOM", envstr, 1);
-	g_free(envstr);
-
-	envstr = g_strdup_printf("%d", mpd_status_get_single(status));
-	g_setenv("MPD_STATUS_SINGLE", envstr, 1);
-	g_free(envstr);
-
-	envstr = g_strdup_printf("%d", mpd_status_get_consume(status));
-	g_setenv("MPD_STATUS_CONSUME", envstr, 1);
-	g_free(envstr);
-
-	envstr = g_strdup_printf("%d", mpd_status_get_queue_length(status));
-	g_setenv("MPD_STATUS_QUEUE_LENGTH", envstr, 1);
-	g_free(envstr);
-
-	envstr = g_strdup_printf("%d", mpd_status_get_queue_version(status));
-	g_setenv("MPD_STATUS_QUEUE_VERSION", envstr, 1);
-	g_free(envstr);
-
-	envstr = g_strdup_printf("%d", mpd_status_get_crossfade(status));
-	g_setenv("MPD_STATUS_CROSSFADE", envstr, 1);
-	g_free(envstr);
-
-	envstr = g_strdup_printf("%d", mpd_status_get_song_pos(status));
-	g_setenv("MPD_STATUS_SONG_POS", envstr, 1);
-	g_free(envstr);
-
-	envstr = g_strdup_printf("%d", mpd_status_get_song_id(status));
-	g_setenv("MPD_STATUS_SONG_ID", envstr, 1);
-	g_free(envstr);
-
-	envstr = g_strdup_printf("%u", mpd_status_get_elapsed_time(status));
-	g_setenv("MPD_STATUS_ELAPSED_TIME", envstr, 1);
-	g_free(envstr);
-
-	envstr = g_strdup_printf("%u", mpd_status_get_elapsed_ms(status));
-	g_setenv("MPD_STATUS_ELAPSED_MS", envstr, 1);
-	g_free(envstr);
-
-	envstr = g_strdup_printf("%u", mpd_status_get_total_time(status));
-	g_setenv("MPD_STATUS_TOTAL_TIME", envstr, 1);
-	g_free(envstr);
-
-	envstr = g_strdup_printf("%u", mpd_status_get_kbit_rate(status));
-	g_setenv("MPD_STATUS_KBIT_RATE", envstr, 1);
-	g_free(envstr);
-
-	envstr = g_strdup_printf("%u", mpd_status_get_update_id(status));
-	g_setenv("MPD_STATUS_UPDATE_ID", envstr, 1);
-	g_free(envstr);
-
-	g_setenv("MPD_STATUS_STATE", env_strstate(mpd_status_get_state(status)), 1);
+	env_addf("MPD_STATUS_VOLUME", "%d", mpd_status_get_volume(status));
+	env_addf("MPD_STATUS_REPEAT", "%d", mpd_status_get_repeat(status));
+	env_addf("MPD_STATUS_RANDOM", "%d", mpd_status_get_random(status));
+	env_addf("MPD_STATUS_SINGLE", "%d", mpd_status_get_single(status));
+	env_addf("MPD_STATUS_CONSUME", "%d", mpd_status_get_consume(status));
+	env_addf("MPD_STATUS_QUEUE_LENGTH", "%d", mpd_status_get_queue_length(status));
+	env_addf("MPD_STATUS_QUEUE_VERSION", "%d", mpd_status_get_queue_version(status));
+	env_addf("MPD_STATUS_CROSSFADE", "%d", mpd_status_get_crossfade(status));
+	env_addf("MPD_STATUS_SONG_POS", "%d", mpd_status_get_song_pos(status));
+	env_addf("MPD_STATUS_SONG_ID", "%d", mpd_status_get_song_id(status));
+	env_addf("MPD_STATUS_ELAPSED_TIME", "%u", mpd_status_get_elapsed_time(status));
+	env_addf("MPD_STATUS_ELAPSED_MS", "%u", mpd_status_get_elapsed_ms(status));
+	env_addf("MPD_STATUS_TOTAL_TIME", "%u", mpd_status_get_total_time(status));
+	env_addf("MPD_STATUS_KBIT_RATE", "%u", mpd_status_get_kbit_rate(status));
+	env_addf("MPD_STATUS_UPDATE_ID", "%u", mpd_status_get_update_id(status));
+	env_add("MPD_STATUS_STATE", env_strstate(mpd_status_get_state(status)));
 
 	if ((fmt = mpd_status_get_audio_format(status)) == NULL)
-		g_setenv("MPD_STATUS_AUDIO_FORMAT", "0", 1);
+		env_add("MPD_STATUS_AUDIO_FORMAT", "0");
 	else {
-		g_setenv("MPD_STATUS_AUDIO_FORMAT", "1", 1);
-
-		envstr = g_strdup_printf("%u", fmt->sample_rate);
-		g_setenv("MPD_STATUS_AUDIO_FORMAT_SAMPLE_RATE", envstr, 1);
-		g_free(envstr);
-
-		envstr = g_strdup_printf("%u", fmt->bits);
-		g_setenv("MPD_STATUS_AUDIO_FORMAT_BITS", envstr, 1);
-		g_free(envstr);
-
-		envstr = g_strdup_printf("%u", fmt->channels);
-		g_setenv("MPD_STATUS_AUDIO_FORMAT_CHANNELS", envstr, 1);
-		g_free(envstr);
+		env_add("MPD_STATUS_AUDIO_FORMAT", "1");
+		env_addf("MPD_STATUS_AUDIO_FORMAT_SAMPLE_RATE", "%u", fmt->sample_rate);
+		env_addf("MPD_STATUS_AUDIO_FORMAT_BITS", "%u", fmt->bits);
+		env_addf("MPD_STATUS_AUDIO_FORMAT_CHANNELS", "%u", fmt->channels);
 	}
 }
 
+static const struct {
+	enum mpd_tag_type type;
+	const char *name;
+} env_tags[] = {
+	{MPD_TAG_ARTIST,			"ARTIST"},
+	{MPD_TAG_ALBUM,				"ALBUM"},
+	{MPD_TAG_ALBUM_ARTIST,			"ALBUM_ARTIST"},
+	{MPD_TAG_TITLE,				"TITLE"},
+	{MPD_TAG_TRACK,				"TRACK"},
+	{MPD_TAG_NAME,				"NAME"},
+	{MPD_TAG_GENRE,				"GENRE"},
+	{MPD_TAG_DATE,				"DATE"},
+	{MPD_TAG_COMPOSER,			"COMPOSER"},
+	{MPD_TAG_PERFORMER,			"PERFORMER"},
+	{MPD_TAG_COMMENT,			"COMMENT"},
+	{MPD_TAG_DISC,				"DISC"},
+	{MPD_TAG_MUSICBRAINZ_ARTISTID,		"MUSICBRAINZ_ARTISTID"},
+	{MPD_TAG_MUSICBRAINZ_ALBUMID,		"MUSICBRAINZ_ALBUMID"},
+	{MPD_TAG_MUSICBRAINZ_ALBUMARTISTID,	"MUSICBRAINZ_ALBUMARTISTID"},
+	{MPD_TAG_MUSICBRAINZ_TRACKID,		"MUSICBRAINZ_TRACKID"},
+};
+
+/* Export song variables with the given prefix, e.g. MPD_SONG or
+ * MPD_SONG_1 */
 static void
-env_export_song(struct mpd_song *song)
+env_export_song(const char *prefix, const struct mpd_song *song)
 {
 	const char *tag;
-	char *envstr;
 	time_t t;
 	struct tm tm;
+	char name[64];
 	char date[DEFAULT_DATE_FORMAT_SIZE] = { 0 };
 
-	g_setenv("MPD_SONG_URI", mpd_song_get_uri(song), 1);
+	g_snprintf(name, sizeof(name), "%s_URI", prefix);
+	env_add(name, mpd_song_get_uri(song));
 
 	t = mpd_song_get_last_modified(song);
 	if (localtime_r(&t, &tm)) {
 		strftime(date, DEFAULT_DATE_FORMAT_SIZE, DEFAULT_DATE_FORMAT, &tm);
-		g_setenv("MPD_SONG_LAST_MODIFIED", date, 1);
+		g_snprintf(name, sizeof(name), "%s_LAST_MODIFIED", prefix);
+		env_add(name, date);
 	}
 
-	envstr = g_strdup_printf("%u", mpd_song_get_duration(song));
-	g_setenv("MPD_SONG_DURATION", envstr, 1);
-	g_free(envstr);
-
-	envstr = g_strdup_printf("%u", mpd_song_get_pos(song));
-	g_setenv("MPD_SONG_POS", envstr, 1);
-	g_free(envstr);
-
-	envstr = g_strdup_printf("%u", mpd_song_get_id(song));
-	g_setenv("MPD_SONG_ID", envstr, 1);
-	g_free(envstr);
+	g_snprintf(name, sizeof(name), "%s_DURATION", prefix);
+	env_addf(name, "%u", mpd_song_get_duration(song));
+	g_snprintf(name, sizeof(name), "%s_POS", prefix);
+	env_addf(name, "%u", mpd_song_get_pos(song));
+	g_snprintf(name, sizeof(name), "%s_ID", prefix);
+	env_addf(name, "%u", mpd_song_get_id(song));
 
 	/* Export tags. FIXME: For now we just export the first tag value to
 	 * the environment.
 	 */
-	if ((tag = mpd_song_get_tag(song, MPD_TAG_ARTIST, 0)) != NULL)
-		g_setenv("MPD_SONG_TAG_ARTIST", tag, 1);
-	if ((tag = mpd_song_get_tag(song, MPD_TAG_ALBUM, 0)) != NULL)
-		g_setenv("MPD_SONG_TAG_ALBUM", tag, 1);
-	if ((tag = mpd_song_get_tag(song, MPD_TAG_ALBUM_ARTIST, 0)) != NULL)
-		g_setenv("MPD_SONG_TAG_ALBUM_ARTIST", tag, 1);
-	if ((tag = mpd_song_get_tag(song, MPD_TAG_TITLE, 0)) != NULL)
-		g_setenv("MPD_SONG_TAG_TITLE", tag, 1);
-	if ((tag = mpd_song_get_tag(song, MPD_TAG_TRACK, 0)) != NULL)
-		g_setenv("MPD_SONG_TAG_TRACK", tag, 1);
-	if ((tag = mpd_song_get_tag(song, MPD_TAG_NAME, 0)) != NULL)
-		g_setenv("MPD_SONG_TAG_NAME", tag, 1);
-	if ((tag = mpd_song_get_tag(song, MPD_TAG_GENRE, 0)) != NULL)
-		g_setenv("MPD_SONG_TAG_GENRE", tag, 1);
-	if ((tag = mpd_song_get_tag(song, MPD_TAG_DATE, 0)) != NULL)
-		g_setenv("MPD_SONG_TAG_DATE", tag, 1);
-	if ((tag = mpd_song_get_tag(song, MPD_TAG_COMPOSER, 0)) != NULL)
-		g_setenv("MPD_SONG_TAG_COMPOSER", tag, 1);
-	if ((tag = mpd_song_get_tag(song, MPD_TAG_PERFORMER, 0)) != NULL)
-		g_setenv("MPD_SONG_TAG_PERFORMER", tag, 1);
-	if ((tag = mpd_song_get_tag(song, MPD_TAG_COMMENT, 0)) != NULL)
-		g_setenv("MPD_SONG_TAG_COMMENT", tag, 1);
-	if ((tag = mpd_song_get_tag(song, MPD_TAG_DISC, 0)) != NULL)
-		g_setenv("MPD_SONG_TAG_DISC", tag, 1);
-	if ((tag = mpd_song_get_tag(song, MPD_TAG_MUSICBRAINZ_ARTISTID, 0)) != NULL)
-		g_setenv("MPD_SONG_TAG_MUSICBRAINZ_ARTISTID", tag, 1);
-	if ((tag = mpd_song_get_tag(song, MPD_TAG_MUSICBRAINZ_ALBUMID, 0)) != NULL)
-		g_setenv("MPD_SONG_TAG_MUSICBRAINZ_ALBUMID", tag, 1);
-	if ((tag = mpd_song_get_tag(song, MPD_TAG_MUSICBRAINZ_ALBUMARTISTID, 0)) != NULL)
-		g_setenv("MPD_SONG_TAG_MUSICBRAINZ_ALBUMARTISTID", tag, 1);
-	if ((tag = mpd_song_get_tag(song, MPD_TAG_MUSICBRAINZ_TRACKID, 0)) != NULL)
-		g_setenv("MPD_SONG_TAG_MUSICBRAINZ_TRACKID", tag, 1);
+	for (unsigned i = 0; i < G_N_ELEMENTS(env_tags); i++) {
+		if ((tag = mpd_song_get_tag(song, env_tags[i].type, 0)) != NULL) {
+			g_snprintf(name, sizeof(name), "%s_TAG_%s",
+					prefix, env_tags[i].name);
+			env_add(name, tag);
+		}
+	}
+}
+
+void
+env_song(const struct mpd_song *song)
+{
+	env_export_song("MPD_SONG", song);
+}
+
+void
+env_queue(const struct mpdcron_queue_delta *delta)
+{
+	unsigned n;
+	char name[64];
+	GString *removed;
+	const struct mpdcron_queue_change *change;
+	static const char *const types[] = {
+		"added", "removed", "moved", "modified",
+	};
+
+	env_addf("MPD_QUEUE_VERSION", "%u", delta->version);
+	env_addf("MPD_QUEUE_OLD_VERSION", "%u", delta->old_version);
+	env_addf("MPD_QUEUE_LENGTH", "%u", delta->length);
+	env_addf("MPD_QUEUE_CHANGES", "%u", delta->count);
+
+	/* Changed songs are exported as MPD_SONG_<n>_*, removed songs as a
+	 * list of ids. Huge changes, like loading a playlist, are truncated
+	 * not to overflow the environment. */
+	n = 0;
+	removed = g_string_new(NULL);
+	for (unsigned i = 0; i < delta->count; i++) {
+		change = &delta->changes[i];
+		if (change->type == MPDCRON_CHANGE_REMOVED) {
+			if (removed->len > 0)
+				g_string_append_c(removed, ' ');
+			g_string_append_printf(removed, "%u", change->id);
+			continue;
+		}
+		if (n >= DEFAULT_QUEUE_ENV_MAX) {
+			env_add("MPD_QUEUE_TRUNCATED", "1");
+			break;
+		}
+		g_snprintf(name, sizeof(name), "MPD_SONG_%u_CHANGE", ++n);
+		env_add(name, types[change->type]);
+		g_snprintf(name, sizeof(name), "MPD_SONG_%u_OLD_POS", n);
+		env_addf(name, "%u", change->old_pos);
+		g_snprintf(name, sizeof(name), "MPD_SONG_%u", n);
+		env_export_song(name, change->song);
+	}
+	if (removed->len > 0)
+		env_add("MPD_QUEUE_REMOVED", removed->str);
+	g_string_free(removed, TRUE);
+}
+
+void
+env_playlists(const struct mpdcron_playlist_delta *delta)
+{
+	char name[64];
+	const struct mpdcron_playlist_change *change;
+	static const char *const types[] = {
+		"added", "removed", "moved", "modified",
+	};
+
+	env_addf("MPD_PLAYLIST_CHANGES", "%u", delta->count);
+	for (unsigned i = 0; i < delta->count; i++) {
+		change = &delta->changes[i];
+		g_snprintf(name, sizeof(name), "MPD_PLAYLIST_%u_CHANGE", i + 1);
+		env_add(name, types[change->type]);
+		g_snprintf(name, sizeof(name), "MPD_PLAYLIST_%u_PATH", i + 1);
+		env_add(name, change->path);
+		if (change->type == MPDCRON_CHANGE_REMOVED)
+			continue;
+		g_snprintf(name, sizeof(name), "MPD_PLAYLIST_%u_LAST_MODIFIED", i + 1);
+		env_addf(name, "%ld", (long)change->last_modified);
+	}
+}
+
+void
+env_outputs(const struct mpdcron_output_delta *delta)
+{
+	char name[64];
+	const struct mpdcron_output_change *change;
+	static const char *const types[] = {
+		"added", "removed", "moved", "modified",
+	};
+
+	env_addf("MPD_OUTPUT_CHANGES", "%u", delta->count);
+	for (unsigned i = 0; i < delta->count; i++) {
+		change = &delta->changes[i];
+		g_snprintf(name, sizeof(name), "MPD_OUTPUT_%u_CHANGE", i + 1);
+		env_add(name, types[change->type]);
+		g_snprintf(name, sizeof(name), "MPD_OUTPUT_%u_ID", i + 1);
+		env_addf(name, "%u", change->id);
+		g_snprintf(name, sizeof(name), "MPD_OUTPUT_%u_NAME", i + 1);
+		env_add(name, change->name);
+		g_snprintf(name, sizeof(name), "MPD_OUTPUT_%u_ENABLED", i + 1);
+		env_add(name, change->enabled ? "1" : "0");
+	}
 }
 
 void
-env_stats(struct mpd_stats *stats)
+env_stats(const struct mpd_stats *stats)
 {
-	char *envstr;
 	time_t t;
 	struct tm tm;
 	char date[DEFAULT_DATE_FORMAT_SIZE] = { 0 };
@@ -212,101 +303,76 @@ env_stats(struct mpd_stats *stats)
 	t = mpd_stats_get_db_update_time(stats);
 	if (localtime_r(&t, &tm)) {
 		strftime(date, DEFAULT_DATE_FORMAT_SIZE, DEFAULT_DATE_FORMAT, &tm);
-		g_setenv("MPD_DATABASE_UPDATE_TIME", date, 1);
+		env_add("MPD_DATABASE_UPDATE_TIME", date);
 	}
 
-	envstr = g_strdup_printf("%d", mpd_stats_get_number_of_artists(stats));
-	g_setenv("MPD_DATABASE_ARTISTS", envstr, 1);
-	g_free(envstr);
-
-	envstr = g_strdup_printf("%d", mpd_stats_get_number_of_albums(stats));
-	g_setenv("MPD_DATABASE_ALBUMS", envstr, 1);
-	g_free(envstr);
+	env_addf("MPD_DATABASE_ARTISTS", "%d", mpd_stats_get_number_of_artists(stats));
+	env_addf("MPD_DATABASE_ALBUMS", "%d", mpd_stats_get_number_of_albums(stats));
+	env_addf("MPD_DATABASE_SONGS", "%d", mpd_stats_get_number_of_songs(stats));
+	env_addf("MPD_DATABASE_PLAY_TIME", "%lu", mpd_stats_get_play_time(stats));
+	env_addf("MPD_DATABASE_UPTIME", "%lu", mpd_stats_get_uptime(stats));
+	env_addf("MPD_DATABASE_DB_PLAY_TIME", "%lu", mpd_stats_get_db_play_time(stats));
+}
 
-	envstr = g_strdup_printf("%d", mpd_stats_get_number_of_songs(stats));
-	g_setenv("MPD_DATABASE_SONGS", envstr, 1);
-	g_free(envstr);
+void
+env_begin(void)
+{
+	if (envbuf == NULL)
+		envbuf = g_string_sized_new(4096);
+	else
+		g_string_truncate(envbuf, 0);
+	envcount = 0;
+
+	g_free(envp);
+	envp = NULL;
+
+	/* Start with the environment of the daemon */
+	for (unsigned i = 0; environ[i] != NULL; i++) {
+		g_string_append_len(envbuf, environ[i], strlen(environ[i]) + 1);
+		envcount++;
+	}
+}
 
-	envstr = g_strdup_printf("%lu", mpd_stats_get_play_time(stats));
-	g_setenv("MPD_DATABASE_PLAY_TIME", envstr, 1);
-	g_free(envstr);
+void
+env_setenv(const char *name, const char *value)
+{
+	env_add(name, value);
+}
 
-	envstr = g_strdup_printf("%lu", mpd_stats_get_uptime(stats));
-	g_setenv("MPD_DATABASE_UPTIME", envstr, 1);
-	g_free(envstr);
+gchar **
+env_end(void)
+{
+	g_assert(envp == NULL);
 
-	envstr = g_strdup_printf("%lu", mpd_stats_get_db_play_time(stats));
-	g_setenv("MPD_DATABASE_DB_PLAY_TIME", envstr, 1);
-	g_free(envstr);
+	envsize = (envcount + 1) * sizeof(gchar *) + envbuf->len;
+	envp = env_layout(g_malloc(envsize), envbuf->str, envcount, envbuf->len);
+	return envp;
 }
 
-void
-env_status(struct mpd_status *status)
+gchar **
+env_envp(void)
 {
-	env_export_status(status);
+	return envp;
 }
 
-void
-env_status_currentsong(struct mpd_song *song, struct mpd_status *status)
+gchar **
+env_dup(void)
 {
-	env_export_status(status);
-	if (song)
-		env_export_song(song);
+	g_assert(envp != NULL);
+
+	return env_layout(g_malloc(envsize), (const char *)(envp + envcount + 1),
+			envcount, envsize - (envcount + 1) * sizeof(gchar *));
 }
 
 void
-env_clearenv(void)
+env_free(void)
 {
-	/* status */
-	g_unsetenv("MPD_STATUS_VOLUME");
-	g_unsetenv("MPD_STATUS_REPEAT");
-	g_unsetenv("MPD_STATUS_RENDOM");
-	g_unsetenv("MPD_STATUS_SINGLE");
-	g_unsetenv("MPD_STATUS_CONSUME");
-	g_unsetenv("MPD_STATUS_QUEUE_LENGTH");
-	g_unsetenv("MPD_STATUS_QUEUE_VERSION");
-	g_unsetenv("MPD_STATUS_CROSSFADE");
-	g_unsetenv("MPD_STATUS_SONG_POS");
-	g_unsetenv("MPD_STATUS_SONG_ID");
-	g_unsetenv("MPD_STATUS_ELAPSED_TIME");
-	g_unsetenv("MPD_STATUS_ELAPSED_MS");
-	g_unsetenv("MPD_STATUS_TOTAL_TIME");
-	g_unsetenv("MPD_STATUS_KBIT_RATE");
-	g_unsetenv("MPD_STATUS_UPDATE_ID");
-	g_unsetenv("MPD_STATUS_STATE");
-	g_unsetenv("MPD_STATUS_AUDIO_FORMAT");
-	g_unsetenv("MPD_STATUS_AUDIO_FORMAT_SAMPLE_RATE");
-	g_unsetenv("MPD_STATUS_AUDIO_FORMAT_BITS");
-	g_unsetenv("MPD_STATUS_AUDIO_FORMAT_CHANNELS");
-
-	/* song */
-	g_unsetenv("MPD_SONG_URI");
-	g_unsetenv("MPD_SONG_TAG_ARTIST");
-	g_unsetenv("MPD_SONG_TAG_ALBUM");
-	g_unsetenv("MPD_SONG_TAG_ALBUM_ARTIST");
-	g_unsetenv("MPD_SONG_TAG_TITLE");
-	g_unsetenv("MPD_SONG_TAG_TRACK");
-	g_unsetenv("MPD_SONG_TAG_NAME");
-	g_unsetenv("MPD_SONG_TAG_GENRE");
-	g_unsetenv("MPD_SONG_TAG_DATE");
-	g_unsetenv("MPD_SONG_TAG_COMPOSER");
-	g_unsetenv("MPD_SONG_TAG_PERFORMER");
-	g_unsetenv("MPD_SONG_TAG_COMMENT");
-	g_unsetenv("MPD_SONG_TAG_DISC");
-	g_unsetenv("MPD_SONG_TAG_MUSICBRAINZ_ARTISTID");
-	g_unsetenv("MPD_SONG_TAG_MUSICBRAINZ_ALBUMID");
-	g_unsetenv("MPD_SONG_TAG_MUSICBRAINZ_ALBUMARTISTID");
-	g_unsetenv("MPD_SONG_TAG_MUSICBRAINZ_TRACKID");
-	g_unsetenv("MPD_SONG_LAST_MODIFIED");
-	g_unsetenv("MPD_SONG_POS");
-	g_unsetenv("MPD_SONG_ID");
-
-	/* stats */
-	g_unsetenv("MPD_DATABASE_UPDATE_TIME");
-	g_unsetenv("MPD_DATABASE_ARTISTS");
-	g_unsetenv("MPD_DATABASE_ALBUMS");
-	g_unsetenv("MPD_DATABASE_SONGS");
-	g_unsetenv("MPD_DATABASE_PLAY_TIME");
-	g_unsetenv("MPD_DATABASE_UPTIME");
-	g_unsetenv("MPD_DATABASE_DB_PLAY_TIME");
+	if (envbuf != NULL) {
+		g_string_free(envbuf, TRUE);
+		envbuf = NULL;
+	}
+	g_free(envp);
+	envp = NULL;
+	envcount = 0;
+	envsize = 0;
 }
@@ -19,37 +19,171 @@
 
 #include "cron-defs.h"
 
+#include <stdbool.h>
+
 #include <glib.h>
 #include <mpd/client.h>
 
+static struct metrics_histogram *run_metrics, *fetch_metrics;
+
+struct event_snapshot *
+event_snapshot_ref(struct event_snapshot *snap)
+{
+	g_atomic_int_inc(&snap->ref);
+	return snap;
+}
+
+void
+event_snapshot_unref(struct event_snapshot *snap)
+{
+	if (!g_atomic_int_dec_and_test(&snap->ref))
+		return;
+
+	if (snap->status != NULL)
+		mpd_status_free(snap->status);
+	if (snap->stats != NULL)
+		mpd_stats_free(snap->stats);
+	if (snap->song != NULL)
+		mpd_song_free(snap->song);
+	g_free(snap);
+}
+
+static bool
+event_snapshot_fetch_list(struct mpd_connection *conn, bool need_status,
+		bool need_stats, bool need_queue, bool need_outputs,
+		bool need_song, struct event_snapshot *snap)
+{
+	GPtrArray *changed, *list;
+	struct mpd_song *song;
+
+	/* Send all the commands we need in one command list so that the
+	 * whole wakeup costs a single round trip.
+	 */
+	g_debug("Sending%s%s%s%s%s commands to Mpd server",
+			need_status ? " status" : "",
+			need_stats ? " stats" : "",
+			need_queue ? " plchanges" : "",
+			need_outputs ? " outputs" : "",
+			need_song ? " currentsong" : "");
+	if (!mpd_command_list_begin(conn, true) ||
+			(need_status && !mpd_send_status(conn)) ||
+			(need_stats && !mpd_send_stats(conn)) ||
+			(need_queue && !mpd_send_queue_changes_meta(conn, queue_version())) ||
+			(need_outputs && !mpd_send_outputs(conn)) ||
+			(need_song && !mpd_send_current_song(conn)) ||
+			!mpd_command_list_end(conn))
+		return false;
+
+	if (need_status) {
+		if ((snap->status = mpd_recv_status(conn)) == NULL)
+			return false;
+		if (!mpd_response_next(conn))
+			return false;
+	}
+
+	if (need_stats) {
+		if ((snap->stats = mpd_recv_stats(conn)) == NULL)
+			return false;
+		if (!mpd_response_next(conn))
+			return false;
+	}
+
+	if (need_queue) {
+		/* Only the songs changed since the version we have */
+		changed = g_ptr_array_new();
+		while ((song = mpd_recv_song(conn)) != NULL)
+			g_ptr_array_add(changed, song);
+		if (mpd_connection_get_error(conn) != MPD_ERROR_SUCCESS ||
+				!mpd_response_next(conn)) {
+			for (unsigned i = 0; i < changed->len; i++)
+				mpd_song_free(g_ptr_array_index(changed, i));
+			g_ptr_array_free(changed, TRUE);
+			return false;
+		}
+		snap->queue = queue_update(snap->status, changed);
+		g_ptr_array_free(changed, TRUE);
+	}
+
+	if (need_outputs) {
+		if ((list = cache_outputs_recv(conn)) == NULL)
+			return false;
+		snap->outputs = cache_outputs_update(list);
+		if (!mpd_response_next(conn))
+			return false;
+	}
+
+	if (need_song) {
+		snap->song = mpd_recv_song(conn);
+		if (snap->song == NULL &&
+				mpd_connection_get_error(conn) != MPD_ERROR_SUCCESS)
+			return false;
+
+		/* Only pass the current song when the player is active. */
+		if (snap->song != NULL &&
+				mpd_status_get_state(snap->status) != MPD_STATE_PLAY &&
+				mpd_status_get_state(snap->status) != MPD_STATE_PAUSE) {
+			mpd_song_free(snap->song);
+			snap->song = NULL;
+		}
+
+		snap->play = play_update(snap->status, snap->song);
+	}
+
+	return mpd_response_finish(conn);
+}
+
+static bool
+event_snapshot_fetch(struct mpd_connection *conn, enum mpd_idle events,
+		struct event_snapshot *snap)
+{
+	bool need_status, need_stats, need_song, need_queue;
+	bool need_playlists, need_outputs, need_list;
+	GPtrArray *list;
+
+	need_stats = !!(events & MPD_IDLE_DATABASE);
+	need_song = !!(events & MPD_IDLE_PLAYER);
+	need_queue = !!(events & MPD_IDLE_QUEUE);
+	need_playlists = !!(events & MPD_IDLE_STORED_PLAYLIST);
+	need_outputs = !!(events & MPD_IDLE_OUTPUT);
+	need_status = !!(events & (MPD_IDLE_PLAYER | MPD_IDLE_MIXER |
+				MPD_IDLE_OPTIONS | MPD_IDLE_UPDATE | MPD_IDLE_QUEUE));
+
+	need_list = need_status || need_stats || need_song || need_outputs;
+
+	if (need_list && !event_snapshot_fetch_list(conn, need_status,
+				need_stats, need_queue, need_outputs,
+				need_song, snap))
+		return false;
+
+	/* Not part of the command list, see cache_playlists_fetch() */
+	if (need_playlists) {
+		if ((list = cache_playlists_fetch(conn)) == NULL)
+			return false;
+		snap->playlists = cache_playlists_update(list);
+	}
+	return true;
+}
+
 static int
-event_database(struct mpd_connection *conn)
+event_database(struct mpd_connection *conn, struct event_snapshot *snap)
 {
 	int ret;
 	const char *name;
-	struct mpd_stats *stats;
 
 	/* Song database has been updated.
-	 * Send stats command and add the variables to the environment.
 	 */
 	name = mpd_idle_name(MPD_IDLE_DATABASE);
 
-	g_debug("Sending stats command to Mpd server");
-	if ((stats = mpd_run_stats(conn)) == NULL)
-		return -1;
-
 	ret = 0;
 #ifdef HAVE_GMODULE
-	ret = module_database_run(conn, stats);
+	ret = module_event_run(conn, MPD_IDLE_DATABASE, snap);
 #endif /* HAVE_GMODULE */
-	env_stats(stats);
 	hooker_run_hook(name);
-	mpd_stats_free(stats);
 	return ret;
 }
 
 static int
-event_stored_playlist(struct mpd_connection *conn)
+event_stored_playlist(struct mpd_connection *conn, struct event_snapshot *snap)
 {
 	int ret;
 	const char *name;
@@ -60,15 +194,14 @@ event_stored_playlist(struct mpd_connection *conn)
 
 	ret = 0;
 #ifdef HAVE_GMODULE
-	/* TODO: Send some data to the module. */
-	ret = module_stored_playlist_run(conn);
+	ret = module_event_run(conn, MPD_IDLE_STORED_PLAYLIST, snap);
 #endif /* HAVE_GMODULE */
 	hooker_run_hook(name);
 	return ret;
 }
 
 static int
-event_queue(struct mpd_connection *conn G_GNUC_UNUSED)
+event_queue(struct mpd_connection *conn, struct event_snapshot *snap)
 {
 	int ret;
 	const char *name;
@@ -79,99 +212,50 @@ event_queue(struct mpd_connection *conn G_GNUC_UNUSED)
 
 	ret = 0;
 #ifdef HAVE_GMODULE
-	/* TODO: Send some data to the module. */
-	ret = module_queue_run(conn);
+	ret = module_event_run(conn, MPD_IDLE_QUEUE, snap);
 #endif /* HAVE_GMODULE */
 	hooker_run_hook(name);
 	return ret;
 }
 
 static int
-event_player(struct mpd_connection *conn)
+event_player(struct mpd_connection *conn, struct event_snapshot *snap)
 {
 	int ret;
 	const char *name;
-	struct mpd_song *song;
-	struct mpd_status *status;
 
 	/* The player state has changed.
-	 * Send status & currentsong command and add the variables to the
-	 * environment.
 	 */
 	name = mpd_idle_name(MPD_IDLE_PLAYER);
 
-	g_debug("Sending status & currentsong commands to Mpd server");
-	if (!mpd_command_list_begin(conn, true) ||
-			!mpd_send_status(conn) ||
-			!mpd_send_current_song(conn) ||
-			!mpd_command_list_end(conn))
-		return -1;
-
-	if ((status = mpd_recv_status(conn)) == NULL)
-		return -1;
-
-	if (mpd_status_get_state(status) == MPD_STATE_PLAY ||
-			mpd_status_get_state(status) == MPD_STATE_PAUSE) {
-		if (!mpd_response_next(conn)) {
-			mpd_status_free(status);
-			return -1;
-		}
-
-		if ((song = mpd_recv_song(conn)) == NULL) {
-			mpd_status_free(status);
-			return -1;
-		}
-	}
-	else
-		song = NULL;
-
-	if (!mpd_response_finish(conn)) {
-		if (song)
-			mpd_song_free(song);
-		mpd_status_free(status);
-		return -1;
-	}
-
 	ret = 0;
 #ifdef HAVE_GMODULE
-	ret = module_player_run(conn, song, status);
+	ret = module_event_run(conn, MPD_IDLE_PLAYER, snap);
 #endif /* HAVE_GMODULE */
-	env_status_currentsong(song, status);
 	hooker_run_hook(name);
-	if (song)
-		mpd_song_free(song);
-	mpd_status_free(status);
 	return ret;
 }
 
 static int
-event_mixer(struct mpd_connection *conn)
+event_mixer(struct mpd_connection *conn, struct event_snapshot *snap)
 {
 	int ret;
 	const char *name;
-	struct mpd_status *status;
 
 	/* The volume has been modified.
-	 * Send status command and add the variables to the environment.
 	 */
 	name = mpd_idle_name(MPD_IDLE_MIXER);
 
-	g_debug("Sending status command to Mpd server");
-	if ((status = mpd_run_status(conn)) == NULL)
-		return -1;
-
 	ret = 0;
 #ifdef HAVE_GMODULE
-	ret = module_mixer_run(conn, status);
+	ret = module_event_run(conn, MPD_IDLE_MIXER, snap);
 #endif /* HAVE_GMODULE */
-	env_status(status);
 	hooker_run_hook(name);
-	mpd_status_free(status);
 	return ret;
 }
 
 static int
-event_output(struct mpd_connection *conn)
+event_output(struct mpd_connection *conn, struct event_snapshot *snap)
 {
 	int ret;
 	const char *name;
@@ -182,87 +266,144 @@ event_output(struct mpd_connection *conn)
 
 	ret = 0;
 #ifdef HAVE_GMODULE
-	/* TODO: Send some data to the module. */
-	ret = module_output_run(conn);
+	ret = module_event_run(conn, MPD_IDLE_OUTPUT, snap);
 #endif /* HAVE_GMODULE */
 	hooker_run_hook(name);
 	return ret;
 }
 
 static int
-event_options(struct mpd_connection *conn)
+event_options(struct mpd_connection *conn, struct event_snapshot *snap)
 {
 	int ret;
 	const char *name;
-	struct mpd_status *status;
 
 	/* One of the options has been modified.
-	 * Send status command and add the variables to the environment.
 	 */
 	name = mpd_idle_name(MPD_IDLE_OPTIONS);
 
-	g_debug("Sending status command to Mpd server");
-	if ((status = mpd_run_status(conn)) == NULL)
-		return -1;
-
 	ret = 0;
 #ifdef HAVE_GMODULE
-	ret = module_options_run(conn, status);
+	ret = module_event_run(conn, MPD_IDLE_OPTIONS, snap);
 #endif /* HAVE_GMODULE */
-	env_status(status);
 	hooker_run_hook(name);
-	mpd_status_free(status);
 	return ret;
 }
 
 static int
-event_update(struct mpd_connection *conn)
+event_update(struct mpd_connection *conn, struct event_snapshot *snap)
 {
 	int ret;
 	const char *name;
-	struct mpd_status *status;
 
 	/* A database update has started or finished.
-	 * Send status command and add the variables to the environment.
 	 */
 	name = mpd_idle_name(MPD_IDLE_UPDATE);
 
-	g_debug("Sending status command to Mpd server");
-	if ((status = mpd_run_status(conn)) == NULL)
-		return -1;
-
 	ret = 0;
 #ifdef HAVE_GMODULE
-	ret = module_update_run(conn, status);
+	ret = module_event_run(conn, MPD_IDLE_UPDATE, snap);
 #endif /* HAVE_GMODULE */
-	env_status(status);
 	hooker_run_hook(name);
-	mpd_status_free(status);
 	return ret;
 }
 
-int
-event_run(struct mpd_connection *conn, enum mpd_idle event)
+static int
+event_run_one(struct mpd_connection *conn, enum mpd_idle event,
+		struct event_snapshot *snap)
 {
 	switch (event) {
 		case MPD_IDLE_DATABASE:
-			return event_database(conn);
+			return event_database(conn, snap);
 		case MPD_IDLE_STORED_PLAYLIST:
-			return event_stored_playlist(conn);
+			return event_stored_playlist(conn, snap);
 		case MPD_IDLE_PLAYER:
-			return event_player(conn);
+			return event_player(conn, snap);
 		case MPD_IDLE_QUEUE:
-			return event_queue(conn);
+			return event_queue(conn, snap);
 		case MPD_IDLE_MIXER:
-			return event_mixer(conn);
+			return event_mixer(conn, snap);
 		case MPD_IDLE_OUTPUT:
-			return event_output(conn);
+			return event_output(conn, snap);
 		case MPD_IDLE_OPTIONS:
-			return event_options(conn);
+			return event_options(conn, snap);
 		case MPD_IDLE_UPDATE:
-			return event_update(conn);
+			return event_update(conn, snap);
 		default:
 			g_warning("Unknown event 0x%x", event);
 			return 0;
 	}
 }
+
+/* Run modules and hooks for the events of a fetched snapshot */
+int
+event_dispatch(struct mpd_connection *conn, enum mpd_idle events,
+		struct event_snapshot *snap)
+{
+	int ret, batch_ret;
+	enum mpd_idle i;
+
+	/* Build the environment once, it's shared by all hooks of this
+	 * wakeup. */
+	env_begin();
+	if (snap->status != NULL)
+		env_status(snap->status);
+	if (snap->song != NULL)
+		env_song(snap->song);
+	if (snap->stats != NULL)
+		env_stats(snap->stats);
+	if (snap->queue != NULL)
+		env_queue(snap->queue);
+	if (snap->playlists != NULL)
+		env_playlists(snap->playlists);
+	if (snap->outputs != NULL)
+		env_outputs(snap->outputs);
+	hooker_count(events);
+	env_end();
+
+	ret = batch_ret = 0;
+#ifdef HAVE_GMODULE
+	/* v2 modules get the whole wakeup in one call. If one of them asks
+	 * for a reconnection, hooks and older modules still run first. */
+	batch_ret = module_batch_run(conn, snap, events);
+#endif /* HAVE_GMODULE */
+	for (unsigned j = 0 ;; j++) {
+		i = 1 << j;
+		if (mpd_idle_name(i) == NULL)
+			break;
+		if (!(events & i))
+			continue;
+		/* Run the appropriate event */
+		if ((ret = event_run_one(conn, i, snap)) < 0)
+			break;
+	}
+	return (batch_ret < 0) ? batch_ret : ret;
+}
+
+int
+event_run(struct mpd_connection *conn, enum mpd_idle events)
+{
+	int ret;
+	gint64 start, fetch_start;
+	struct event_snapshot *snap;
+
+	if (run_metrics == NULL) {
+		run_metrics = metrics_histogram("event.run");
+		fetch_metrics = metrics_histogram("mpd.fetch");
+	}
+	start = metrics_now();
+
+	fetch_start = metrics_now();
+	snap = g_new0(struct event_snapshot, 1);
+	snap->ref = 1;
+	if (!event_snapshot_fetch(conn, events, snap)) {
+		event_snapshot_unref(snap);
+		return -1;
+	}
+	metrics_observe(fetch_metrics, fetch_start);
+
+	ret = event_dispatch(conn, events, snap);
+	event_snapshot_unref(snap);
+	metrics_observe(run_metrics, start);
+	return ret;
+}
@@ -21,20 +21,137 @@
 
 #include <stdbool.h>
 #include <string.h>
+#include <sys/stat.h>
 
 #include <glib.h>
 #include <gmodule.h>
 #include <mpd/client.h>
 
+/* One slot for each bit of enum mpd_idle */
+#define MODULE_EVENT_MAX	32
+
 struct module_data {
 	int user;
+	char *name;
 	char *path;
 	GModule *module;
-	struct mpdcron_module *data;
+
+	/* What the module was loaded from, compared on reload */
+	time_t mtime;
+	off_t size;
+	ino_t ino;
+	char *config;
+
+	/* Description of the module, v1 modules are adapted on load */
+	struct mpdcron_module_v2 *data;
+	struct mpdcron_module *v1;
+
+	/* Callback latencies, one per event and one for batches */
+	struct metrics_histogram *metrics[MODULE_EVENT_MAX];
+	struct metrics_histogram *batch_metrics;
+
+	/* Set when the module asks to be unloaded during dispatch */
+	bool unloaded;
+
+	/* Time budget of a callback in milliseconds, 0 if unlimited, and the
+	 * number of consecutive callbacks over it */
+	int budget;
+	int strikes;
+	bool quarantined;
+
+	/* Worker thread of modules with MPDCRON_MODULE_THREADED or of
+	 * quarantined ones with MPDCRON_MODULE_THREADSAFE */
+	struct module_worker *worker;
+};
+
+/* An event queued for a module worker. It holds a reference to the
+ * snapshot and copies of the deltas, which only live until the next
+ * wakeup. Shared by all threaded modules subscribed to the event. */
+struct module_event {
+	gint ref;
+	enum mpd_idle events;
+	struct event_snapshot *snap;
+	struct mpdcron_queue_delta *queue;
+	struct mpdcron_playlist_delta *playlists;
+	struct mpdcron_output_delta *outputs;
+	struct mpdcron_play_delta *play;
+};
+
+struct module_worker {
+	GThread *thread;
+	GAsyncQueue *queue;
+	unsigned long dropped;
+
+	/* Last non-success return of a callback, handled in the main thread */
+	gint ret;
+};
+
+/* Pushed to a worker to make it exit */
+static struct module_event worker_stop;
+
+struct module_config module_conf = {
+	DEFAULT_MODULE_BUDGET,
+	DEFAULT_MODULE_STRIKES,
+	MODULE_QUARANTINE_DISABLE,
 };
 
 static GSList *modules = NULL;
 
+#ifdef HAVE_BUILTIN_MODULES
+#ifdef BUILTIN_NOTIFICATION
+extern struct mpdcron_module_v2 mpdcron_module_notification;
+#endif /* BUILTIN_NOTIFICATION */
+#ifdef BUILTIN_SCROBBLER
+extern struct mpdcron_module_v2 mpdcron_module_scrobbler;
+#endif /* BUILTIN_SCROBBLER */
+#ifdef BUILTIN_STATS
+extern struct mpdcron_module_v2 mpdcron_module_stats;
+#endif /* BUILTIN_STATS */
+
+/* Standard modules linked into mpdcron, these are used without looking for
+ * a shared object. */
+static const struct {
+	const char *name;
+	struct mpdcron_module_v2 *data;
+} builtins[] = {
+#ifdef BUILTIN_NOTIFICATION
+	{"notification", &mpdcron_module_notification},
+#endif /* BUILTIN_NOTIFICATION */
+#ifdef BUILTIN_SCROBBLER
+	{"scrobbler", &mpdcron_module_scrobbler},
+#endif /* BUILTIN_SCROBBLER */
+#ifdef BUILTIN_STATS
+	{"stats", &mpdcron_module_stats},
+#endif /* BUILTIN_STATS */
+	{NULL, NULL},
+};
+#endif /* HAVE_BUILTIN_MODULES */
+
+/* v1 modules implementing each event, indexed by the bit of enum mpd_idle,
+ * and v2 modules which get a batch per wakeup. Modules which unload
+ * themselves are only marked during dispatch and removed once no dispatch
+ * is running. */
+static GPtrArray *subscribers[MODULE_EVENT_MAX];
+static GPtrArray *batchers;
+static unsigned dispatching;
+static bool reap;
+
+static struct mpdcron_module_v2 *
+module_builtin(
+#ifndef HAVE_BUILTIN_MODULES
+		G_GNUC_UNUSED
+#endif /* !HAVE_BUILTIN_MODULES */
+		const char *modname)
+{
+#ifdef HAVE_BUILTIN_MODULES
+	for (unsigned i = 0; builtins[i].name != NULL; i++) {
+		if (strcmp(builtins[i].name, modname) == 0)
+			return builtins[i].data;
+	}
+#endif /* HAVE_BUILTIN_MODULES */
+	return NULL;
+}
+
 static char *
 module_path(const char *modname, int *user_r)
 {
@@ -69,47 +186,478 @@ module_path(const char *modname, int *user_r)
 	return NULL;
 }
 
+/* Flatten the group of the module so that configuration changes can be
+ * detected on reload. */
+static char *
+module_config(GKeyFile *config_fd, const char *modname)
+{
+	char **keys, *value;
+	GString *dump;
+
+	if (config_fd == NULL ||
+			(keys = g_key_file_get_keys(config_fd, modname, NULL, NULL)) == NULL)
+		return NULL;
+
+	dump = g_string_new("");
+	for (unsigned i = 0; keys[i] != NULL; i++) {
+		value = g_key_file_get_value(config_fd, modname, keys[i], NULL);
+		g_string_append_printf(dump, "%s=%s\n", keys[i],
+				value != NULL ? value : "");
+		g_free(value);
+	}
+	g_strfreev(keys);
+	return g_string_free(dump, FALSE);
+}
+
+/* The budget may be set per module in its group */
 static int
-module_init_one(const char *modname, GKeyFile *config_fd)
+module_budget(GKeyFile *config_fd, const char *modname)
+{
+	int budget;
+	GError *error;
+
+	if (config_fd == NULL || !g_key_file_has_key(config_fd, modname, "budget", NULL))
+		return module_conf.budget;
+
+	error = NULL;
+	budget = g_key_file_get_integer(config_fd, modname, "budget", &error);
+	if (error != NULL) {
+		g_warning("%s.budget not an integer: %s", modname, error->message);
+		g_error_free(error);
+		return module_conf.budget;
+	}
+	if (budget < 0) {
+		g_warning("%s.budget smaller than zero, adjusting to default %d",
+				modname, module_conf.budget);
+		return module_conf.budget;
+	}
+	return budget;
+}
+
+static bool
+module_changed(const struct module_data *mod, GKeyFile *config_fd)
 {
+	int user;
+	bool changed;
+	char *path, *config;
+	struct stat buf;
+
+	/* Built-in modules can only change their configuration */
+	if (mod->module != NULL) {
+		if ((path = module_path(mod->name, &user)) == NULL)
+			return true;
+		changed = (strcmp(path, mod->path) != 0 ||
+				stat(path, &buf) < 0 ||
+				buf.st_mtime != mod->mtime ||
+				buf.st_size != mod->size ||
+				buf.st_ino != mod->ino);
+		g_free(path);
+		if (changed)
+			return true;
+	}
+
+	config = module_config(config_fd, mod->name);
+	changed = (g_strcmp0(config, mod->config) != 0);
+	g_free(config);
+	return changed;
+}
+
+static bool
+module_implements(const struct mpdcron_module *data, enum mpd_idle event)
+{
+	switch (event) {
+	case MPD_IDLE_DATABASE:
+		return data->event_database != NULL;
+	case MPD_IDLE_STORED_PLAYLIST:
+		return data->event_stored_playlist != NULL;
+	case MPD_IDLE_QUEUE:
+		return data->event_queue != NULL;
+	case MPD_IDLE_PLAYER:
+		return data->event_player != NULL;
+	case MPD_IDLE_MIXER:
+		return data->event_mixer != NULL;
+	case MPD_IDLE_OUTPUT:
+		return data->event_output != NULL;
+	case MPD_IDLE_OPTIONS:
+		return data->event_options != NULL;
+	case MPD_IDLE_UPDATE:
+		return data->event_update != NULL;
+	default:
+		return false;
+	}
+}
+
+static void
+module_subscribe(void)
+{
+	enum mpd_idle event;
+	GSList *walk;
 	struct module_data *mod;
 
-	mod = g_new0(struct module_data, 1);
+	for (unsigned j = 0; j < MODULE_EVENT_MAX; j++) {
+		event = 1 << j;
+		if (subscribers[j] == NULL)
+			subscribers[j] = g_ptr_array_new();
+		else
+			g_ptr_array_set_size(subscribers[j], 0);
+
+		for (walk = modules; walk != NULL; walk = g_slist_next(walk)) {
+			mod = (struct module_data *)walk->data;
+			if (!mod->unloaded && mod->v1 != NULL &&
+					(mod->data->events & event))
+				g_ptr_array_add(subscribers[j], mod);
+		}
+	}
+
+	if (batchers == NULL)
+		batchers = g_ptr_array_new();
+	else
+		g_ptr_array_set_size(batchers, 0);
+	for (walk = modules; walk != NULL; walk = g_slist_next(walk)) {
+		mod = (struct module_data *)walk->data;
+		if (!mod->unloaded && mod->v1 == NULL)
+			g_ptr_array_add(batchers, mod);
+	}
+}
+
+static struct mpdcron_module_v2 *
+module_adapt(const struct mpdcron_module *v1)
+{
+	struct mpdcron_module_v2 *data;
+
+	/* The per-event callbacks are called from module_*_run() */
+	data = g_new0(struct mpdcron_module_v2, 1);
+	data->abi_version = MPDCRON_MODULE_ABI_VERSION;
+	data->name = v1->name;
+	/* Older modules have no flags, threading is only for v2 ones */
+	data->flags = 0;
+	data->init = v1->init;
+	data->destroy = v1->destroy;
+	for (unsigned j = 0; j < MODULE_EVENT_MAX; j++) {
+		if (module_implements(v1, 1 << j))
+			data->events |= 1 << j;
+	}
+	return data;
+}
+
+static struct metrics_histogram *
+module_metrics(struct module_data *mod, enum mpd_idle event)
+{
+	int j;
+	char *base, *name;
+	struct metrics_histogram **slot;
+
+	/* Event 0 stands for the batch callback of v2 modules */
+	j = (event != 0) ? g_bit_nth_lsf(event, -1) : -1;
+	slot = (j >= 0) ? &mod->metrics[j] : &mod->batch_metrics;
+	if (*slot == NULL) {
+		if (mod->data->name != NULL)
+			base = g_ascii_strdown(mod->data->name, -1);
+		else
+			base = g_path_get_basename(mod->path);
+		name = g_strdup_printf("module.%s.%s", base,
+				(j >= 0) ? mpd_idle_name(event) : "batch");
+		*slot = metrics_histogram(name);
+		g_free(name);
+		g_free(base);
+	}
+	return *slot;
+}
+
+static struct module_event *
+module_event_new(enum mpd_idle events, struct event_snapshot *snap)
+{
+	struct module_event *ev;
+	struct mpdcron_queue_change *qc;
+	struct mpdcron_playlist_change *pc;
+	struct mpdcron_output_change *oc;
+	struct mpdcron_play_event *pe;
+
+	ev = g_new0(struct module_event, 1);
+	ev->ref = 1;
+	ev->events = events;
+	ev->snap = event_snapshot_ref(snap);
+
+	if ((events & MPD_IDLE_QUEUE) && snap->queue != NULL) {
+		ev->queue = g_new(struct mpdcron_queue_delta, 1);
+		*ev->queue = *snap->queue;
+		qc = g_new(struct mpdcron_queue_change, snap->queue->count);
+		for (unsigned i = 0; i < snap->queue->count; i++) {
+			qc[i] = snap->queue->changes[i];
+			if (qc[i].song != NULL)
+				qc[i].song = mpd_song_dup(qc[i].song);
+		}
+		ev->queue->changes = qc;
+	}
+	if ((events & MPD_IDLE_STORED_PLAYLIST) && snap->playlists != NULL) {
+		ev->playlists = g_new(struct mpdcron_playlist_delta, 1);
+		*ev->playlists = *snap->playlists;
+		pc = g_new(struct mpdcron_playlist_change, snap->playlists->count);
+		for (unsigned i = 0; i < snap->playlists->count; i++) {
+			pc[i] = snap->playlists->changes[i];
+			pc[i].path = g_strdup(pc[i].path);
+		}
+		ev->playlists->changes = pc;
+	}
+	if ((events & MPD_IDLE_OUTPUT) && snap->outputs != NULL) {
+		ev->outputs = g_new(struct mpdcron_output_delta, 1);
+		*ev->outputs = *snap->outputs;
+		oc = g_new(struct mpdcron_output_change, snap->outputs->count);
+		for (unsigned i = 0; i < snap->outputs->count; i++) {
+			oc[i] = snap->outputs->changes[i];
+			oc[i].name = g_strdup(oc[i].name);
+		}
+		ev->outputs->changes = oc;
+	}
+	if ((events & MPD_IDLE_PLAYER) && snap->play != NULL) {
+		ev->play = g_new(struct mpdcron_play_delta, 1);
+		*ev->play = *snap->play;
+		pe = g_new(struct mpdcron_play_event, snap->play->count);
+		for (unsigned i = 0; i < snap->play->count; i++) {
+			pe[i] = snap->play->events[i];
+			pe[i].song = mpd_song_dup(pe[i].song);
+		}
+		ev->play->events = pe;
+	}
+	return ev;
+}
+
+static void
+module_event_unref(struct module_event *ev)
+{
+	if (!g_atomic_int_dec_and_test(&ev->ref))
+		return;
+
+	if (ev->queue != NULL) {
+		for (unsigned i = 0; i < ev->queue->count; i++) {
+			if (ev->queue->changes[i].song != NULL)
+				mpd_song_free((struct mpd_song *)ev->queue->changes[i].song);
+		}
+		g_free((gpointer)ev->queue->changes);
+		g_free(ev->queue);
+	}
+	if (ev->playlists != NULL) {
+		for (unsigned i = 0; i < ev->playlists->count; i++)
+			g_free((gpointer)ev->playlists->changes[i].path);
+		g_free((gpointer)ev->playlists->changes);
+		g_free(ev->playlists);
+	}
+	if (ev->outputs != NULL) {
+		for (unsigned i = 0; i < ev->outputs->count; i++)
+			g_free((gpointer)ev->outputs->changes[i].name);
+		g_free((gpointer)ev->outputs->changes);
+		g_free(ev->outputs);
+	}
+	if (ev->play != NULL) {
+		for (unsigned i = 0; i < ev->play->count; i++)
+			mpd_song_free((struct mpd_song *)ev->play->events[i].song);
+		g_free((gpointer)ev->play->events);
+		g_free(ev->play);
+	}
+	event_snapshot_unref(ev->snap);
+	g_free(ev);
+}
+
+static void
+module_batch_fill(struct mpdcron_event_batch *batch, enum mpd_idle events,
+		const struct event_snapshot *snap)
+{
+	batch->events = events;
+	batch->status = snap->status;
+	batch->song = snap->song;
+	batch->stats = snap->stats;
+	batch->queue = (events & MPD_IDLE_QUEUE) ? snap->queue : NULL;
+	batch->playlists = (events & MPD_IDLE_STORED_PLAYLIST) ? snap->playlists : NULL;
+	batch->outputs = (events & MPD_IDLE_OUTPUT) ? snap->outputs : NULL;
+	batch->play = (events & MPD_IDLE_PLAYER) ? snap->play : NULL;
+}
+
+static int
+module_event_call(const struct module_data *mod, const struct module_event *ev)
+{
+	struct mpdcron_event_batch batch;
+
+	/* Only v2 modules run on a worker. They don't get the connection,
+	 * it belongs to the main thread. */
+	module_batch_fill(&batch, ev->events & mod->data->events, ev->snap);
+	/* Deltas are replaced with the copies made for the worker */
+	if (batch.queue != NULL)
+		batch.queue = ev->queue;
+	if (batch.playlists != NULL)
+		batch.playlists = ev->playlists;
+	if (batch.outputs != NULL)
+		batch.outputs = ev->outputs;
+	if (batch.play != NULL)
+		batch.play = ev->play;
+	return (mod->data->event)(NULL, &batch);
+}
+
+static gboolean module_worker_poll(gpointer data);
+
+static gpointer
+module_worker_run(gpointer data)
+{
+	int mret;
+	bool unloaded;
+	gint64 start;
+	struct module_event *ev;
+	struct module_data *mod = (struct module_data *)data;
+
+	unloaded = false;
+	while ((ev = g_async_queue_pop(mod->worker->queue)) != &worker_stop) {
+		if (!unloaded) {
+			start = metrics_now();
+			mret = module_event_call(mod, ev);
+			metrics_observe(mod->batch_metrics, start);
+			if (mret != MPDCRON_EVENT_SUCCESS) {
+				/* Let the main thread handle it */
+				unloaded = (mret == MPDCRON_EVENT_UNLOAD);
+				g_atomic_int_set(&mod->worker->ret, mret);
+				g_idle_add(module_worker_poll, NULL);
+			}
+		}
+		module_event_unref(ev);
+	}
+	return NULL;
+}
+
+static void
+module_worker_start(struct module_data *mod)
+{
+	/* The histogram is created here, the worker only updates it */
+	module_metrics(mod, 0);
+
+	mod->worker = g_new0(struct module_worker, 1);
+	mod->worker->queue = g_async_queue_new();
+	mod->worker->thread = g_thread_new(mod->path, module_worker_run, mod);
+	g_debug("Started worker thread for module `%s'", mod->path);
+}
+
+static void
+module_worker_stop(struct module_data *mod)
+{
+	struct module_event *ev;
+
+	/* Drop the backlog so that joining waits for the current callback
+	 * only. Events are pushed from the main thread, none can come in
+	 * between. */
+	while ((ev = g_async_queue_try_pop(mod->worker->queue)) != NULL)
+		module_event_unref(ev);
+	g_async_queue_push(mod->worker->queue, &worker_stop);
+	g_thread_join(mod->worker->thread);
+	g_async_queue_unref(mod->worker->queue);
+	g_free(mod->worker);
+	mod->worker = NULL;
+}
+
+static void
+module_worker_push(struct module_data *mod, struct module_event *ev)
+{
+	struct module_event *old;
+	struct module_worker *worker = mod->worker;
+
+	/* The module can't keep up, drop the oldest event. */
+	if (g_async_queue_length(worker->queue) >= DEFAULT_MODULE_QUEUE) {
+		if ((old = g_async_queue_try_pop(worker->queue)) != NULL)
+			module_event_unref(old);
+		if (++worker->dropped % 100 == 1)
+			g_warning("Module `%s' is falling behind, %lu events dropped",
+					mod->path, worker->dropped);
+	}
+
+	g_atomic_int_inc(&ev->ref);
+	g_async_queue_push(worker->queue, ev);
+}
+
+/* Find the description of the module, built-in modules are preferred over
+ * shared objects so that they don't cost a lookup in the filesystem. */
+static int
+module_open(struct module_data *mod, const char *modname)
+{
+	if ((mod->data = module_builtin(modname)) != NULL) {
+		g_debug("Using built-in module %s", modname);
+		mod->path = g_strdup_printf("builtin:%s", modname);
+		return 0;
+	}
+
 	if ((mod->path = module_path(modname, &(mod->user))) == NULL) {
 		g_warning("Error loading module %s: file not found",
 				modname);
-		g_free(mod);
 		return -1;
 	}
 	if ((mod->module = g_module_open(mod->path, G_MODULE_BIND_LOCAL)) == NULL) {
 		g_warning("Error loading module `%s': %s",
 				mod->path, g_module_error());
 		g_free(mod->path);
-		g_free(mod);
 		return -1;
 	}
-	if (!g_module_symbol(mod->module, "module", (gpointer *)&mod->data) || mod->data == NULL) {
+	if (g_module_symbol(mod->module, "mpdcron_module", (gpointer *)&mod->data) &&
+			mod->data != NULL) {
+		if (mod->data->abi_version != MPDCRON_MODULE_ABI_VERSION ||
+				mod->data->event == NULL) {
+			g_warning("Error loading module `%s': unsupported ABI version %u",
+					mod->path, mod->data->abi_version);
+			g_module_close(mod->module);
+			g_free(mod->path);
+			return -1;
+		}
+	}
+	else if (g_module_symbol(mod->module, "module", (gpointer *)&mod->v1) &&
+			mod->v1 != NULL) {
+		g_debug("Module `%s' uses ABI version 1", mod->path);
+		mod->data = module_adapt(mod->v1);
+	}
+	else {
 		g_warning("Error loading module `%s': no module structure",
 				mod->path);
 		g_module_close(mod->module);
 		g_free(mod->path);
+		return -1;
+	}
+	return 0;
+}
+
+static int
+module_init_one(const char *modname, GKeyFile *config_fd)
+{
+	struct stat buf;
+	struct module_data *mod;
+
+	mod = g_new0(struct module_data, 1);
+	if (module_open(mod, modname) < 0) {
 		g_free(mod);
 		return -1;
 	}
+	if (mod->v1 == NULL && mod->data->events == 0)
+		mod->data->events = ~0;
 
 	/* Run the init() function if there's any. */
 	if (mod->data->init != NULL) {
 		if ((mod->data->init)(&conf, config_fd) == MPDCRON_INIT_FAILURE) {
 			g_warning("Skipped loading module `%s': init() returned %d",
 					mod->path, MPDCRON_INIT_FAILURE);
+			if (mod->v1 != NULL)
+				g_free(mod->data);
 			g_free(mod->path);
-			g_module_close(mod->module);
+			if (mod->module != NULL)
+				g_module_close(mod->module);
 			g_free(mod);
 			return -1;
 		}
 	}
+	mod->name = g_strdup(modname);
+	mod->config = module_config(config_fd, modname);
+	mod->budget = module_budget(config_fd, modname);
+	if (mod->module != NULL && stat(mod->path, &buf) == 0) {
+		mod->mtime = buf.st_mtime;
+		mod->size = buf.st_size;
+		mod->ino = buf.st_ino;
+	}
 	g_debug("Loaded module `%s'", mod->path);
+	if (mod->data->flags & MPDCRON_MODULE_THREADED)
+		module_worker_start(mod);
 	modules = g_slist_prepend(modules, mod);
+	module_subscribe();
 	return 0;
 }
 
@@ -122,17 +670,57 @@ module_destroy_one(gpointer data, gpointer userdata)
 	mod = (struct module_data *)data;
 	gclose = GPOINTER_TO_INT(userdata);
 
+	/* Let the worker finish the callback it's running */
+	if (mod->worker != NULL)
+		module_worker_stop(mod);
+
 	/* Run the destroy function if there's any */
 	if (mod->data->destroy != NULL)
 		(mod->data->destroy)();
+	if (mod->v1 != NULL)
+		g_free(mod->data);
+	g_free(mod->name);
 	g_free(mod->path);
-	if (gclose)
+	g_free(mod->config);
+	if (gclose && mod->module != NULL)
 		g_module_close(mod->module);
 	g_free(mod);
 }
 
+static void
+module_reap(void)
+{
+	GSList *walk, *next;
+	struct module_data *mod;
+
+	for (walk = modules; walk != NULL; walk = next) {
+		next = g_slist_next(walk);
+		mod = (struct module_data *)walk->data;
+		if (!mod->unloaded)
+			continue;
+		modules = g_slist_delete_link(modules, walk);
+		module_destroy_one(mod, NULL);
+	}
+	reap = false;
+	module_subscribe();
+}
+
+static GPtrArray *
+module_dispatch_begin(enum mpd_idle event)
+{
+	++dispatching;
+	return subscribers[g_bit_nth_lsf(event, -1)];
+}
+
+static void
+module_dispatch_end(void)
+{
+	if (--dispatching == 0 && reap)
+		module_reap();
+}
+
 static int
-module_process_ret(int ret, struct module_data *mod, GSList **slink_r, GSList **slist_r)
+module_process_ret(int ret, struct module_data *mod)
 {
 	switch (ret) {
 	case MPDCRON_EVENT_SUCCESS:
@@ -151,10 +739,8 @@ module_process_ret(int ret, struct module_data *mod, GSList **slink_r, GSList **
 		g_message("Unloading %s module `%s'",
 				mod->user ? "user" : "standard",
 				mod->path);
-		*slist_r = g_slist_remove_link(*slist_r, *slink_r);
-		module_destroy_one(mod, NULL);
-		g_slist_free(*slink_r);
-		*slink_r = *slist_r;
+		mod->unloaded = true;
+		reap = true;
 		return 0;
 	default:
 		g_warning("Unknown return from %s module `%s': %d",
@@ -165,177 +751,336 @@ module_process_ret(int ret, struct module_data *mod, GSList **slink_r, GSList **
 	}
 }
 
-int
-module_load(const char *modname, GKeyFile *config_fd)
+static void
+module_quarantine(struct module_data *mod, gint64 elapsed)
 {
-	return module_init_one(modname, config_fd);
+	switch (module_conf.quarantine) {
+	case MODULE_QUARANTINE_THREAD:
+		/* Modules which didn't declare themselves thread-safe expect
+		 * the main thread and a connection, unload them instead. */
+		if (mod->data->flags & MPDCRON_MODULE_THREADSAFE) {
+			g_warning("Module `%s' took %" G_GINT64_FORMAT "ms, over its budget of %dms"
+					" %d times in a row, moving it to a worker thread",
+					mod->path, elapsed / 1000, mod->budget, mod->strikes);
+			module_worker_start(mod);
+			break;
+		}
+		/* fall through */
+	case MODULE_QUARANTINE_DISABLE:
+	default:
+		g_warning("Module `%s' took %" G_GINT64_FORMAT "ms, over its budget of %dms"
+				" %d times in a row, unloading it",
+				mod->path, elapsed / 1000, mod->budget, mod->strikes);
+		mod->unloaded = true;
+		reap = true;
+		break;
+	}
+	mod->quarantined = true;
+	mod->strikes = 0;
 }
 
-void
-module_close(int gclose)
+/* Record the latency of a callback run in the main thread and quarantine
+ * modules which keep blocking it for longer than their budget. */
+static void
+module_observe(struct module_data *mod, struct metrics_histogram *hist, gint64 start)
 {
-	g_slist_foreach(modules, module_destroy_one, GINT_TO_POINTER(gclose));
-	g_slist_free(modules);
-	modules = NULL;
+	gint64 elapsed;
+
+	elapsed = metrics_observe(hist, start);
+	if (mod->budget == 0 || mod->worker != NULL)
+		return;
+	if (elapsed <= (gint64)mod->budget * 1000) {
+		mod->strikes = 0;
+		return;
+	}
+
+	g_debug("Module `%s' took %" G_GINT64_FORMAT "ms, over its budget of %dms",
+			mod->path, elapsed / 1000, mod->budget);
+	if (++mod->strikes >= module_conf.strikes)
+		module_quarantine(mod, elapsed);
 }
 
-int
-module_database_run(const struct mpd_connection *conn, const struct mpd_stats *stats)
+static gboolean
+module_worker_poll(G_GNUC_UNUSED gpointer data)
 {
-	int mret, ret;
+	int mret;
 	GSList *walk;
 	struct module_data *mod;
 
-	ret = 0;
 	for (walk = modules; walk != NULL; walk = g_slist_next(walk)) {
 		mod = (struct module_data *)walk->data;
-		if (mod->data->event_database == NULL)
+		if (mod->worker == NULL ||
+				(mret = g_atomic_int_get(&mod->worker->ret)) == 0 ||
+				!g_atomic_int_compare_and_exchange(&mod->worker->ret, mret, 0))
 			continue;
-		mret = (mod->data->event_database)(conn,stats);
-		ret = module_process_ret(mret, mod, &walk, &modules);
-		if (ret < 0 && mret == MPDCRON_EVENT_RECONNECT_NOW)
-			break;
+		if (mret == MPDCRON_EVENT_RECONNECT || mret == MPDCRON_EVENT_RECONNECT_NOW)
+			g_message("Threaded module `%s' can't schedule reconnect, ignoring",
+					mod->path);
+		else
+			module_process_ret(mret, mod);
 	}
-	return ret;
+	if (dispatching == 0 && reap)
+		module_reap();
+	return FALSE;
 }
 
 int
-module_stored_playlist_run(const struct mpd_connection *conn)
+module_load(const char *modname, GKeyFile *config_fd)
 {
-	int mret, ret;
-	GSList *walk;
-	struct module_data *mod;
+	return module_init_one(modname, config_fd);
+}
 
-	ret = 0;
-	for (walk = modules; walk != NULL; walk = g_slist_next(walk)) {
-		mod = (struct module_data *)walk->data;
-		if (mod->data->event_stored_playlist == NULL)
-			continue;
-		mret = (mod->data->event_stored_playlist)(conn);
-		ret = module_process_ret(mret, mod, &walk, &modules);
-		if (ret < 0 && mret == MPDCRON_EVENT_RECONNECT_NOW)
-			break;
+static bool
+module_listed(char **names, const char *modname)
+{
+	for (unsigned i = 0; names != NULL && names[i] != NULL; i++) {
+		if (strcmp(names[i], modname) == 0)
+			return true;
 	}
-	return ret;
+	return false;
 }
 
-int
-module_queue_run(const struct mpd_connection *conn)
+static struct module_data *
+module_find(const char *modname)
 {
-	int mret, ret;
 	GSList *walk;
 	struct module_data *mod;
 
-	ret = 0;
 	for (walk = modules; walk != NULL; walk = g_slist_next(walk)) {
 		mod = (struct module_data *)walk->data;
-		if (mod->data->event_queue == NULL)
-			continue;
-		mret = (mod->data->event_queue)(conn);
-		ret = module_process_ret(mret, mod, &walk, &modules);
-		if (ret < 0 && mret == MPDCRON_EVENT_RECONNECT_NOW)
-			break;
+		if (strcmp(mod->name, modname) == 0)
+			return mod;
 	}
-	return ret;
+	return NULL;
 }
 
 int
-module_player_run(const struct mpd_connection *conn, const struct mpd_song *song,
-		const struct mpd_status *status)
+module_reload(char **names, GKeyFile *config_fd)
 {
-	int mret, ret;
-	GSList *walk;
+	int ret;
+	bool listed;
+	GSList *walk, *next;
 	struct module_data *mod;
 
-	ret = 0;
-	for (walk = modules; walk != NULL; walk = g_slist_next(walk)) {
+	g_assert(dispatching == 0);
+
+	/* Unload modules which were removed from the list or changed on disk
+	 * or in the configuration file, the rest keep running untouched. */
+	for (walk = modules; walk != NULL; walk = next) {
+		next = g_slist_next(walk);
 		mod = (struct module_data *)walk->data;
-		if (mod->data->event_player == NULL)
+		listed = module_listed(names, mod->name);
+		if (listed && !mod->unloaded && !module_changed(mod, config_fd)) {
+			/* main.module_budget may have changed */
+			mod->budget = module_budget(config_fd, mod->name);
 			continue;
-		mret = (mod->data->event_player)(conn, song, status);
-		ret = module_process_ret(mret, mod, &walk, &modules);
-		if (ret < 0 && mret == MPDCRON_EVENT_RECONNECT_NOW)
-			break;
+		}
+		g_message("%s %s module `%s'",
+				(listed && !mod->unloaded) ? "Reloading" : "Unloading",
+				mod->user ? "user" : "standard",
+				mod->path);
+		modules = g_slist_delete_link(modules, walk);
+		module_destroy_one(mod, GINT_TO_POINTER(1));
+	}
+	reap = false;
+	module_subscribe();
+
+	ret = 0;
+	for (unsigned i = 0; names != NULL && names[i] != NULL; i++) {
+		if (module_find(names[i]) == NULL &&
+				module_init_one(names[i], config_fd) < 0)
+			ret = -1;
 	}
 	return ret;
 }
 
-int
-module_mixer_run(const struct mpd_connection *conn, const struct mpd_status *status)
+void
+module_close(int gclose)
 {
-	int mret, ret;
-	GSList *walk;
-	struct module_data *mod;
+	g_slist_foreach(modules, module_destroy_one, GINT_TO_POINTER(gclose));
+	g_slist_free(modules);
+	modules = NULL;
 
-	ret = 0;
-	for (walk = modules; walk != NULL; walk = g_slist_next(walk)) {
-		mod = (struct module_data *)walk->data;
-		if (mod->data->event_mixer == NULL)
-			continue;
-		mret = (mod->data->event_mixer)(conn, status);
-		ret = module_process_ret(mret, mod, &walk, &modules);
-		if (ret < 0 && mret == MPDCRON_EVENT_RECONNECT_NOW)
-			break;
+	for (unsigned j = 0; j < MODULE_EVENT_MAX; j++) {
+		if (subscribers[j] != NULL) {
+			g_ptr_array_free(subscribers[j], TRUE);
+			subscribers[j] = NULL;
+		}
+	}
+	if (batchers != NULL) {
+		g_ptr_array_free(batchers, TRUE);
+		batchers = NULL;
 	}
-	return ret;
 }
 
-int
-module_output_run(const struct mpd_connection *conn)
+void
+module_dump(void)
 {
-	int mret, ret;
 	GSList *walk;
 	struct module_data *mod;
+	struct metrics_histogram *hist, total;
 
-	ret = 0;
 	for (walk = modules; walk != NULL; walk = g_slist_next(walk)) {
 		mod = (struct module_data *)walk->data;
-		if (mod->data->event_output == NULL)
-			continue;
-		mret = (mod->data->event_output)(conn);
-		ret = module_process_ret(mret, mod, &walk, &modules);
-		if (ret < 0 && mret == MPDCRON_EVENT_RECONNECT_NOW)
-			break;
+
+		/* Sum up the histograms of all callbacks */
+		memset(&total, 0, sizeof(struct metrics_histogram));
+		for (int j = -1; j < MODULE_EVENT_MAX; j++) {
+			hist = (j < 0) ? mod->batch_metrics : mod->metrics[j];
+			if (hist == NULL)
+				continue;
+			metrics_histogram_add(&total, hist);
+		}
+
+		g_message("Module `%s': %" G_GUINT64_FORMAT " calls, total %" G_GINT64_FORMAT "ms,"
+				" p99 %" G_GINT64_FORMAT "us, max %" G_GINT64_FORMAT "us,"
+				" budget %dms, %s%s",
+				mod->path, total.count, total.sum / 1000,
+				metrics_quantile(&total, 0.99), total.max,
+				mod->budget,
+				mod->worker != NULL ? "threaded" : "main thread",
+				mod->quarantined ? ", quarantined" : "");
 	}
-	return ret;
 }
 
 int
-module_options_run(const struct mpd_connection *conn, const struct mpd_status *status)
+module_batch_run(const struct mpd_connection *conn, struct event_snapshot *snap,
+		enum mpd_idle events)
 {
 	int mret, ret;
-	GSList *walk;
+	gint64 start;
+	enum mpd_idle mine;
 	struct module_data *mod;
+	struct module_event *ev;
+	struct mpdcron_event_batch batch;
 
 	ret = 0;
-	for (walk = modules; walk != NULL; walk = g_slist_next(walk)) {
-		mod = (struct module_data *)walk->data;
-		if (mod->data->event_options == NULL)
+	ev = NULL;
+	++dispatching;
+	for (unsigned i = 0; batchers != NULL && i < batchers->len; i++) {
+		mod = (struct module_data *)g_ptr_array_index(batchers, i);
+		if (mod->unloaded || (mine = (events & mod->data->events)) == 0)
+			continue;
+		if (mod->worker != NULL) {
+			if (ev == NULL)
+				ev = module_event_new(events, snap);
+			module_worker_push(mod, ev);
 			continue;
-		mret = (mod->data->event_options)(conn, status);
-		ret = module_process_ret(mret, mod, &walk, &modules);
+		}
+		module_batch_fill(&batch, mine, snap);
+		start = metrics_now();
+		mret = (mod->data->event)(conn, &batch);
+		module_observe(mod, module_metrics(mod, 0), start);
+		ret = module_process_ret(mret, mod);
 		if (ret < 0 && mret == MPDCRON_EVENT_RECONNECT_NOW)
 			break;
 	}
+	if (ev != NULL)
+		module_event_unref(ev);
+	module_dispatch_end();
 	return ret;
 }
 
+/* Call the v1 callback of an event, in the order of the bits of
+ * enum mpd_idle */
+typedef int (*module_call_func)(const struct mpdcron_module *v1,
+		const struct mpd_connection *conn,
+		const struct event_snapshot *snap);
+
+static int
+module_call_database(const struct mpdcron_module *v1,
+		const struct mpd_connection *conn, const struct event_snapshot *snap)
+{
+	return (v1->event_database)(conn, snap->stats);
+}
+
+static int
+module_call_stored_playlist(const struct mpdcron_module *v1,
+		const struct mpd_connection *conn, const struct event_snapshot *snap)
+{
+	return (v1->event_stored_playlist)(conn);
+}
+
+static int
+module_call_queue(const struct mpdcron_module *v1,
+		const struct mpd_connection *conn, const struct event_snapshot *snap)
+{
+	return (v1->event_queue)(conn);
+}
+
+static int
+module_call_player(const struct mpdcron_module *v1,
+		const struct mpd_connection *conn, const struct event_snapshot *snap)
+{
+	return (v1->event_player)(conn, snap->song, snap->status);
+}
+
+static int
+module_call_mixer(const struct mpdcron_module *v1,
+		const struct mpd_connection *conn, const struct event_snapshot *snap)
+{
+	return (v1->event_mixer)(conn, snap->status);
+}
+
+static int
+module_call_output(const struct mpdcron_module *v1,
+		const struct mpd_connection *conn, const struct event_snapshot *snap)
+{
+	return (v1->event_output)(conn);
+}
+
+static int
+module_call_options(const struct mpdcron_module *v1,
+		const struct mpd_connection *conn, const struct event_snapshot *snap)
+{
+	return (v1->event_options)(conn, snap->status);
+}
+
+static int
+module_call_update(const struct mpdcron_module *v1,
+		const struct mpd_connection *conn, const struct event_snapshot *snap)
+{
+	return (v1->event_update)(conn, snap->status);
+}
+
+static const module_call_func module_calls[] = {
+	module_call_database,
+	module_call_stored_playlist,
+	module_call_queue,
+	module_call_player,
+	module_call_mixer,
+	module_call_output,
+	module_call_options,
+	module_call_update,
+};
+
 int
-module_update_run(const struct mpd_connection *conn, const struct mpd_status *status)
+module_event_run(const struct mpd_connection *conn, enum mpd_idle event,
+		struct event_snapshot *snap)
 {
 	int mret, ret;
-	GSList *walk;
+	gint j;
+	gint64 start;
+	GPtrArray *subs;
 	struct module_data *mod;
 
+	j = g_bit_nth_lsf(event, -1);
+	g_assert(j >= 0 && (unsigned)j < G_N_ELEMENTS(module_calls));
+
+	/* v1 modules always run on the main thread */
 	ret = 0;
-	for (walk = modules; walk != NULL; walk = g_slist_next(walk)) {
-		mod = (struct module_data *)walk->data;
-		if (mod->data->event_update == NULL)
+	subs = module_dispatch_begin(event);
+	for (unsigned i = 0; subs != NULL && i < subs->len; i++) {
+		mod = (struct module_data *)g_ptr_array_index(subs, i);
+		if (mod->unloaded)
 			continue;
-		mret = (mod->data->event_update)(conn, status);
-		ret = module_process_ret(mret, mod, &walk, &modules);
+		start = metrics_now();
+		mret = module_calls[j](mod->v1, conn, snap);
+		module_observe(mod, module_metrics(mod, event), start);
+		ret = module_process_ret(mret, mod);
 		if (ret < 0 && mret == MPDCRON_EVENT_RECONNECT_NOW)
 			break;
 	}
+	module_dispatch_end();
 	return ret;
 }
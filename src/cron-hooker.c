@@ -19,77 +19,615 @@
 
 #include "cron-defs.h"
 
-#include <limits.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
 #include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/wait.h>
 
 #include <glib.h>
 
-/* Count the number of hook calls */
-static struct hook_calls {
-	const char *name;
-	const char *env;
-	unsigned int ncalls;
-} calls[] = {
-	{"database",		"MC_CALLS_DATABASE",		0},
-	{"stored_playlist",	"MC_CALLS_STORED_PLAYLIST",	0},
-	{"queue",		"MC_CALLS_QUEUE",		0},
-	{"playlist",		"MC_CALLS_PLAYLIST",		0},
-	{"player",		"MC_CALLS_PLAYER",		0},
-	{"mixer",		"MC_CALLS_MIXER",		0},
-	{"output",		"MC_CALLS_OUTPUT",		0},
-	{"options",		"MC_CALLS_OPTIONS",		0},
-	{"update",		"MC_CALLS_UPDATE",		0},
-	{NULL,			NULL,				0},
+/* One slot for each bit of enum mpd_idle */
+#define HOOK_EVENT_MAX	32
+
+/* Count the number of hook calls, exported as MC_CALLS_<EVENT> */
+static struct metrics_counter *calls[HOOK_EVENT_MAX];
+static char *calls_env[HOOK_EVENT_MAX];
+
+struct hooker_config hooker_conf = {
+	DEFAULT_HOOK_CONCURRENCY,
+	DEFAULT_HOOK_QUEUE,
+	HOOK_POLICY_DROP_OLDEST,
+	DEFAULT_HOOK_TIMEOUT,
+	DEFAULT_HOOK_BACKLOG,
+};
+
+/* Hook execution pools, bounding the running instances of every hook */
+struct hook_pool {
+	char *name;
+	unsigned running;
+	GSList *children;
+
+	/* Environments of the events waiting for a free slot, see env_dup() */
+	GQueue *pending;
+	unsigned long dropped;
+
+	struct metrics_histogram *spawn, *run;
+};
+
+struct hook_child {
+	struct hook_pool *pool;
+	GPid pid;
+	bool terminated;
+	gint64 started;
+	guint child_sid, timeout_sid;
+};
+
+static GHashTable *pools = NULL;
+
+/* Persistent hooks, started once and fed events on their standard input */
+struct hook_worker {
+	char *name;
+	GPid pid;
+	int fd;
+	time_t started;
+	unsigned delay;
+	guint child_sid, write_sid, restart_sid;
+
+	/* Pending records, the first one is partially written if offset > 0 */
+	GQueue *queue;
+	gsize offset;
+	unsigned backlog;
+	unsigned long dropped;
+
+	struct metrics_histogram *send;
 };
 
+static GSList *workers = NULL;
+
+static bool hooker_worker_spawn(struct hook_worker *worker);
+
+static struct hook_worker *
+hooker_worker_find(const char *name)
+{
+	GSList *walk;
+	struct hook_worker *worker;
+
+	for (walk = workers; walk != NULL; walk = g_slist_next(walk)) {
+		worker = (struct hook_worker *)walk->data;
+		if (strcmp(worker->name, name) == 0)
+			return worker;
+	}
+	return NULL;
+}
+
 static void
-hooker_increment(const char *name)
-{
-	char *envstr;
-
-	for (unsigned int i = 0; calls[i].name != NULL; i++) {
-		if (strcmp(name, calls[i].name) == 0) {
-			envstr = g_strdup_printf("%u", ++calls[i].ncalls);
-			g_setenv(calls[i].env, envstr, 1);
-			g_debug("Setting environment variable %s=%s", calls[i].env, envstr);
-			g_free(envstr);
-			if (calls[i].ncalls == UINT_MAX) {
-				g_debug("Resetting counter for %s", calls[i].env);
-				calls[i].ncalls = 0;
-			}
-			break;
+hooker_worker_close(struct hook_worker *worker)
+{
+	if (worker->write_sid != 0) {
+		g_source_remove(worker->write_sid);
+		worker->write_sid = 0;
+	}
+	if (worker->fd >= 0) {
+		close(worker->fd);
+		worker->fd = -1;
+	}
+	/* A partially written record is useless to the next instance */
+	if (worker->offset > 0) {
+		g_free(g_queue_pop_head(worker->queue));
+		worker->offset = 0;
+	}
+}
+
+static gboolean
+hooker_worker_restart(gpointer data)
+{
+	struct hook_worker *worker = (struct hook_worker *)data;
+
+	worker->restart_sid = 0;
+	if (!hooker_worker_spawn(worker)) {
+		worker->delay = MIN(worker->delay * 2, DEFAULT_HOOK_RESTART_MAX);
+		g_message("Restarting persistent hook %s in %u seconds",
+				worker->name, worker->delay);
+		worker->restart_sid = g_timeout_add_seconds(worker->delay,
+				hooker_worker_restart, worker);
+	}
+	return FALSE;
+}
+
+static void
+hooker_worker_exited(GPid pid, gint status, gpointer data)
+{
+	struct hook_worker *worker = (struct hook_worker *)data;
+
+	g_spawn_close_pid(pid);
+	worker->child_sid = 0;
+	worker->pid = 0;
+	hooker_worker_close(worker);
+
+	if (WIFSIGNALED(status))
+		g_warning("Persistent hook %s was terminated by signal %d",
+				worker->name, WTERMSIG(status));
+	else
+		g_warning("Persistent hook %s exited with code %d",
+				worker->name, WEXITSTATUS(status));
+
+	/* Back off if it keeps on dying right after being started */
+	if (time(NULL) - worker->started >= DEFAULT_HOOK_RESTART_MAX)
+		worker->delay = 1;
+	else
+		worker->delay = MIN(worker->delay * 2, DEFAULT_HOOK_RESTART_MAX);
+
+	g_message("Restarting persistent hook %s in %u seconds",
+			worker->name, worker->delay);
+	worker->restart_sid = g_timeout_add_seconds(worker->delay,
+			hooker_worker_restart, worker);
+}
+
+static gboolean
+hooker_worker_flush(G_GNUC_UNUSED GIOChannel *source,
+		G_GNUC_UNUSED GIOCondition condition,
+		gpointer data)
+{
+	gsize len;
+	ssize_t n;
+	const char *record;
+	struct hook_worker *worker = (struct hook_worker *)data;
+
+	while ((record = g_queue_peek_head(worker->queue)) != NULL) {
+		len = strlen(record) - worker->offset;
+		n = write(worker->fd, record + worker->offset, len);
+		if (n < 0) {
+			if (errno == EAGAIN || errno == EINTR)
+				return TRUE;
+			/* The child watch takes care of restarting it */
+			g_debug("Failed to write to persistent hook %s: %s",
+					worker->name, g_strerror(errno));
+			worker->write_sid = 0;
+			return FALSE;
 		}
+		if ((gsize)n < len) {
+			worker->offset += n;
+			return TRUE;
+		}
+		g_free(g_queue_pop_head(worker->queue));
+		worker->offset = 0;
 	}
+
+	worker->write_sid = 0;
+	return FALSE;
 }
 
-int
-hooker_run_hook(const char *name)
+static void
+hooker_worker_schedule_flush(struct hook_worker *worker)
 {
+	GIOChannel *channel;
+
+	if (worker->fd < 0 || worker->write_sid != 0)
+		return;
+
+	channel = g_io_channel_unix_new(worker->fd);
+	worker->write_sid = g_io_add_watch(channel, G_IO_OUT | G_IO_ERR | G_IO_HUP,
+			hooker_worker_flush, worker);
+	g_io_channel_unref(channel);
+}
+
+static bool
+hooker_worker_spawn(struct hook_worker *worker)
+{
+	int flags;
 	gchar **myargv;
 	GError *error;
 
-	hooker_increment(name);
+	g_assert(worker->pid == 0);
+	g_assert(worker->fd < 0);
 
 	myargv = g_malloc(2 * sizeof(gchar *));
-	myargv[0] = g_build_filename(DOT_HOOKS, name, NULL);
+	myargv[0] = g_build_filename(DOT_HOOKS, worker->name, NULL);
+	myargv[1] = NULL;
+
+	g_debug("Starting persistent hook: %s home directory: %s",
+			myargv[0], conf.home_path);
+
+	error = NULL;
+	if (!g_spawn_async_with_pipes(conf.home_path, myargv, NULL,
+				G_SPAWN_LEAVE_DESCRIPTORS_OPEN | G_SPAWN_DO_NOT_REAP_CHILD,
+				NULL, NULL, &worker->pid, &worker->fd, NULL, NULL,
+				&error)) {
+		g_warning("Failed to start persistent hook %s: %s",
+				worker->name, error->message);
+		g_free(myargv[0]);
+		g_free(myargv);
+		g_error_free(error);
+		worker->pid = 0;
+		worker->fd = -1;
+		return false;
+	}
+	g_free(myargv[0]);
+	g_free(myargv);
+
+	/* Never block the main loop on a slow hook, and don't leak the pipe
+	 * to other hooks or the hook would never see end of file. */
+	flags = fcntl(worker->fd, F_GETFL);
+	fcntl(worker->fd, F_SETFL, flags | O_NONBLOCK);
+	fcntl(worker->fd, F_SETFD, FD_CLOEXEC);
+
+	worker->started = time(NULL);
+	worker->child_sid = g_child_watch_add(worker->pid, hooker_worker_exited, worker);
+	if (!g_queue_is_empty(worker->queue))
+		hooker_worker_schedule_flush(worker);
+	return true;
+}
+
+/* Serialize the event as a single line:
+ * name<TAB>KEY=VALUE<TAB>KEY=VALUE...<NEWLINE>
+ * Values are escaped using g_strescape() so they contain no tabs or
+ * newlines.
+ */
+static char *
+hooker_worker_record(const char *name)
+{
+	char *esc, *sep;
+	gchar **envp;
+	GString *record;
+
+	record = g_string_new(name);
+	envp = env_envp();
+	for (unsigned int i = 0; envp != NULL && envp[i] != NULL; i++) {
+		if (!g_str_has_prefix(envp[i], "MPD_") &&
+				!g_str_has_prefix(envp[i], "MC_"))
+			continue;
+		if ((sep = strchr(envp[i], '=')) == NULL)
+			continue;
+		esc = g_strescape(sep + 1, NULL);
+		g_string_append_c(record, '\t');
+		g_string_append_len(record, envp[i], sep - envp[i] + 1);
+		g_string_append(record, esc);
+		g_free(esc);
+	}
+	g_string_append_c(record, '\n');
+	return g_string_free(record, FALSE);
+}
+
+static void
+hooker_worker_send(struct hook_worker *worker, const char *name)
+{
+	GList *link;
+
+	/* The hook can't keep up, drop the oldest pending record. */
+	if (g_queue_get_length(worker->queue) >= worker->backlog) {
+		/* The first record may be partially written, keep it. */
+		link = g_queue_peek_head_link(worker->queue);
+		if (worker->offset > 0)
+			link = link->next;
+		if (link != NULL) {
+			g_free(link->data);
+			g_queue_delete_link(worker->queue, link);
+		}
+		if (++worker->dropped % 100 == 1)
+			g_warning("Persistent hook %s is falling behind, %lu events dropped",
+					worker->name, worker->dropped);
+	}
+
+	g_queue_push_tail(worker->queue, hooker_worker_record(name));
+	hooker_worker_schedule_flush(worker);
+}
+
+static void
+hooker_worker_free(gpointer data, G_GNUC_UNUSED gpointer userdata)
+{
+	struct hook_worker *worker = (struct hook_worker *)data;
+
+	if (worker->restart_sid != 0)
+		g_source_remove(worker->restart_sid);
+	if (worker->child_sid != 0)
+		g_source_remove(worker->child_sid);
+	hooker_worker_close(worker);
+	/* Closing the pipe is the signal to exit, the child is reaped by init
+	 * once we're gone. */
+	if (worker->pid != 0)
+		g_spawn_close_pid(worker->pid);
+
+	while (!g_queue_is_empty(worker->queue))
+		g_free(g_queue_pop_head(worker->queue));
+	g_queue_free(worker->queue);
+	g_free(worker->name);
+	g_free(worker);
+}
+
+static bool hooker_pool_spawn(struct hook_pool *pool, gchar **envp);
+
+static void
+hooker_pool_next(struct hook_pool *pool)
+{
+	gchar **envp;
+
+	while (pool->running < (unsigned)hooker_conf.concurrency &&
+			(envp = g_queue_pop_head(pool->pending)) != NULL) {
+		hooker_pool_spawn(pool, envp);
+		g_free(envp);
+	}
+}
+
+static void
+hooker_child_exited(GPid pid, gint status, gpointer data)
+{
+	struct hook_child *child = (struct hook_child *)data;
+	struct hook_pool *pool = child->pool;
+
+	g_spawn_close_pid(pid);
+	if (child->timeout_sid != 0)
+		g_source_remove(child->timeout_sid);
+	metrics_observe(pool->run, child->started);
+
+	if (WIFSIGNALED(status))
+		g_debug("Hook %s (pid %d) was terminated by signal %d",
+				pool->name, pid, WTERMSIG(status));
+	else if (WEXITSTATUS(status) != 0)
+		g_debug("Hook %s (pid %d) exited with code %d",
+				pool->name, pid, WEXITSTATUS(status));
+
+	pool->children = g_slist_remove(pool->children, child);
+	pool->running--;
+	g_free(child);
+
+	hooker_pool_next(pool);
+}
+
+static gboolean
+hooker_child_timeout(gpointer data)
+{
+	struct hook_child *child = (struct hook_child *)data;
+
+	if (!child->terminated) {
+		g_warning("Hook %s (pid %d) timed out after %d seconds, terminating",
+				child->pool->name, child->pid, hooker_conf.timeout);
+		kill(child->pid, SIGTERM);
+		child->terminated = true;
+		child->timeout_sid = g_timeout_add_seconds(conf.killwait,
+				hooker_child_timeout, child);
+	}
+	else {
+		g_warning("Hook %s (pid %d) didn't exit, killing",
+				child->pool->name, child->pid);
+		kill(child->pid, SIGKILL);
+		child->timeout_sid = 0;
+	}
+	return FALSE;
+}
+
+static bool
+hooker_pool_spawn(struct hook_pool *pool, gchar **envp)
+{
+	GPid pid;
+	gchar **myargv;
+	GError *error;
+	struct hook_child *child;
+
+	myargv = g_malloc(2 * sizeof(gchar *));
+	myargv[0] = g_build_filename(DOT_HOOKS, pool->name, NULL);
 	myargv[1] = NULL;
 
 	g_debug("Running hook: %s home directory: %s", myargv[0], conf.home_path);
 
 	error = NULL;
-	if (!g_spawn_async(conf.home_path, myargv, NULL,
-				G_SPAWN_LEAVE_DESCRIPTORS_OPEN | G_SPAWN_CHILD_INHERITS_STDIN,
-				NULL, NULL, NULL, &error)) {
+	if (!g_spawn_async(conf.home_path, myargv, envp,
+				G_SPAWN_LEAVE_DESCRIPTORS_OPEN | G_SPAWN_CHILD_INHERITS_STDIN |
+				G_SPAWN_DO_NOT_REAP_CHILD,
+				NULL, NULL, &pid, &error)) {
 		if (error->code != G_SPAWN_ERROR_NOENT && error->code != G_SPAWN_ERROR_NOEXEC)
-			g_warning("Failed to execute hook %s: %s", name, error->message);
+			g_warning("Failed to execute hook %s: %s", pool->name, error->message);
 		else
-			g_debug("Failed to execute hook %s: %s", name, error->message);
+			g_debug("Failed to execute hook %s: %s", pool->name, error->message);
 		g_free(myargv[0]);
 		g_free(myargv);
 		g_error_free(error);
-		return -1;
+		return false;
 	}
 	g_free(myargv[0]);
 	g_free(myargv);
+
+	child = g_new0(struct hook_child, 1);
+	child->pool = pool;
+	child->pid = pid;
+	child->started = metrics_now();
+	child->child_sid = g_child_watch_add(pid, hooker_child_exited, child);
+	if (hooker_conf.timeout > 0)
+		child->timeout_sid = g_timeout_add_seconds(hooker_conf.timeout,
+				hooker_child_timeout, child);
+
+	pool->children = g_slist_prepend(pool->children, child);
+	pool->running++;
+	return true;
+}
+
+static void
+hooker_pool_enqueue(struct hook_pool *pool)
+{
+	gchar **envp;
+	bool full;
+
+	full = g_queue_get_length(pool->pending) >= (unsigned)hooker_conf.queue;
+	switch (hooker_conf.policy) {
+	case HOOK_POLICY_MERGE:
+		/* All pending events are of the same kind, the latest one
+		 * carries the latest state. */
+		if ((envp = g_queue_pop_tail(pool->pending)) != NULL) {
+			g_debug("Merging pending %s hook", pool->name);
+			g_free(envp);
+			full = false;
+		}
+		break;
+	case HOOK_POLICY_DROP_NEWEST:
+		if (full) {
+			if (++pool->dropped % 100 == 1)
+				g_warning("Hook %s is falling behind, %lu events dropped",
+						pool->name, pool->dropped);
+			return;
+		}
+		break;
+	case HOOK_POLICY_DROP_OLDEST:
+	default:
+		break;
+	}
+
+	if (full) {
+		g_free(g_queue_pop_head(pool->pending));
+		if (++pool->dropped % 100 == 1)
+			g_warning("Hook %s is falling behind, %lu events dropped",
+					pool->name, pool->dropped);
+	}
+
+	/* Save the environment, it'll be gone by the time the hook runs */
+	g_queue_push_tail(pool->pending, env_dup());
+}
+
+static void
+hooker_pool_free(gpointer data)
+{
+	GSList *walk;
+	struct hook_child *child;
+	struct hook_pool *pool = (struct hook_pool *)data;
+
+	/* Leave running hooks alone, init reaps them once we're gone. */
+	for (walk = pool->children; walk != NULL; walk = g_slist_next(walk)) {
+		child = (struct hook_child *)walk->data;
+		g_source_remove(child->child_sid);
+		if (child->timeout_sid != 0)
+			g_source_remove(child->timeout_sid);
+		g_spawn_close_pid(child->pid);
+		g_free(child);
+	}
+	g_slist_free(pool->children);
+
+	while (!g_queue_is_empty(pool->pending))
+		g_free(g_queue_pop_head(pool->pending));
+	g_queue_free(pool->pending);
+	g_free(pool->name);
+	g_free(pool);
+}
+
+
+int
+hooker_persistent_start(const char *name)
+{
+	char *key;
+	struct hook_worker *worker;
+
+	if (hooker_worker_find(name) != NULL) {
+		g_debug("Persistent hook %s already started", name);
+		return 0;
+	}
+
+	worker = g_new0(struct hook_worker, 1);
+	worker->name = g_strdup(name);
+	worker->fd = -1;
+	worker->delay = 1;
+	worker->backlog = hooker_conf.backlog;
+	worker->queue = g_queue_new();
+	key = g_strdup_printf("hook.%s.send", name);
+	worker->send = metrics_histogram(key);
+	g_free(key);
+	workers = g_slist_prepend(workers, worker);
+
+	if (!hooker_worker_spawn(worker)) {
+		g_message("Restarting persistent hook %s in %u seconds",
+				worker->name, worker->delay);
+		worker->restart_sid = g_timeout_add_seconds(worker->delay,
+				hooker_worker_restart, worker);
+		return -1;
+	}
 	return 0;
 }
+
+void
+hooker_count(enum mpd_idle events)
+{
+	enum mpd_idle i;
+	const char *name;
+	char *key, envstr[32];
+
+	for (unsigned j = 0; j < HOOK_EVENT_MAX; j++) {
+		i = 1 << j;
+		if ((name = mpd_idle_name(i)) == NULL)
+			break;
+		if (calls[j] == NULL) {
+			key = g_strdup_printf("calls.%s", name);
+			calls[j] = metrics_counter(key);
+			g_free(key);
+			key = g_ascii_strup(name, -1);
+			calls_env[j] = g_strdup_printf("MC_CALLS_%s", key);
+			g_free(key);
+		}
+		if (events & i)
+			metrics_inc(calls[j]);
+
+		/* Export every counter, not only the ones of this wakeup */
+		if (calls[j]->value == 0)
+			continue;
+		snprintf(envstr, sizeof(envstr), "%" G_GUINT64_FORMAT, calls[j]->value);
+		env_setenv(calls_env[j], envstr);
+	}
+}
+
+void
+hooker_close(void)
+{
+	g_slist_foreach(workers, hooker_worker_free, NULL);
+	g_slist_free(workers);
+	workers = NULL;
+
+	if (pools != NULL) {
+		g_hash_table_destroy(pools);
+		pools = NULL;
+	}
+}
+
+int
+hooker_run_hook(const char *name)
+{
+	bool ret;
+	char *key;
+	gint64 start;
+	struct hook_pool *pool;
+	struct hook_worker *worker;
+
+	if ((worker = hooker_worker_find(name)) != NULL) {
+		g_debug("Sending event to persistent hook: %s", name);
+		start = metrics_now();
+		hooker_worker_send(worker, name);
+		metrics_observe(worker->send, start);
+		return 0;
+	}
+
+	if (pools == NULL)
+		pools = g_hash_table_new_full(g_str_hash, g_str_equal,
+				NULL, hooker_pool_free);
+	if ((pool = g_hash_table_lookup(pools, name)) == NULL) {
+		pool = g_new0(struct hook_pool, 1);
+		pool->name = g_strdup(name);
+		pool->pending = g_queue_new();
+		key = g_strdup_printf("hook.%s.spawn", name);
+		pool->spawn = metrics_histogram(key);
+		g_free(key);
+		key = g_strdup_printf("hook.%s.run", name);
+		pool->run = metrics_histogram(key);
+		g_free(key);
+		g_hash_table_insert(pools, pool->name, pool);
+	}
+
+	if (pool->running >= (unsigned)hooker_conf.concurrency) {
+		g_debug("Hook %s has %u running instances, queueing",
+				name, pool->running);
+		hooker_pool_enqueue(pool);
+		return 0;
+	}
+
+	start = metrics_now();
+	ret = hooker_pool_spawn(pool, env_envp());
+	metrics_observe(pool->spawn, start);
+	return ret ? 0 : -1;
+}
@@ -19,9 +19,139 @@
 
 #include "cron-defs.h"
 
+#include <string.h>
+
 #include <glib.h>
 #include <mpd/client.h>
 
+/* Persistent hooks started from the configuration file */
+static char **persistent_hooks = NULL;
+
+/* Reset the options which may be reloaded to their defaults, so that
+ * removing an option from the configuration file restores its default. */
+static void
+keyfile_defaults(void)
+{
+	conf.killwait = DEFAULT_PID_KILL_WAIT;
+	conf.loglevel = DEFAULT_LOG_LEVEL;
+	conf.reconnect = DEFAULT_MPD_RECONNECT;
+	conf.reconnect_max = DEFAULT_MPD_RECONNECT_MAX;
+	conf.timeout = DEFAULT_MPD_TIMEOUT;
+	conf.coalesce = DEFAULT_MPD_COALESCE;
+	conf.pool = DEFAULT_MPD_POOL;
+
+	hooker_conf.concurrency = DEFAULT_HOOK_CONCURRENCY;
+	hooker_conf.queue = DEFAULT_HOOK_QUEUE;
+	hooker_conf.policy = HOOK_POLICY_DROP_OLDEST;
+	hooker_conf.timeout = DEFAULT_HOOK_TIMEOUT;
+	hooker_conf.backlog = DEFAULT_HOOK_BACKLOG;
+
+#ifdef HAVE_GMODULE
+	module_conf.budget = DEFAULT_MODULE_BUDGET;
+	module_conf.strikes = DEFAULT_MODULE_STRIKES;
+	module_conf.quarantine = MODULE_QUARANTINE_DISABLE;
+#endif /* HAVE_GMODULE */
+}
+
+static int
+keyfile_load_integer(GKeyFile *cfd, const char *group, const char *key,
+		int def, int min, int *value_r)
+{
+	GError *error;
+
+	error = NULL;
+	*value_r = g_key_file_get_integer(cfd, group, key, &error);
+	if (error != NULL) {
+		switch (error->code) {
+		case G_KEY_FILE_ERROR_INVALID_VALUE:
+			g_warning("%s.%s not an integer: %s", group, key, error->message);
+			g_error_free(error);
+			return -1;
+		default:
+			g_error_free(error);
+			*value_r = def;
+			break;
+		}
+	}
+
+	if (*value_r < min) {
+		g_warning("%s smaller than %d, adjusting to default %d",
+				key, min, def);
+		*value_r = def;
+	}
+	return 0;
+}
+
+static int
+keyfile_load_hook_options(GKeyFile *cfd)
+{
+	char *policy;
+
+	/* Get hooks.concurrency, hooks.queue, hooks.timeout, hooks.backlog */
+	if (keyfile_load_integer(cfd, "hooks", "concurrency",
+				DEFAULT_HOOK_CONCURRENCY, 1, &hooker_conf.concurrency) < 0 ||
+			keyfile_load_integer(cfd, "hooks", "queue",
+				DEFAULT_HOOK_QUEUE, 1, &hooker_conf.queue) < 0 ||
+			keyfile_load_integer(cfd, "hooks", "timeout",
+				DEFAULT_HOOK_TIMEOUT, 0, &hooker_conf.timeout) < 0 ||
+			keyfile_load_integer(cfd, "hooks", "backlog",
+				DEFAULT_HOOK_BACKLOG, 1, &hooker_conf.backlog) < 0)
+		return -1;
+
+	/* Get hooks.policy */
+	hooker_conf.policy = HOOK_POLICY_DROP_OLDEST;
+	if ((policy = g_key_file_get_string(cfd, "hooks", "policy", NULL)) != NULL) {
+		g_strstrip(policy);
+		if (strcmp(policy, "drop-oldest") == 0)
+			hooker_conf.policy = HOOK_POLICY_DROP_OLDEST;
+		else if (strcmp(policy, "drop-newest") == 0)
+			hooker_conf.policy = HOOK_POLICY_DROP_NEWEST;
+		else if (strcmp(policy, "merge") == 0)
+			hooker_conf.policy = HOOK_POLICY_MERGE;
+		else {
+			g_warning("Unrecognized hook queue policy: %s", policy);
+			g_free(policy);
+			return -1;
+		}
+		g_free(policy);
+	}
+
+	return 0;
+}
+
+#ifdef HAVE_GMODULE
+static int
+keyfile_load_module_options(GKeyFile *cfd)
+{
+	char *quarantine;
+
+	/* Get main.module_budget, main.module_strikes */
+	if (keyfile_load_integer(cfd, "main", "module_budget",
+				DEFAULT_MODULE_BUDGET, 0, &module_conf.budget) < 0 ||
+			keyfile_load_integer(cfd, "main", "module_strikes",
+				DEFAULT_MODULE_STRIKES, 1, &module_conf.strikes) < 0)
+		return -1;
+
+	/* Get main.module_quarantine */
+	module_conf.quarantine = MODULE_QUARANTINE_DISABLE;
+	if ((quarantine = g_key_file_get_string(cfd, "main", "module_quarantine", NULL)) != NULL) {
+		g_strstrip(quarantine);
+		if (strcmp(quarantine, "disable") == 0)
+			module_conf.quarantine = MODULE_QUARANTINE_DISABLE;
+		else if (strcmp(quarantine, "thread") == 0)
+			module_conf.quarantine = MODULE_QUARANTINE_THREAD;
+		else {
+			g_warning("Unrecognized module quarantine: %s", quarantine);
+			g_free(quarantine);
+			return -1;
+		}
+		g_free(quarantine);
+	}
+
+	return 0;
+}
+#endif /* HAVE_GMODULE */
+
 int
 keyfile_load(GKeyFile **cfd_r)
 {
@@ -29,6 +159,8 @@ keyfile_load(GKeyFile **cfd_r)
 	char **events;
 	GError *error;
 
+	keyfile_defaults();
+
 	error = NULL;
 	if (!g_key_file_load_from_file(*cfd_r, conf.conf_path, G_KEY_FILE_NONE, &error)) {
 		switch (error->code) {
@@ -37,13 +169,6 @@ keyfile_load(GKeyFile **cfd_r)
 			g_debug("Configuration file `%s' not found, skipping",
 					conf.conf_path);
 			g_error_free(error);
-
-			/* Set defaults */
-			conf.killwait = DEFAULT_PID_KILL_WAIT;
-			conf.loglevel = DEFAULT_LOG_LEVEL;
-			conf.reconnect = DEFAULT_MPD_RECONNECT;
-			conf.timeout = DEFAULT_MPD_TIMEOUT;
-
 			return 0;
 		default:
 			g_critical("Failed to parse configuration file `%s': %s",
@@ -57,6 +182,16 @@ keyfile_load(GKeyFile **cfd_r)
 	if (conf.pid_path == NULL)
 		conf.pid_path = g_key_file_get_string(*cfd_r, "main", "pidfile", NULL);
 
+	/* Get main.metrics_socket */
+	if ((conf.metrics_path = g_key_file_get_string(*cfd_r, "main", "metrics_socket", NULL)) != NULL) {
+		g_strstrip(conf.metrics_path);
+		if (!g_path_is_absolute(conf.metrics_path)) {
+			char *path = g_build_filename(conf.home_path, conf.metrics_path, NULL);
+			g_free(conf.metrics_path);
+			conf.metrics_path = path;
+		}
+	}
+
 	/* Get main.killwait */
 	error = NULL;
 	conf.killwait = g_key_file_get_integer(*cfd_r, "main", "killwait", &error);
@@ -122,6 +257,28 @@ keyfile_load(GKeyFile **cfd_r)
 	g_setenv("MCOPT_RECONNECT", optstr, 1);
 	g_free(optstr);
 
+	/* Get mpd.reconnect_max */
+	error = NULL;
+	conf.reconnect_max = g_key_file_get_integer(*cfd_r, "mpd", "reconnect_max", &error);
+	if (error != NULL) {
+		switch (error->code) {
+		case G_KEY_FILE_ERROR_INVALID_VALUE:
+			g_warning("mpd.reconnect_max not an integer: %s", error->message);
+			g_error_free(error);
+			return -1;
+		default:
+			g_error_free(error);
+			conf.reconnect_max = DEFAULT_MPD_RECONNECT_MAX;
+			break;
+		}
+	}
+
+	if (conf.reconnect_max < conf.reconnect) {
+		g_warning("reconnect_max smaller than reconnect, adjusting to %d",
+				conf.reconnect);
+		conf.reconnect_max = conf.reconnect;
+	}
+
 	/* Get mpd.timeout */
 	error = NULL;
 	conf.timeout = g_key_file_get_integer(*cfd_r, "mpd", "timeout", &error);
@@ -148,6 +305,50 @@ keyfile_load(GKeyFile **cfd_r)
 	g_setenv("MCOPT_TIMEOUT", optstr, 1);
 	g_free(optstr);
 
+	/* Get mpd.coalesce */
+	error = NULL;
+	conf.coalesce = g_key_file_get_integer(*cfd_r, "mpd", "coalesce", &error);
+	if (error != NULL) {
+		switch (error->code) {
+		case G_KEY_FILE_ERROR_INVALID_VALUE:
+			g_warning("mpd.coalesce not an integer: %s", error->message);
+			g_error_free(error);
+			return -1;
+		default:
+			g_error_free(error);
+			conf.coalesce = DEFAULT_MPD_COALESCE;
+			break;
+		}
+	}
+
+	if (conf.coalesce < 0) {
+		g_warning("coalesce smaller than zero, adjusting to default %d",
+				DEFAULT_MPD_COALESCE);
+		conf.coalesce = DEFAULT_MPD_COALESCE;
+	}
+
+	/* Get mpd.pool */
+	error = NULL;
+	conf.pool = g_key_file_get_integer(*cfd_r, "mpd", "pool", &error);
+	if (error != NULL) {
+		switch (error->code) {
+		case G_KEY_FILE_ERROR_INVALID_VALUE:
+			g_warning("mpd.pool not an integer: %s", error->message);
+			g_error_free(error);
+			return -1;
+		default:
+			g_error_free(error);
+			conf.pool = DEFAULT_MPD_POOL;
+			break;
+		}
+	}
+
+	if (conf.pool < 0) {
+		g_warning("pool smaller than zero, adjusting to default %d",
+				DEFAULT_MPD_POOL);
+		conf.pool = DEFAULT_MPD_POOL;
+	}
+
 	/* Get mpd.events */
 	if ((events = g_key_file_get_string_list(*cfd_r, "mpd", "events", NULL, NULL)) != NULL) {
 		for (unsigned int i = 0; events[i] != NULL; i++) {
@@ -160,6 +361,57 @@ keyfile_load(GKeyFile **cfd_r)
 		g_strfreev(events);
 	}
 
+	/* Get hook options */
+	if (keyfile_load_hook_options(*cfd_r) < 0)
+		return -1;
+
+#ifdef HAVE_GMODULE
+	/* Get module options */
+	if (keyfile_load_module_options(*cfd_r) < 0)
+		return -1;
+#endif /* HAVE_GMODULE */
+
+	return 0;
+}
+
+int
+keyfile_load_hooks(GKeyFile **cfd_r)
+{
+	char **hooks;
+
+	g_assert(*cfd_r != NULL);
+
+	/* Start persistent hooks */
+	if ((hooks = g_key_file_get_string_list(*cfd_r, "hooks", "persistent", NULL, NULL)) != NULL) {
+		for (unsigned int i = 0; hooks[i] != NULL; i++)
+			hooker_persistent_start(hooks[i]);
+	}
+	g_strfreev(persistent_hooks);
+	persistent_hooks = hooks;
+	return 0;
+}
+
+int
+keyfile_reload_hooks(GKeyFile **cfd_r)
+{
+	bool changed;
+	char **hooks;
+
+	g_assert(*cfd_r != NULL);
+
+	/* Persistent hooks are started once, they are not restarted on
+	 * reload */
+	hooks = g_key_file_get_string_list(*cfd_r, "hooks", "persistent", NULL, NULL);
+	if (hooks == NULL || persistent_hooks == NULL)
+		changed = (hooks != persistent_hooks);
+	else {
+		changed = (g_strv_length(hooks) != g_strv_length(persistent_hooks));
+		for (unsigned int i = 0; !changed && hooks[i] != NULL; i++)
+			changed = (strcmp(hooks[i], persistent_hooks[i]) != 0);
+	}
+	if (changed)
+		g_warning("Changing hooks.persistent requires a restart");
+	g_strfreev(hooks);
 	return 0;
 }
 
@@ -180,4 +432,19 @@ keyfile_load_modules(GKeyFile **cfd_r)
 	return 0;
 }
 
+int
+keyfile_reload_modules(GKeyFile **cfd_r)
+{
+	int ret;
+	char **modules;
+
+	g_assert(*cfd_r != NULL);
+
+	/* Load new modules, unload removed and changed ones */
+	modules = g_key_file_get_string_list(*cfd_r, "main", "modules", NULL, NULL);
+	ret = module_reload(modules, *cfd_r);
+	g_strfreev(modules);
+	return ret;
+}
+
 #endif /* HAVE_GMODULE */
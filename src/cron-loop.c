@@ -28,10 +28,27 @@
 #include <glib.h>
 #include <mpd/client.h>
 
+/* One slot for each bit of enum mpd_idle */
+#define LOOP_EVENT_MAX	32
+
 static guint idle_sid, reconnect_sid;
+static unsigned attempts;
+static struct connect_request *connecting = NULL;
 static const unsigned *version = NULL;
 static struct mpd_connection *conn = NULL;
 
+/* Coalescing state:
+ * hold_sid: Deadline timer of every event, non-zero while its window is open.
+ * dirty: Events which arrived while their window was open.
+ * due: Dirty events whose window has closed, waiting to be dispatched.
+ * noidle: Whether noidle was sent to interrupt the current idle command.
+ */
+static guint hold_sid[LOOP_EVENT_MAX];
+static enum mpd_idle dirty, due;
+static bool noidle;
+
+static struct metrics_counter *wakeups, *coalesced, *connects;
+
 static void loop_schedule_reconnect(void);
 static void loop_schedule_idle(void);
 
@@ -46,21 +63,76 @@ loop_failure(void)
 	g_free(msg);
 	mpd_connection_free(conn);
 	conn = NULL;
+
+	/* Pooled connections are most likely dead as well */
+	pool_flush();
+}
+
+static void
+loop_interrupt_idle(void)
+{
+	g_assert(idle_sid != 0);
+	g_assert(conn != NULL);
+
+	if (!mpd_send_noidle(conn)) {
+		g_source_remove(idle_sid);
+		idle_sid = 0;
+		loop_failure();
+		loop_schedule_reconnect();
+		return;
+	}
+	noidle = true;
 }
 
 static gboolean
-loop_reconnect(G_GNUC_UNUSED gpointer data)
+loop_hold_expire(gpointer data)
 {
-	g_message("Connecting to `%s' on port %s with timeout %d",
-			conf.hostname, conf.port, conf.timeout);
-	if ((conn = mpd_connection_new(conf.hostname, atoi(conf.port), conf.timeout)) == NULL) {
-		g_critical("Error creating mpd connection: out of memory");
-		exit(EXIT_FAILURE);
+	unsigned j;
+	enum mpd_idle i;
+
+	j = GPOINTER_TO_UINT(data);
+	i = 1 << j;
+	hold_sid[j] = 0;
+
+	if (!(dirty & i))
+		return FALSE;
+
+	g_debug("Coalescing window of %s event closed, dispatching",
+			mpd_idle_name(i));
+	dirty &= ~i;
+	due |= i;
+
+	/* Interrupt the idle command so that loop_idle() gets called.
+	 * If there's no connection, due events are dispatched after
+	 * reconnecting. */
+	if (idle_sid != 0 && !noidle)
+		loop_interrupt_idle();
+	return FALSE;
+}
+
+static void
+loop_hold_reset(void)
+{
+	for (unsigned j = 0; j < LOOP_EVENT_MAX; j++) {
+		if (hold_sid[j] != 0) {
+			g_source_remove(hold_sid[j]);
+			hold_sid[j] = 0;
+		}
 	}
-	if (mpd_connection_get_error(conn) != MPD_ERROR_SUCCESS) {
-		loop_failure();
-		return TRUE;
+	dirty = due = 0;
+}
+
+static void
+loop_connected(struct mpd_connection *newconn, const char *error,
+		G_GNUC_UNUSED gpointer data)
+{
+	connecting = NULL;
+	if (newconn == NULL) {
+		g_warning("Failed to connect to Mpd: %s", error);
+		loop_schedule_reconnect();
+		return;
 	}
+	conn = newconn;
 
 	if (conf.password != NULL) {
 		g_message("Sending password");
@@ -82,8 +154,26 @@ loop_reconnect(G_GNUC_UNUSED gpointer data)
 	else
 		g_message("Connected to Mpd server, running version unknown");
 
+	/* Mirror the queue, the stored playlists and the outputs so that
+	 * later events only report what changed. */
+	if (queue_prime(conn) < 0 || cache_prime(conn) < 0) {
+		loop_failure();
+		loop_schedule_reconnect();
+		return;
+	}
+
+	attempts = 0;
 	loop_schedule_idle();
+}
+
+static gboolean
+loop_reconnect(G_GNUC_UNUSED gpointer data)
+{
+	g_message("Connecting to `%s' on port %s with timeout %d",
+			conf.hostname, conf.port, conf.timeout);
 	reconnect_sid = 0;
+	metrics_inc(connects);
+	connecting = connect_async(loop_connected, NULL);
 	return FALSE;
 }
 
@@ -100,6 +190,8 @@ loop_idle(G_GNUC_UNUSED GIOChannel *source,
 	g_assert(conn != NULL);
 
 	idle_sid = 0;
+	noidle = false;
+	metrics_inc(wakeups);
 	myidle = mpd_recv_idle(conn, false);
 	if (!mpd_response_finish(conn)) {
 		/* Check whether idle command is supported */
@@ -119,20 +211,35 @@ loop_idle(G_GNUC_UNUSED GIOChannel *source,
 		return FALSE;
 	}
 
-	for (j = 0 ;; j++) {
+	/* Add the events whose coalescing window has closed */
+	myidle |= due;
+	due = 0;
+
+	for (j = 0 ; j < LOOP_EVENT_MAX; j++) {
 		i = 1 << j;
 		if ((name = mpd_idle_name(i)) == NULL)
 			break;
-		if (myidle & i) {
-			/* Clear the environment */
-			env_clearenv();
-			/* Run the appropriate event */
-			if (event_run(conn, i) < 0) {
-				loop_failure();
-				loop_schedule_reconnect();
-				return FALSE;
-			}
+		if (!(myidle & i))
+			continue;
+		if (hold_sid[j] != 0) {
+			/* Window is open, dispatch when it closes */
+			g_debug("Coalescing %s event", name);
+			metrics_inc(coalesced);
+			dirty |= i;
+			myidle &= ~i;
+			continue;
 		}
+		if (conf.coalesce > 0)
+			hold_sid[j] = g_timeout_add(conf.coalesce,
+					loop_hold_expire,
+					GUINT_TO_POINTER(j));
+	}
+
+	/* Run the events, sharing a single fetch of Mpd state */
+	if (myidle != 0 && event_run(conn, myidle) < 0) {
+		loop_failure();
+		loop_schedule_reconnect();
+		return FALSE;
 	}
 
 	loop_schedule_idle();
@@ -142,9 +249,24 @@ loop_idle(G_GNUC_UNUSED GIOChannel *source,
 static void
 loop_schedule_reconnect(void)
 {
+	guint delay, cap;
+
 	g_assert(reconnect_sid == 0);
-	g_message("Waiting for %d seconds before reconnecting", conf.reconnect);
-	reconnect_sid = g_timeout_add_seconds(conf.reconnect, loop_reconnect, NULL);
+
+	/* Double the interval on every failed attempt up to the cap and wait
+	 * a random time between half and all of it, so that a bunch of
+	 * clients don't hammer a restarting Mpd at the same time. */
+	delay = conf.reconnect * 1000;
+	cap = conf.reconnect_max * 1000;
+	for (unsigned j = 0; j < attempts && delay < cap; j++)
+		delay *= 2;
+	if (delay > cap)
+		delay = cap;
+	delay = delay / 2 + g_random_int_range(0, delay / 2 + 1);
+	attempts++;
+
+	g_message("Waiting for %.1f seconds before reconnecting", delay / 1000.0);
+	reconnect_sid = g_timeout_add(delay, loop_reconnect, NULL);
 }
 
 static void
@@ -168,13 +290,25 @@ loop_schedule_idle(void)
 	channel = g_io_channel_unix_new(mpd_connection_get_fd(conn));
 	idle_sid = g_io_add_watch(channel, G_IO_IN, loop_idle, NULL);
 	g_io_channel_unref(channel);
+
+	/* Dispatch events whose window closed while we were disconnected */
+	if (due != 0)
+		loop_interrupt_idle();
 }
 
 void
 loop_connect(void)
 {
-	if (loop_reconnect(NULL))
-		loop_schedule_reconnect();
+	wakeups = metrics_counter("loop.wakeups");
+	coalesced = metrics_counter("loop.coalesced");
+	connects = metrics_counter("loop.connects");
+	loop_reconnect(NULL);
+}
+
+bool
+loop_online(void)
+{
+	return conn != NULL;
 }
 
 void
@@ -186,6 +320,13 @@ loop_disconnect(void)
 	if (reconnect_sid != 0)
 		g_source_remove(reconnect_sid);
 
+	if (connecting != NULL) {
+		connect_cancel(connecting);
+		connecting = NULL;
+	}
+
+	loop_hold_reset();
+
 	if (conn != NULL) {
 		mpd_connection_free(conn);
 		conn = NULL;
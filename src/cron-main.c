@@ -26,6 +26,7 @@
 #include <string.h>
 
 #include <glib.h>
+#include <glib-unix.h>
 
 #include <libdaemon/dfork.h>
 #include <libdaemon/dlog.h>
@@ -60,6 +61,13 @@ internal_cleanup(
 #ifdef HAVE_GMODULE
 	module_close(signaled ? 0 : 1);
 #endif /* HAVE_GMODULE */
+	hooker_close();
+	pool_free();
+	play_free();
+	queue_free();
+	cache_free();
+	env_free();
+	metrics_free();
 	conf_free();
 	if (cfd != NULL) {
 		g_key_file_free(cfd);
@@ -91,6 +99,73 @@ sig_cleanup(int signum)
 	raise(signum);
 }
 
+static gboolean
+sig_reload(G_GNUC_UNUSED gpointer userdata)
+{
+	GKeyFile *kfd;
+	struct mpdcron_config old;
+	struct hooker_config old_hooker;
+#ifdef HAVE_GMODULE
+	struct module_config old_module;
+#endif /* HAVE_GMODULE */
+
+	g_message("Reloading configuration file `%s'", conf.conf_path);
+
+	/* keyfile_load() fills conf in place, keep a copy to restore if the
+	 * new configuration file is invalid. */
+	old = conf;
+	old_hooker = hooker_conf;
+#ifdef HAVE_GMODULE
+	old_module = module_conf;
+#endif /* HAVE_GMODULE */
+	conf.metrics_path = NULL;
+	conf.idle = 0;
+	kfd = g_key_file_new();
+	if (keyfile_load(&kfd) < 0) {
+		g_warning("Keeping the old configuration");
+		g_free(conf.metrics_path);
+		conf = old;
+		hooker_conf = old_hooker;
+#ifdef HAVE_GMODULE
+		module_conf = old_module;
+#endif /* HAVE_GMODULE */
+		g_key_file_free(kfd);
+		return TRUE;
+	}
+
+	/* The pool, the metrics socket and persistent hooks are set up once */
+	if (conf.pool != old.pool) {
+		g_warning("Changing mpd.pool requires a restart");
+		conf.pool = old.pool;
+	}
+	if (g_strcmp0(conf.metrics_path, old.metrics_path) != 0)
+		g_warning("Changing main.metrics_socket requires a restart");
+	g_free(conf.metrics_path);
+	conf.metrics_path = old.metrics_path;
+	if (hooker_conf.backlog != old_hooker.backlog) {
+		g_warning("Changing hooks.backlog requires a restart");
+		hooker_conf.backlog = old_hooker.backlog;
+	}
+	keyfile_reload_hooks(&kfd);
+
+	g_log_set_default_handler(log_handler, GINT_TO_POINTER(conf.no_daemon ? 5 : conf.loglevel));
+
+#ifdef HAVE_GMODULE
+	keyfile_reload_modules(&kfd);
+#endif /* HAVE_GMODULE */
+	g_key_file_free(kfd);
+	return TRUE;
+}
+
+#ifdef HAVE_GMODULE
+static gboolean
+sig_dump(G_GNUC_UNUSED gpointer userdata)
+{
+	module_dump();
+	return TRUE;
+}
+#endif /* HAVE_GMODULE */
+
 int
 main(int argc, char **argv)
 {
@@ -180,10 +255,30 @@ main(int argc, char **argv)
 
 #undef HANDLE_SIGNAL
 
+	/* Persistent hooks may die while we're writing to them. */
+	signal(SIGPIPE, SIG_IGN);
+
 	if (conf.no_daemon) {
 		/* Create the main loop */
 		loop = g_main_loop_new(NULL, FALSE);
 
+		/* Reload configuration and modules on SIGHUP */
+		g_unix_signal_add(SIGHUP, sig_reload, NULL);
+#ifdef HAVE_GMODULE
+		/* Log module timings on SIGUSR1 */
+		g_unix_signal_add(SIGUSR1, sig_dump, NULL);
+#endif /* HAVE_GMODULE */
+
+		/* Start persistent hooks */
+		keyfile_load_hooks(&cfd);
+
+		/* Set up the connection pool for modules */
+		pool_init();
+
+		/* Serve metrics */
+		if (conf.metrics_path != NULL)
+			metrics_listen(conf.metrics_path);
+
 #ifdef HAVE_GMODULE
 		/* Load modules which may add initial events */
 		keyfile_load_modules(&cfd);
@@ -249,6 +344,23 @@ main(int argc, char **argv)
 		/* Create the main loop */
 		loop = g_main_loop_new(NULL, FALSE);
 
+		/* Reload configuration and modules on SIGHUP */
+		g_unix_signal_add(SIGHUP, sig_reload, NULL);
+#ifdef HAVE_GMODULE
+		/* Log module timings on SIGUSR1 */
+		g_unix_signal_add(SIGUSR1, sig_dump, NULL);
+#endif /* HAVE_GMODULE */
+
+		/* Start persistent hooks */
+		keyfile_load_hooks(&cfd);
+
+		/* Set up the connection pool for modules */
+		pool_init();
+
+		/* Serve metrics */
+		if (conf.metrics_path != NULL)
+			metrics_listen(conf.metrics_path);
+
 #ifdef HAVE_GMODULE
 		/* Load modules which may add initial events */
 		keyfile_load_modules(&cfd);
@@ -0,0 +1,372 @@
+/* vim: set cino= fo=croql sw=8 ts=8 sts=0 noet cin fdm=syntax : */
+
+/*
+ * Copyright (c) 2013 Ali Polatel <alip@exherbo.org>
+ *
+ * This file is part of the mpdcron mpd client. mpdcron is free software;
+ * you can redistribute it and/or modify it under the terms of the GNU General
+ * Public License version 2, as published by the Free Software Foundation.
+ *
+ * mpdcron is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+ * Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include "cron-defs.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include <glib.h>
+
+/* Upper bounds of the histogram buckets in microseconds, the last bucket
+ * catches everything slower. */
+static const gint64 bounds[METRICS_BUCKETS - 1] = {
+	50, 100, 250, 500,
+	1000, 2500, 5000, 10000, 25000, 50000,
+	100000, 250000, 1000000,
+};
+
+/* Seconds a metrics client gets to read the dump */
+#define METRICS_WRITE_TIMEOUT	10
+
+struct metrics_client {
+	int fd;
+	char *text;
+	size_t len, off;
+	guint io_sid, timeout_sid;
+};
+
+static GHashTable *histograms = NULL;
+static GHashTable *counters = NULL;
+
+/* Histograms are observed from module threads too */
+static GMutex histogram_lock;
+
+static int listen_fd = -1;
+static guint listen_sid;
+static GSList *clients = NULL;
+
+static void
+metrics_histogram_free(gpointer data)
+{
+	struct metrics_histogram *hist = (struct metrics_histogram *)data;
+
+	g_free(hist->name);
+	g_free(hist);
+}
+
+static void
+metrics_counter_free(gpointer data)
+{
+	struct metrics_counter *counter = (struct metrics_counter *)data;
+
+	g_free(counter->name);
+	g_free(counter);
+}
+
+struct metrics_histogram *
+metrics_histogram(const char *name)
+{
+	struct metrics_histogram *hist;
+
+	g_mutex_lock(&histogram_lock);
+	if (histograms == NULL)
+		histograms = g_hash_table_new_full(g_str_hash, g_str_equal,
+				NULL, metrics_histogram_free);
+	if ((hist = g_hash_table_lookup(histograms, name)) == NULL) {
+		hist = g_new0(struct metrics_histogram, 1);
+		hist->name = g_strdup(name);
+		g_hash_table_insert(histograms, hist->name, hist);
+	}
+	g_mutex_unlock(&histogram_lock);
+	return hist;
+}
+
+struct metrics_counter *
+metrics_counter(const char *name)
+{
+	struct metrics_counter *counter;
+
+	if (counters == NULL)
+		counters = g_hash_table_new_full(g_str_hash, g_str_equal,
+				NULL, metrics_counter_free);
+	if ((counter = g_hash_table_lookup(counters, name)) == NULL) {
+		counter = g_new0(struct metrics_counter, 1);
+		counter->name = g_strdup(name);
+		g_hash_table_insert(counters, counter->name, counter);
+	}
+	return counter;
+}
+
+gint64
+metrics_observe(struct metrics_histogram *hist, gint64 start)
+{
+	unsigned i;
+	gint64 elapsed;
+
+	elapsed = g_get_monotonic_time() - start;
+	for (i = 0; i < METRICS_BUCKETS - 1; i++) {
+		if (elapsed <= bounds[i])
+			break;
+	}
+	g_mutex_lock(&histogram_lock);
+	hist->buckets[i]++;
+	hist->count++;
+	hist->sum += elapsed;
+	if (elapsed > hist->max)
+		hist->max = elapsed;
+	g_mutex_unlock(&histogram_lock);
+	return elapsed;
+}
+
+/* Add the values of a histogram to total, which isn't shared */
+void
+metrics_histogram_add(struct metrics_histogram *total,
+		const struct metrics_histogram *hist)
+{
+	g_mutex_lock(&histogram_lock);
+	for (unsigned i = 0; i < METRICS_BUCKETS; i++)
+		total->buckets[i] += hist->buckets[i];
+	total->count += hist->count;
+	total->sum += hist->sum;
+	total->max = MAX(total->max, hist->max);
+	g_mutex_unlock(&histogram_lock);
+}
+
+/* Estimate a quantile from the buckets, the result is the upper bound of
+ * the bucket the quantile falls into. */
+gint64
+metrics_quantile(const struct metrics_histogram *hist, double q)
+{
+	guint64 rank, cumulative;
+
+	if (hist->count == 0)
+		return 0;
+
+	rank = (guint64)(q * hist->count);
+	if (rank < q * hist->count || rank == 0)
+		rank++;
+
+	cumulative = 0;
+	for (unsigned i = 0; i < METRICS_BUCKETS - 1; i++) {
+		cumulative += hist->buckets[i];
+		if (cumulative >= rank)
+			return MIN(bounds[i], hist->max);
+	}
+	return hist->max;
+}
+
+static GList *
+metrics_sorted(GHashTable *table)
+{
+	if (table == NULL)
+		return NULL;
+	return g_list_sort(g_hash_table_get_keys(table), (GCompareFunc)strcmp);
+}
+
+char *
+metrics_dump(void)
+{
+	guint64 cumulative;
+	GList *keys, *walk;
+	GString *out;
+	struct metrics_counter *counter;
+	struct metrics_histogram *hist;
+
+	out = g_string_sized_new(4096);
+
+	keys = metrics_sorted(counters);
+	for (walk = keys; walk != NULL; walk = g_list_next(walk)) {
+		counter = g_hash_table_lookup(counters, walk->data);
+		g_string_append_printf(out, "mpdcron_counter{name=\"%s\"} %" G_GUINT64_FORMAT "\n",
+				counter->name, counter->value);
+	}
+	g_list_free(keys);
+
+	g_mutex_lock(&histogram_lock);
+	keys = metrics_sorted(histograms);
+	for (walk = keys; walk != NULL; walk = g_list_next(walk)) {
+		hist = g_hash_table_lookup(histograms, walk->data);
+		cumulative = 0;
+		for (unsigned i = 0; i < METRICS_BUCKETS; i++) {
+			cumulative += hist->buckets[i];
+			if (i < METRICS_BUCKETS - 1)
+				g_string_append_printf(out,
+						"mpdcron_latency_us_bucket{name=\"%s\",le=\"%" G_GINT64_FORMAT "\"} %" G_GUINT64_FORMAT "\n",
+						hist->name, bounds[i], cumulative);
+			else
+				g_string_append_printf(out,
+						"mpdcron_latency_us_bucket{name=\"%s\",le=\"+Inf\"} %" G_GUINT64_FORMAT "\n",
+						hist->name, cumulative);
+		}
+		g_string_append_printf(out, "mpdcron_latency_us_sum{name=\"%s\"} %" G_GINT64_FORMAT "\n",
+				hist->name, hist->sum);
+		g_string_append_printf(out, "mpdcron_latency_us_count{name=\"%s\"} %" G_GUINT64_FORMAT "\n",
+				hist->name, hist->count);
+		g_string_append_printf(out, "mpdcron_latency_us_max{name=\"%s\"} %" G_GINT64_FORMAT "\n",
+				hist->name, hist->max);
+	}
+	g_mutex_unlock(&histogram_lock);
+	g_list_free(keys);
+
+	return g_string_free(out, FALSE);
+}
+
+static void
+metrics_client_free(struct metrics_client *client)
+{
+	clients = g_slist_remove(clients, client);
+	if (client->io_sid != 0)
+		g_source_remove(client->io_sid);
+	if (client->timeout_sid != 0)
+		g_source_remove(client->timeout_sid);
+	close(client->fd);
+	g_free(client->text);
+	g_free(client);
+}
+
+static gboolean
+metrics_client_expire(gpointer data)
+{
+	struct metrics_client *client = (struct metrics_client *)data;
+
+	g_debug("Metrics client didn't read the dump in time");
+	client->timeout_sid = 0;
+	metrics_client_free(client);
+	return FALSE;
+}
+
+static gboolean
+metrics_client_write(G_GNUC_UNUSED GIOChannel *source,
+		G_GNUC_UNUSED GIOCondition condition,
+		gpointer data)
+{
+	ssize_t n;
+	struct metrics_client *client = (struct metrics_client *)data;
+
+	while (client->off < client->len) {
+		if ((n = write(client->fd, client->text + client->off,
+						client->len - client->off)) < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN)
+				return TRUE;
+			g_debug("Failed to write metrics: %s", g_strerror(errno));
+			break;
+		}
+		client->off += n;
+	}
+
+	/* Done or failed, hang up */
+	client->io_sid = 0;
+	metrics_client_free(client);
+	return FALSE;
+}
+
+static gboolean
+metrics_accept(G_GNUC_UNUSED GIOChannel *source,
+		G_GNUC_UNUSED GIOCondition condition,
+		G_GNUC_UNUSED gpointer data)
+{
+	int fd;
+	GIOChannel *channel;
+	struct metrics_client *client;
+
+	if ((fd = accept(listen_fd, NULL, NULL)) < 0) {
+		if (errno != EAGAIN && errno != EINTR)
+			g_warning("Failed to accept metrics connection: %s",
+					g_strerror(errno));
+		return TRUE;
+	}
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+	fcntl(fd, F_SETFD, FD_CLOEXEC);
+
+	/* Write the dump as the client reads it, one that stops reading
+	 * must not stall the main loop. */
+	client = g_new0(struct metrics_client, 1);
+	client->fd = fd;
+	client->text = metrics_dump();
+	client->len = strlen(client->text);
+
+	channel = g_io_channel_unix_new(fd);
+	client->io_sid = g_io_add_watch(channel, G_IO_OUT | G_IO_HUP | G_IO_ERR,
+			metrics_client_write, client);
+	g_io_channel_unref(channel);
+	client->timeout_sid = g_timeout_add_seconds(METRICS_WRITE_TIMEOUT,
+			metrics_client_expire, client);
+	clients = g_slist_prepend(clients, client);
+	return TRUE;
+}
+
+int
+metrics_listen(const char *path)
+{
+	struct sockaddr_un sun;
+	GIOChannel *channel;
+
+	if (strlen(path) >= sizeof(sun.sun_path)) {
+		g_warning("Metrics socket path `%s' too long", path);
+		return -1;
+	}
+
+	if ((listen_fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) {
+		g_warning("Failed to create metrics socket: %s", g_strerror(errno));
+		return -1;
+	}
+	fcntl(listen_fd, F_SETFL, fcntl(listen_fd, F_GETFL) | O_NONBLOCK);
+	fcntl(listen_fd, F_SETFD, FD_CLOEXEC);
+
+	memset(&sun, 0, sizeof(sun));
+	sun.sun_family = AF_UNIX;
+	g_strlcpy(sun.sun_path, path, sizeof(sun.sun_path));
+	unlink(path);
+	if (bind(listen_fd, (struct sockaddr *)&sun, sizeof(sun)) < 0 ||
+			listen(listen_fd, 4) < 0) {
+		g_warning("Failed to listen on metrics socket `%s': %s",
+				path, g_strerror(errno));
+		close(listen_fd);
+		listen_fd = -1;
+		return -1;
+	}
+
+	channel = g_io_channel_unix_new(listen_fd);
+	listen_sid = g_io_add_watch(channel, G_IO_IN, metrics_accept, NULL);
+	g_io_channel_unref(channel);
+	g_debug("Serving metrics on `%s'", path);
+	return 0;
+}
+
+void
+metrics_free(void)
+{
+	if (listen_sid != 0) {
+		g_source_remove(listen_sid);
+		listen_sid = 0;
+	}
+	while (clients != NULL)
+		metrics_client_free(clients->data);
+	if (listen_fd >= 0) {
+		close(listen_fd);
+		listen_fd = -1;
+		if (conf.metrics_path != NULL)
+			unlink(conf.metrics_path);
+	}
+	if (histograms != NULL) {
+		g_hash_table_destroy(histograms);
+		histograms = NULL;
+	}
+	if (counters != NULL) {
+		g_hash_table_destroy(counters);
+		counters = NULL;
+	}
+}
@@ -0,0 +1,329 @@
+/* vim: set cino= fo=croql sw=8 ts=8 sts=0 noet cin fdm=syntax : */
+
+/*
+ * Copyright (c) 2013 Ali Polatel <alip@exherbo.org>
+ *
+ * This file is part of the mpdcron mpd client. mpdcron is free software;
+ * you can redistribute it and/or modify it under the terms of the GNU General
+ * Public License version 2, as published by the Free Software Foundation.
+ *
+ * mpdcron is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+ * Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include "cron-defs.h"
+
+#include <stdbool.h>
+#include <string.h>
+
+#include <glib.h>
+#include <mpd/client.h>
+
+/* Differences in milliseconds between the position reported by Mpd and the
+ * one expected from the clock which are not considered seeks. */
+#define PLAY_SEEK_TOLERANCE	1500
+
+enum play_jump {
+	PLAY_JUMP_NONE = 0,
+	PLAY_JUMP_SEEK,
+	PLAY_JUMP_REPEAT,
+};
+
+/* Play tracking:
+ * prev: The song seen at the last player event, NULL if stopped.
+ * last_id: Id of the song being played, -1 if stopped.
+ */
+static struct mpd_song *prev = NULL;
+static unsigned last_id = -1;
+static bool was_paused = false;
+static bool is_remote = false;
+
+/* Session of the current song. The position reported by Mpd is compared
+ * with the monotonic clock at every player event to find out how long the
+ * song was really listened to and whether it was seeked or repeated.
+ * mark: Monotonic time of the last player event, in microseconds.
+ * position: Position reported by Mpd at mark, in milliseconds.
+ * listened: Milliseconds listened to so far.
+ * running: Whether the song was playing since mark.
+ */
+static struct {
+	gint64 mark;
+	unsigned position;
+	guint64 listened;
+	unsigned seeks;
+	bool running;
+} session;
+
+/* Events of the last update and the songs which ended during it */
+static GArray *events = NULL;
+static GPtrArray *ended = NULL;
+static struct mpdcron_play_delta delta;
+
+static bool
+played_long_enough(unsigned elapsed, int length)
+{
+	/* http://www.lastfm.de/api/submissions "The track must have been
+	   played for a duration of at least 240 seconds or half the track's
+	   total length, whichever comes first. Skipping or pausing the
+	   track is irrelevant as long as the appropriate amount has been
+	   played."
+	 */
+	return elapsed > 240 || (length >= 30 && elapsed > (unsigned)length / 2);
+}
+
+/* Streams keep their id and change the title for every track */
+static bool
+song_differs(const struct mpd_song *song, const struct mpd_song *other)
+{
+	if (mpd_song_get_id(song) != mpd_song_get_id(other))
+		return true;
+	return is_remote && g_strcmp0(mpd_song_get_tag(song, MPD_TAG_TITLE, 0),
+			mpd_song_get_tag(other, MPD_TAG_TITLE, 0)) != 0;
+}
+
+static void
+session_start(const struct mpd_status *status, bool running)
+{
+	session.mark = g_get_monotonic_time();
+	session.position = mpd_status_get_elapsed_ms(status);
+	session.seeks = 0;
+	session.running = running;
+
+	/* Count what was played before the event reached us unless we
+	 * joined in the middle of the song. */
+	session.listened = (session.position < PLAY_SEEK_TOLERANCE) ? session.position : 0;
+}
+
+/* Account for the time played since the last event, used when Mpd no longer
+ * reports the position of the song: it changed or the player stopped. */
+static void
+session_finish(const struct mpd_song *song)
+{
+	gint64 wall;
+	unsigned duration;
+
+	if (!session.running)
+		return;
+
+	wall = (g_get_monotonic_time() - session.mark) / 1000;
+	duration = mpd_song_get_duration(song) * 1000;
+	if (duration > session.position)
+		wall = MIN(wall, (gint64)(duration - session.position));
+	session.listened += wall;
+	session.running = false;
+}
+
+/* Reconcile the position reported by Mpd with the clock */
+static enum play_jump
+session_advance(const struct mpd_song *song, const struct mpd_status *status)
+{
+	gint64 now, wall, moved, drift;
+	unsigned reported, duration;
+
+	now = g_get_monotonic_time();
+	reported = mpd_status_get_elapsed_ms(status);
+	wall = session.running ? (now - session.mark) / 1000 : 0;
+	moved = (gint64)reported - session.position;
+	drift = moved - wall;
+	duration = mpd_song_get_duration(song) * 1000;
+
+	if (drift >= -PLAY_SEEK_TOLERANCE && drift <= PLAY_SEEK_TOLERANCE) {
+		/* Played along, Mpd knows better about stalls */
+		session.listened += CLAMP(moved, 0, wall);
+		session.mark = now;
+		session.position = reported;
+		return PLAY_JUMP_NONE;
+	}
+
+	if (duration > 0 && reported <= wall &&
+			session.position + wall + PLAY_SEEK_TOLERANCE >= duration) {
+		/* Reached the end and started over */
+		session.listened += MAX(wall - reported, 0);
+		return PLAY_JUMP_REPEAT;
+	}
+
+	session.listened += wall;
+	session.mark = now;
+	session.position = reported;
+	session.seeks++;
+	return PLAY_JUMP_SEEK;
+}
+
+static void
+play_emit(enum mpdcron_play_type type, const struct mpd_song *song)
+{
+	guint64 duration;
+	struct mpdcron_play_event event;
+
+	event.type = type;
+	event.song = song;
+	event.listened_ms = session.listened;
+	event.position_ms = session.position;
+	event.seeks = session.seeks;
+	event.elapsed = session.listened / 1000;
+	duration = (guint64)mpd_song_get_duration(song) * 1000;
+	event.percent = (duration > 0) ? MIN(session.listened * 100 / duration, 100) : 100;
+	event.long_enough = played_long_enough(event.elapsed, mpd_song_get_duration(song));
+	g_array_append_val(events, event);
+}
+
+static void
+play_started(const struct mpd_song *song, const struct mpd_status *status)
+{
+	const char *uri;
+
+	uri = mpd_song_get_uri(song);
+	is_remote = (strstr(uri, "://") != NULL);
+	session_start(status, mpd_status_get_state(status) == MPD_STATE_PLAY);
+	last_id = mpd_song_get_id(song);
+	play_emit(MPDCRON_PLAY_STARTED, song);
+}
+
+static void
+play_ended(struct mpd_song *song)
+{
+	/* The song has to outlive the delta */
+	g_ptr_array_add(ended, song);
+	play_emit(MPDCRON_PLAY_ENDED, song);
+}
+
+const struct mpdcron_play_delta *
+play_update(const struct mpd_status *status, const struct mpd_song *song)
+{
+	bool resumed;
+	unsigned reported;
+	enum mpd_state state;
+	struct mpd_song *again;
+
+	if (events == NULL) {
+		events = g_array_new(FALSE, FALSE, sizeof(struct mpdcron_play_event));
+		ended = g_ptr_array_new_with_free_func((GDestroyNotify)mpd_song_free);
+	}
+	g_array_set_size(events, 0);
+	g_ptr_array_set_size(ended, 0);
+
+	state = mpd_status_get_state(status);
+	if (state == MPD_STATE_PAUSE) {
+		if (prev != NULL && song != NULL && song_differs(song, prev)) {
+			/* The song changed before or while pausing */
+			session_finish(prev);
+			play_ended(prev);
+			prev = mpd_song_dup(song);
+			play_started(prev, status);
+			play_emit(MPDCRON_PLAY_PAUSED, prev);
+		}
+		else if (prev != NULL && !was_paused) {
+			switch (session_advance(prev, status)) {
+			case PLAY_JUMP_REPEAT:
+				g_debug("Repeated song detected");
+				again = mpd_song_dup((song != NULL) ? song : prev);
+				play_ended(prev);
+				prev = again;
+				play_started(prev, status);
+				break;
+			case PLAY_JUMP_SEEK:
+				play_emit(MPDCRON_PLAY_SEEKED, prev);
+				break;
+			default:
+				break;
+			}
+			session.running = false;
+			play_emit(MPDCRON_PLAY_PAUSED, prev);
+		}
+		else if (prev != NULL) {
+			/* Seeking while paused */
+			reported = mpd_status_get_elapsed_ms(status);
+			if (reported + PLAY_SEEK_TOLERANCE < session.position ||
+					reported > session.position + PLAY_SEEK_TOLERANCE) {
+				session.position = reported;
+				session.seeks++;
+				play_emit(MPDCRON_PLAY_SEEKED, prev);
+			}
+		}
+		was_paused = true;
+		goto out;
+	}
+	else if (state != MPD_STATE_PLAY) {
+		last_id = -1;
+		was_paused = false;
+	}
+
+	resumed = false;
+	if (was_paused) {
+		if (song != NULL && mpd_song_get_id(song) == last_id) {
+			session.mark = g_get_monotonic_time();
+			session.position = mpd_status_get_elapsed_ms(status);
+			session.running = true;
+			play_emit(MPDCRON_PLAY_RESUMED, song);
+			resumed = true;
+		}
+		was_paused = false;
+	}
+
+	/* The previous song was skipped, finished or the player stopped */
+	if (prev != NULL && (song == NULL || song_differs(song, prev))) {
+		session_finish(prev);
+		play_ended(prev);
+		prev = NULL;
+	}
+
+	if (song != NULL) {
+		if (mpd_song_get_id(song) != last_id || prev == NULL) {
+			g_debug("New song detected (%s - %s), id: %u, pos: %u",
+					mpd_song_get_tag(song, MPD_TAG_ARTIST, 0),
+					mpd_song_get_tag(song, MPD_TAG_TITLE, 0),
+					mpd_song_get_id(song), mpd_song_get_pos(song));
+			play_started(song, status);
+		}
+		else if (!resumed) {
+			switch (session_advance(song, status)) {
+			case PLAY_JUMP_REPEAT:
+				g_debug("Repeated song detected");
+				play_ended(prev);
+				prev = NULL;
+				play_started(song, status);
+				break;
+			case PLAY_JUMP_SEEK:
+				g_debug("Seek to %u ms detected", session.position);
+				play_emit(MPDCRON_PLAY_SEEKED, song);
+				break;
+			default:
+				break;
+			}
+		}
+	}
+
+	if (prev != NULL)
+		mpd_song_free(prev);
+	prev = (song != NULL) ? mpd_song_dup(song) : NULL;
+
+out:
+	delta.count = events->len;
+	delta.events = (const struct mpdcron_play_event *)events->data;
+	return &delta;
+}
+
+void
+play_free(void)
+{
+	if (prev != NULL) {
+		mpd_song_free(prev);
+		prev = NULL;
+	}
+	if (events != NULL) {
+		g_array_free(events, TRUE);
+		events = NULL;
+		g_ptr_array_free(ended, TRUE);
+		ended = NULL;
+	}
+	memset(&session, 0, sizeof(session));
+	last_id = -1;
+	was_paused = false;
+	is_remote = false;
+}
@@ -0,0 +1,349 @@
+/* vim: set cino= fo=croql sw=8 ts=8 sts=0 noet cin fdm=syntax : */
+
+/*
+ * Copyright (c) 2013 Ali Polatel <alip@exherbo.org>
+ *
+ * This file is part of the mpdcron mpd client. mpdcron is free software;
+ * you can redistribute it and/or modify it under the terms of the GNU General
+ * Public License version 2, as published by the Free Software Foundation.
+ *
+ * mpdcron is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+ * Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include "cron-defs.h"
+
+#include <stdbool.h>
+#include <string.h>
+
+#include <glib.h>
+#include <mpd/client.h>
+
+/* Auxiliary connections lent to modules. The main connection spends most of
+ * its time in idle, so modules which want to query Mpd borrow one of these.
+ * Connecting, sending the password and pinging happen asynchronously on the
+ * main loop, borrowing only hands out connections which are already up.
+ * pending: A command was sent, the slot can't be borrowed until the answer
+ *          arrives.
+ */
+struct pool_slot {
+	struct mpd_connection *conn;
+	bool busy;
+	bool pending;
+
+	/* Only touched from the main thread */
+	struct connect_request *connecting;
+	guint io_sid;
+};
+
+static struct pool_slot *slots = NULL;
+static guint ping_sid, refill_sid;
+
+/* Threaded modules borrow connections too */
+static GMutex lock;
+
+static void
+pool_drop(struct pool_slot *slot)
+{
+	if (slot->conn != NULL) {
+		mpd_connection_free(slot->conn);
+		slot->conn = NULL;
+	}
+}
+
+static void
+pool_request_cancel(struct pool_slot *slot)
+{
+	if (slot->io_sid != 0) {
+		g_source_remove(slot->io_sid);
+		slot->io_sid = 0;
+	}
+	slot->pending = false;
+}
+
+static void
+pool_request_done(struct pool_slot *slot, const char *error)
+{
+	g_mutex_lock(&lock);
+	slot->pending = false;
+	if (error != NULL) {
+		g_debug("Dropping pooled connection %d: %s",
+				(int)(slot - slots), error);
+		pool_drop(slot);
+	}
+	g_mutex_unlock(&lock);
+}
+
+static gboolean pool_request_io(GIOChannel *source, GIOCondition condition,
+		gpointer data);
+
+static void
+pool_request_watch(struct pool_slot *slot)
+{
+	GIOChannel *channel;
+	GIOCondition condition;
+	enum mpd_async_event events;
+	struct mpd_async *async;
+
+	async = mpd_connection_get_async(slot->conn);
+	events = mpd_async_events(async);
+	condition = G_IO_HUP | G_IO_ERR;
+	if (events & MPD_ASYNC_EVENT_READ)
+		condition |= G_IO_IN;
+	if (events & MPD_ASYNC_EVENT_WRITE)
+		condition |= G_IO_OUT;
+
+	channel = g_io_channel_unix_new(mpd_async_get_fd(async));
+	slot->io_sid = g_io_add_watch(channel, condition, pool_request_io, slot);
+	g_io_channel_unref(channel);
+}
+
+static gboolean
+pool_request_io(G_GNUC_UNUSED GIOChannel *source, GIOCondition condition,
+		gpointer data)
+{
+	char *line;
+	enum mpd_async_event events;
+	struct mpd_async *async;
+	struct pool_slot *slot = (struct pool_slot *)data;
+
+	slot->io_sid = 0;
+	async = mpd_connection_get_async(slot->conn);
+
+	events = 0;
+	if (condition & G_IO_IN)
+		events |= MPD_ASYNC_EVENT_READ;
+	if (condition & G_IO_OUT)
+		events |= MPD_ASYNC_EVENT_WRITE;
+	if (condition & G_IO_HUP)
+		events |= MPD_ASYNC_EVENT_HUP;
+	if (condition & G_IO_ERR)
+		events |= MPD_ASYNC_EVENT_ERROR;
+
+	if (!mpd_async_io(async, events)) {
+		pool_request_done(slot, mpd_async_get_error_message(async));
+		return FALSE;
+	}
+
+	if ((line = mpd_async_recv_line(async)) == NULL) {
+		if (mpd_async_get_error(async) != MPD_ERROR_SUCCESS)
+			pool_request_done(slot, mpd_async_get_error_message(async));
+		else
+			pool_request_watch(slot);
+		return FALSE;
+	}
+
+	pool_request_done(slot, (strcmp(line, "OK") == 0) ? NULL : line);
+	return FALSE;
+}
+
+/* Send a command answered with a single OK, the slot must be pending */
+static void
+pool_request(struct pool_slot *slot, const char *command, const char *arg)
+{
+	struct mpd_async *async;
+
+	async = mpd_connection_get_async(slot->conn);
+	if (!mpd_async_send_command(async, command, arg, NULL)) {
+		pool_request_done(slot, mpd_async_get_error_message(async));
+		return;
+	}
+	pool_request_watch(slot);
+}
+
+static gboolean
+pool_ping(G_GNUC_UNUSED gpointer data)
+{
+	/* Keep idle connections alive and drop the dead ones, they're
+	 * reopened on the next borrow. */
+	for (int i = 0; i < conf.pool; i++) {
+		g_mutex_lock(&lock);
+		if (slots[i].pending) {
+			/* No answer since the last round */
+			pool_request_cancel(&slots[i]);
+			g_debug("Dropping pooled connection %d: no answer from Mpd", i);
+			pool_drop(&slots[i]);
+		}
+		if (slots[i].busy || slots[i].conn == NULL) {
+			g_mutex_unlock(&lock);
+			continue;
+		}
+		slots[i].pending = true;
+		g_mutex_unlock(&lock);
+
+		pool_request(&slots[i], "ping", NULL);
+	}
+	return TRUE;
+}
+
+static void
+pool_connected(struct mpd_connection *conn, const char *error, gpointer data)
+{
+	struct pool_slot *slot = (struct pool_slot *)data;
+
+	slot->connecting = NULL;
+	if (conn == NULL) {
+		g_warning("Failed to open pooled connection: %s", error);
+		return;
+	}
+
+	/* The connection is lent once Mpd accepted the password */
+	g_mutex_lock(&lock);
+	slot->conn = conn;
+	slot->pending = (conf.password != NULL);
+	g_mutex_unlock(&lock);
+	if (conf.password != NULL)
+		pool_request(slot, "password", conf.password);
+}
+
+static gboolean
+pool_refill(G_GNUC_UNUSED gpointer data)
+{
+	bool empty;
+
+	g_mutex_lock(&lock);
+	refill_sid = 0;
+	g_mutex_unlock(&lock);
+
+	if (!loop_online())
+		return FALSE;
+
+	for (int i = 0; i < conf.pool; i++) {
+		if (slots[i].connecting != NULL)
+			continue;
+		g_mutex_lock(&lock);
+		empty = (!slots[i].busy && slots[i].conn == NULL);
+		g_mutex_unlock(&lock);
+		if (!empty)
+			continue;
+
+		g_debug("Opening pooled connection %d", i);
+		slots[i].connecting = connect_async(pool_connected, &slots[i]);
+	}
+	return FALSE;
+}
+
+void
+pool_init(void)
+{
+	if (conf.pool == 0 || slots != NULL)
+		return;
+
+	slots = g_new0(struct pool_slot, conf.pool);
+	ping_sid = g_timeout_add_seconds(DEFAULT_MPD_POOL_PING, pool_ping, NULL);
+}
+
+void
+pool_flush(void)
+{
+	if (slots == NULL)
+		return;
+
+	/* Busy connections are dropped when they're returned with an error */
+	for (int i = 0; i < conf.pool; i++) {
+		if (slots[i].connecting != NULL) {
+			connect_cancel(slots[i].connecting);
+			slots[i].connecting = NULL;
+		}
+		g_mutex_lock(&lock);
+		pool_request_cancel(&slots[i]);
+		if (!slots[i].busy)
+			pool_drop(&slots[i]);
+		g_mutex_unlock(&lock);
+	}
+}
+
+void
+pool_free(void)
+{
+	if (slots == NULL)
+		return;
+
+	if (ping_sid != 0) {
+		g_source_remove(ping_sid);
+		ping_sid = 0;
+	}
+	if (refill_sid != 0) {
+		g_source_remove(refill_sid);
+		refill_sid = 0;
+	}
+	for (int i = 0; i < conf.pool; i++) {
+		if (slots[i].connecting != NULL)
+			connect_cancel(slots[i].connecting);
+		pool_request_cancel(&slots[i]);
+		pool_drop(&slots[i]);
+	}
+	g_free(slots);
+	slots = NULL;
+}
+
+struct mpd_connection *
+mpdcron_connection_borrow(void)
+{
+	int i;
+	bool refill;
+	struct mpd_connection *conn;
+
+	if (slots == NULL)
+		return NULL;
+
+	if (!loop_online())
+		return NULL;
+
+	g_mutex_lock(&lock);
+	conn = NULL;
+	refill = false;
+	for (i = 0; i < conf.pool; i++) {
+		if (slots[i].busy || slots[i].pending)
+			continue;
+		if (slots[i].conn == NULL) {
+			refill = true;
+			continue;
+		}
+		slots[i].busy = true;
+		conn = slots[i].conn;
+		break;
+	}
+
+	/* Open the missing connections in the background, the caller
+	 * doesn't wait for them. */
+	if (refill && refill_sid == 0)
+		refill_sid = g_idle_add(pool_refill, NULL);
+	g_mutex_unlock(&lock);
+
+	if (conn == NULL)
+		g_debug("No pooled connection is ready");
+	return conn;
+}
+
+void
+mpdcron_connection_return(struct mpd_connection *conn)
+{
+	if (slots == NULL || conn == NULL)
+		return;
+
+	g_mutex_lock(&lock);
+	for (int i = 0; i < conf.pool; i++) {
+		if (slots[i].conn != conn)
+			continue;
+		g_assert(slots[i].busy);
+		slots[i].busy = false;
+		/* Server errors, like a missing song, leave the connection
+		 * usable. Anything else means it's gone. */
+		if (mpd_connection_get_error(conn) != MPD_ERROR_SUCCESS &&
+				!mpd_connection_clear_error(conn)) {
+			g_debug("Dropping broken pooled connection %d", i);
+			pool_drop(&slots[i]);
+		}
+		g_mutex_unlock(&lock);
+		return;
+	}
+	g_mutex_unlock(&lock);
+	g_warning("Returned connection doesn't belong to the pool");
+}
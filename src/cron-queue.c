@@ -0,0 +1,232 @@
+/* vim: set cino= fo=croql sw=8 ts=8 sts=0 noet cin fdm=syntax : */
+
+/*
+ * Copyright (c) 2013 Ali Polatel <alip@exherbo.org>
+ *
+ * This file is part of the mpdcron mpd client. mpdcron is free software;
+ * you can redistribute it and/or modify it under the terms of the GNU General
+ * Public License version 2, as published by the Free Software Foundation.
+ *
+ * mpdcron is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+ * Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include "cron-defs.h"
+
+#include <stdbool.h>
+
+#include <glib.h>
+#include <mpd/client.h>
+
+/* Mirror of Mpd's queue:
+ * songs: Songs indexed by position.
+ * ids: Maps song ids to positions.
+ * version: Queue version the mirror corresponds to, 0 if empty.
+ */
+static GPtrArray *songs = NULL;
+static GHashTable *ids = NULL;
+static unsigned version = 0;
+
+/* Delta of the last update */
+static GArray *changes = NULL;
+static struct mpdcron_queue_delta delta;
+
+static void
+queue_init(void)
+{
+	if (songs != NULL)
+		return;
+	songs = g_ptr_array_new();
+	ids = g_hash_table_new(g_direct_hash, g_direct_equal);
+	changes = g_array_new(FALSE, FALSE, sizeof(struct mpdcron_queue_change));
+}
+
+/* Remove the song at the given position from the mirror and remember it as
+ * possibly removed. Whether it's really gone is known after all changes are
+ * applied. */
+static void
+queue_vacate(unsigned pos, GArray *vacated)
+{
+	struct mpd_song *song;
+	struct mpdcron_queue_change change;
+
+	if ((song = g_ptr_array_index(songs, pos)) == NULL)
+		return;
+
+	change.type = MPDCRON_CHANGE_REMOVED;
+	change.id = mpd_song_get_id(song);
+	change.pos = change.old_pos = pos;
+	change.song = NULL;
+	g_array_append_val(vacated, change);
+
+	g_hash_table_remove(ids, GUINT_TO_POINTER(change.id));
+	mpd_song_free(song);
+	g_ptr_array_index(songs, pos) = NULL;
+}
+
+unsigned
+queue_version(void)
+{
+	return version;
+}
+
+const struct mpdcron_queue_delta *
+queue_update(const struct mpd_status *status, GPtrArray *changed)
+{
+	unsigned length, pos;
+	gpointer old_pos;
+	GArray *vacated;
+	struct mpd_song *song;
+	struct mpdcron_queue_change change;
+
+	queue_init();
+
+	g_array_set_size(changes, 0);
+	delta.old_version = version;
+	delta.version = mpd_status_get_queue_version(status);
+	delta.length = length = mpd_status_get_queue_length(status);
+
+	/* Drop changes Mpd shouldn't have sent */
+	for (unsigned i = 0; i < changed->len; i++) {
+		song = g_ptr_array_index(changed, i);
+		if (mpd_song_get_pos(song) >= length) {
+			g_warning("Queue change at position %u beyond length %u",
+					mpd_song_get_pos(song), length);
+			mpd_song_free(song);
+			g_ptr_array_remove_index(changed, i--);
+		}
+	}
+
+	/* Classify the changes against the old mirror first */
+	for (unsigned i = 0; i < changed->len; i++) {
+		song = g_ptr_array_index(changed, i);
+		change.id = mpd_song_get_id(song);
+		change.pos = mpd_song_get_pos(song);
+		change.song = song;
+		if (!g_hash_table_lookup_extended(ids, GUINT_TO_POINTER(change.id),
+					NULL, &old_pos)) {
+			change.type = MPDCRON_CHANGE_ADDED;
+			change.old_pos = change.pos;
+		}
+		else {
+			change.old_pos = GPOINTER_TO_UINT(old_pos);
+			change.type = (change.old_pos == change.pos)
+				? MPDCRON_CHANGE_MODIFIED
+				: MPDCRON_CHANGE_MOVED;
+		}
+		g_array_append_val(changes, change);
+	}
+
+	/* Vacate the slots which are truncated or overwritten */
+	vacated = g_array_new(FALSE, FALSE, sizeof(struct mpdcron_queue_change));
+	for (pos = length; pos < songs->len; pos++)
+		queue_vacate(pos, vacated);
+	g_ptr_array_set_size(songs, MAX(length, songs->len));
+	for (unsigned i = 0; i < changed->len; i++)
+		queue_vacate(mpd_song_get_pos(g_ptr_array_index(changed, i)), vacated);
+	g_ptr_array_set_size(songs, length);
+
+	/* Fill in the new songs, the mirror takes over their ownership */
+	for (unsigned i = 0; i < changed->len; i++) {
+		song = g_ptr_array_index(changed, i);
+		pos = mpd_song_get_pos(song);
+		g_ptr_array_index(songs, pos) = song;
+		g_hash_table_insert(ids, GUINT_TO_POINTER(mpd_song_get_id(song)),
+				GUINT_TO_POINTER(pos));
+	}
+	g_ptr_array_set_size(changed, 0);
+
+	/* Vacated songs which didn't come back are gone */
+	for (unsigned i = 0; i < vacated->len; i++) {
+		change = g_array_index(vacated, struct mpdcron_queue_change, i);
+		if (!g_hash_table_lookup_extended(ids, GUINT_TO_POINTER(change.id),
+					NULL, NULL))
+			g_array_append_val(changes, change);
+	}
+	g_array_free(vacated, TRUE);
+
+	version = delta.version;
+	delta.count = changes->len;
+	delta.changes = (const struct mpdcron_queue_change *)changes->data;
+	g_debug("Queue version %u -> %u, length %u, %u changes",
+			delta.old_version, delta.version, delta.length, delta.count);
+	return &delta;
+}
+
+int
+queue_prime(struct mpd_connection *conn)
+{
+	GPtrArray *changed;
+	struct mpd_song *song;
+	struct mpd_status *status;
+
+	queue_clear();
+
+	g_debug("Sending status & plchanges commands to Mpd server");
+	if (!mpd_command_list_begin(conn, true) ||
+			!mpd_send_status(conn) ||
+			!mpd_send_queue_changes_meta(conn, 0) ||
+			!mpd_command_list_end(conn))
+		return -1;
+
+	if ((status = mpd_recv_status(conn)) == NULL)
+		return -1;
+	if (!mpd_response_next(conn)) {
+		mpd_status_free(status);
+		return -1;
+	}
+
+	changed = g_ptr_array_new();
+	while ((song = mpd_recv_song(conn)) != NULL)
+		g_ptr_array_add(changed, song);
+
+	if (!mpd_response_finish(conn)) {
+		for (unsigned i = 0; i < changed->len; i++)
+			mpd_song_free(g_ptr_array_index(changed, i));
+		g_ptr_array_free(changed, TRUE);
+		mpd_status_free(status);
+		return -1;
+	}
+
+	queue_update(status, changed);
+	g_ptr_array_free(changed, TRUE);
+	mpd_status_free(status);
+	return 0;
+}
+
+void
+queue_clear(void)
+{
+	if (songs == NULL)
+		return;
+
+	for (unsigned i = 0; i < songs->len; i++) {
+		if (g_ptr_array_index(songs, i) != NULL)
+			mpd_song_free(g_ptr_array_index(songs, i));
+	}
+	g_ptr_array_set_size(songs, 0);
+	g_hash_table_remove_all(ids);
+	g_array_set_size(changes, 0);
+	version = 0;
+}
+
+void
+queue_free(void)
+{
+	if (songs == NULL)
+		return;
+
+	queue_clear();
+	g_ptr_array_free(songs, TRUE);
+	g_hash_table_destroy(ids);
+	g_array_free(changes, TRUE);
+	songs = NULL;
+	ids = NULL;
+	changes = NULL;
+}
@@ -21,6 +21,7 @@
 #define MPDCRON_GUARD_MODULE_H 1
 
 #include <stdbool.h>
+#include <time.h>
 
 #ifdef MPDCRON_MODULE
 #define G_LOG_DOMAIN MPDCRON_MODULE
@@ -29,11 +30,31 @@
 #include <glib.h>
 #include <mpd/client.h>
 
+/** Version of struct mpdcron_module_v2 */
+#define MPDCRON_MODULE_ABI_VERSION 2
+
 enum mpdcron_init_retval {
 	MPDCRON_INIT_SUCCESS = 0, /** Success */
 	MPDCRON_INIT_FAILURE, /** Failure */
 };
 
+enum mpdcron_module_flags {
+	/**
+	 * Run the event callbacks on a worker thread of the module. Events
+	 * are delivered in order, the connection argument is NULL and
+	 * reconnect requests are ignored. init() and destroy() are still
+	 * called from the main thread.
+	 */
+	MPDCRON_MODULE_THREADED = 1 << 0,
+	/**
+	 * The event callback may run on a worker thread. The module starts
+	 * on the main thread and is moved to a worker, where it gets no
+	 * connection, if it's quarantined with main.module_quarantine set
+	 * to thread.
+	 */
+	MPDCRON_MODULE_THREADSAFE = 1 << 1,
+};
+
 enum mpdcron_event_retval {
 	MPDCRON_EVENT_SUCCESS = 0, /** Success **/
 	MPDCRON_EVENT_RECONNECT, /** Schedule a reconnection to mpd server **/
@@ -41,6 +62,121 @@ enum mpdcron_event_retval {
 	MPDCRON_EVENT_UNLOAD, /** Unload the module **/
 };
 
+enum mpdcron_change {
+	MPDCRON_CHANGE_ADDED = 0, /** Entry was added **/
+	MPDCRON_CHANGE_REMOVED, /** Entry was removed **/
+	MPDCRON_CHANGE_MOVED, /** Entry was moved to another position **/
+	MPDCRON_CHANGE_MODIFIED, /** Entry was modified in place **/
+};
+
+struct mpdcron_queue_change {
+	/** Type of the change */
+	enum mpdcron_change type;
+
+	/** Song id */
+	unsigned id;
+
+	/** New position, for removed songs this is the old position */
+	unsigned pos;
+
+	/** Old position, only valid for moved and removed songs */
+	unsigned old_pos;
+
+	/** The song, NULL for removed songs */
+	const struct mpd_song *song;
+};
+
+struct mpdcron_queue_delta {
+	/** Queue version before and after the change */
+	unsigned old_version;
+	unsigned version;
+
+	/** Length of the queue after the change */
+	unsigned length;
+
+	/** Changed songs, the removed ones come last */
+	unsigned count;
+	const struct mpdcron_queue_change *changes;
+};
+
+struct mpdcron_playlist_change {
+	/** Type of the change, one of added, removed or modified */
+	enum mpdcron_change type;
+
+	/** Path of the stored playlist */
+	const char *path;
+
+	/** Last modification time, 0 for removed playlists */
+	time_t last_modified;
+};
+
+struct mpdcron_playlist_delta {
+	unsigned count;
+	const struct mpdcron_playlist_change *changes;
+};
+
+struct mpdcron_output_change {
+	/** Type of the change, one of added, removed or modified */
+	enum mpdcron_change type;
+
+	/** Output id and name */
+	unsigned id;
+	const char *name;
+
+	/** Whether the output is enabled, false for removed outputs */
+	bool enabled;
+};
+
+struct mpdcron_output_delta {
+	unsigned count;
+	const struct mpdcron_output_change *changes;
+};
+
+enum mpdcron_play_type {
+	MPDCRON_PLAY_STARTED = 0, /** A song started playing **/
+	MPDCRON_PLAY_ENDED, /** The song finished, was skipped or the player stopped **/
+	MPDCRON_PLAY_PAUSED, /** The song was paused **/
+	MPDCRON_PLAY_RESUMED, /** The song continues after a pause **/
+	MPDCRON_PLAY_SEEKED, /** The position in the song was changed **/
+};
+
+struct mpdcron_play_event {
+	/** Type of the event */
+	enum mpdcron_play_type type;
+
+	/** The song */
+	const struct mpd_song *song;
+
+	/** Seconds the song has been listened to */
+	unsigned elapsed;
+
+	/** Percentage of the song listened to, 100 if the duration is unknown */
+	unsigned percent;
+
+	/** Whether the song was played long enough to count as played:
+	 * 240 seconds or half of its duration, whichever comes first. */
+	bool long_enough;
+
+	/** Milliseconds the song has been listened to. Pauses and the parts
+	 * skipped by seeking aren't counted, parts played again are. */
+	unsigned listened_ms;
+
+	/** Position in the song reported by Mpd in milliseconds */
+	unsigned position_ms;
+
+	/** Number of seeks since the song started */
+	unsigned seeks;
+};
+
+/**
+ * Play events derived from player events by the daemon, so that modules
+ * don't have to track the current song, pauses and play time themselves.
+ */
+struct mpdcron_play_delta {
+	unsigned count;
+	const struct mpdcron_play_event *events;
+};
+
 struct mpdcron_config {
 	char *home_path;
 	char *conf_path;
@@ -57,6 +193,13 @@ struct mpdcron_config {
 	int loglevel;
 
 	enum mpd_idle idle;
+
+	/* Fields added later go below, modules built against older headers
+	 * only know about the ones above. */
+	int coalesce;
+	int pool;
+	int reconnect_max;
+	char *metrics_path;
 };
 
 struct mpdcron_module {
@@ -95,8 +238,81 @@ struct mpdcron_module {
 	int (*event_update) (const struct mpd_connection *, const struct mpd_status *);
 };
 
+/**
+ * Everything that happened during one wakeup, passed to v2 modules in a
+ * single call. The objects are shared by all modules and are only valid
+ * during the call. The deltas are NULL unless the matching event is set.
+ */
+struct mpdcron_event_batch {
+	/** Events of this wakeup the module subscribed to */
+	enum mpd_idle events;
+
+	/** Status, NULL if no event needed it */
+	const struct mpd_status *status;
+
+	/** Current song, NULL if the player is stopped or didn't change */
+	const struct mpd_song *song;
+
+	/** Statistics, only set for the database event */
+	const struct mpd_stats *stats;
+
+	const struct mpdcron_queue_delta *queue;
+	const struct mpdcron_playlist_delta *playlists;
+	const struct mpdcron_output_delta *outputs;
+
+	/** Play events, set with the player event */
+	const struct mpdcron_play_delta *play;
+};
+
+struct mpdcron_module_v2 {
+	/** Must be MPDCRON_MODULE_ABI_VERSION */
+	unsigned abi_version;
+
+	/** Name of the module */
+	const char *name;
+
+	/** Flags, see enum mpdcron_module_flags */
+	unsigned flags;
+
+	/** Events the module wants, zero means all of them */
+	enum mpd_idle events;
+
+	/** Initialization function */
+	int (*init) (const struct mpdcron_config *, GKeyFile *);
+
+	/** Cleanup function */
+	void (*destroy) (void);
+
+	/** Function called once per wakeup with the subscribed events */
+	int (*event) (const struct mpd_connection *,
+			const struct mpdcron_event_batch *);
+};
+
+/*
+ * Modules export either a struct mpdcron_module_v2 called mpdcron_module or
+ * the older struct mpdcron_module called module.
+ */
 #ifndef MPDCRON_INTERNAL
 extern struct mpdcron_module module;
+extern struct mpdcron_module_v2 mpdcron_module;
 #endif /* !MPDCRON_INTERNAL */
 
+/**
+ * Borrow an auxiliary connection to the Mpd server, may be called from
+ * module threads.
+ * The connection is not in idle mode and may be used for any query.
+ * Returns NULL if the pool is disabled, exhausted or Mpd is unreachable.
+ * Missing connections are opened in the background, so the first calls
+ * may return NULL as well.
+ */
+struct mpd_connection *
+mpdcron_connection_borrow(void);
+
+/**
+ * Give a borrowed connection back to the pool.
+ * Connections with an unrecoverable error are closed.
+ */
+void
+mpdcron_connection_return(struct mpd_connection *conn);
+
 #endif /* !MPDCRON_GUARD_MODULE_H */
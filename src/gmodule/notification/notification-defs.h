@@ -27,6 +27,14 @@
 #define MPDCRON_MODULE		"notification"
 #include "../gmodule.h"
 
+#ifdef MPDCRON_BUILTIN
+/* Linked into mpdcron next to the other standard modules */
+#define mpdcron_module		mpdcron_module_notification
+#define file_config		notification_file_config
+#define file_load		notification_file_load
+#define file_cleanup		notification_file_cleanup
+#endif /* MPDCRON_BUILTIN */
+
 #include <glib.h>
 
 struct config {
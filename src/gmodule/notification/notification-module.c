@@ -33,32 +33,7 @@
 #include <glib.h>
 #include <mpd/client.h>
 
-static bool was_paused;
-static unsigned last_id = -1;
-static GTimer *timer = NULL;
-
 /* Utility functions */
-static void
-song_paused(void)
-{
-	if (!was_paused)
-		g_timer_stop(timer);
-	was_paused = true;
-}
-
-static void
-song_stopped(void)
-{
-	last_id = -1;
-	was_paused = false;
-}
-
-static void
-song_continued(void)
-{
-	g_timer_continue(timer);
-}
-
 static void
 song_changed(const struct mpd_song *song)
 {
@@ -66,7 +41,6 @@ song_changed(const struct mpd_song *song)
 	char *cpath, *body;
 
 	assert(song != NULL);
-	g_timer_start(timer);
 
 	cpath = cover_find(mpd_song_get_tag(song, MPD_TAG_ARTIST, 0),
 			mpd_song_get_tag(song, MPD_TAG_ALBUM, 0));
@@ -96,33 +70,13 @@ song_changed(const struct mpd_song *song)
 	g_free(cpath);
 }
 
-static void
-song_started(const struct mpd_song *song)
-{
-	song_changed(song);
-}
-
-static void
-song_playing(const struct mpd_song *song, unsigned elapsed)
-{
-	unsigned prev_elapsed = g_timer_elapsed(timer, NULL);
-	if (prev_elapsed > elapsed) {
-		g_debug("Repeated song detected");
-		song_started(song);
-	}
-}
-
 static int
 init(G_GNUC_UNUSED const struct mpdcron_config *conf, GKeyFile *fd)
 {
-	was_paused = false;
-	last_id = -1;
-
 	/* Parse configuration */
 	if (file_load(fd) < 0)
 		return MPDCRON_INIT_FAILURE;
 
-	timer = g_timer_new();
 	g_message("Initialized");
 	return MPDCRON_INIT_SUCCESS;
 }
@@ -132,7 +86,6 @@ destroy(void)
 {
 	g_message("Exiting");
 	file_cleanup();
-	g_timer_destroy(timer);
 }
 
 static int
@@ -181,43 +134,16 @@ event_database(G_GNUC_UNUSED const struct mpd_connection *conn,
 
 static int
 event_player(G_GNUC_UNUSED const struct mpd_connection *conn,
-		const struct mpd_song *song, const struct mpd_status *status)
+		const struct mpdcron_play_delta *play)
 {
-	enum mpd_state state;
-
-	g_assert(status != NULL);
+	g_assert(play != NULL);
 
 	if ((file_config.events | MPD_IDLE_PLAYER) == 0)
 		return MPDCRON_EVENT_SUCCESS;
 
-	state = mpd_status_get_state(status);
-	assert(song != NULL || state != MPD_STATE_PLAY);
-
-	if (state == MPD_STATE_PAUSE) {
-		song_paused();
-		return MPDCRON_EVENT_SUCCESS;
-	}
-	else if (state != MPD_STATE_PLAY) {
-		song_stopped();
-		return MPDCRON_EVENT_SUCCESS;
-	}
-
-	if (was_paused) {
-		if (song != NULL && mpd_song_get_id(song) == last_id)
-			song_continued();
-		was_paused = false;
-	}
-
-	if (song != NULL) {
-		if (mpd_song_get_id(song) != last_id) {
-			/* New song */
-			song_started(song);
-			last_id = mpd_song_get_id(song);
-		}
-		else {
-			/* Still playing the previous song */
-			song_playing(song, mpd_status_get_elapsed_time(status));
-		}
+	for (unsigned i = 0; i < play->count; i++) {
+		if (play->events[i].type == MPDCRON_PLAY_STARTED)
+			song_changed(play->events[i].song);
 	}
 
 	return MPDCRON_EVENT_SUCCESS;
@@ -283,13 +209,28 @@ event_update(G_GNUC_UNUSED const struct mpd_connection *conn,
 	return MPDCRON_EVENT_SUCCESS;
 }
 
-struct mpdcron_module module = {
+static int
+event(const struct mpd_connection *conn, const struct mpdcron_event_batch *batch)
+{
+	if (batch->events & MPD_IDLE_DATABASE)
+		event_database(conn, batch->stats);
+	if (batch->play != NULL)
+		event_player(conn, batch->play);
+	if (batch->events & MPD_IDLE_MIXER)
+		event_mixer(conn, batch->status);
+	if (batch->events & MPD_IDLE_OPTIONS)
+		event_options(conn, batch->status);
+	if (batch->events & MPD_IDLE_UPDATE)
+		event_update(conn, batch->status);
+	return MPDCRON_EVENT_SUCCESS;
+}
+
+struct mpdcron_module_v2 mpdcron_module = {
+	.abi_version = MPDCRON_MODULE_ABI_VERSION,
 	.name = "Notification",
+	.events = MPD_IDLE_DATABASE | MPD_IDLE_PLAYER | MPD_IDLE_MIXER |
+		MPD_IDLE_OPTIONS | MPD_IDLE_UPDATE,
 	.init = init,
 	.destroy = destroy,
-	.event_database = event_database,
-	.event_player = event_player,
-	.event_mixer = event_mixer,
-	.event_options = event_options,
-	.event_update = event_update,
+	.event = event,
 };
@@ -438,6 +438,7 @@ http_client_finish(void)
 
 	g_slist_foreach(http_client.requests, http_request_free_callback, NULL);
 	g_slist_free(http_client.requests);
+	http_client.requests = NULL;
 
 	/* unregister all GPollFD instances */
 
@@ -30,6 +30,14 @@
 #define MPDCRON_MODULE		"scrobbler"
 #include "../gmodule.h"
 
+#ifdef MPDCRON_BUILTIN
+/* Linked into mpdcron next to the other standard modules */
+#define mpdcron_module		mpdcron_module_scrobbler
+#define file_config		scrobbler_file_config
+#define file_load		scrobbler_file_load
+#define file_cleanup		scrobbler_file_cleanup
+#endif /* MPDCRON_BUILTIN */
+
 #include <stdbool.h>
 #include <stddef.h>
 
@@ -785,4 +785,5 @@ void as_cleanup(void)
 {
 	g_slist_foreach(scrobblers, scrobbler_free_callback, NULL);
 	g_slist_free(scrobblers);
+	scrobblers = NULL;
 }
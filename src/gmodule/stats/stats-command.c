@@ -44,11 +44,20 @@ struct command {
 	enum command_return (*handler)(struct client *client, int argc, char **argv);
 };
 
-static const char *current_command;
+/* Commands run on reader threads and those done waiting to be sent */
+static GThreadPool *command_pool = NULL;
+static GAsyncQueue *command_done = NULL;
+
+struct command_job {
+	struct client client;
+	const struct command *cmd;
+	int argc;
+	char *argv[COMMAND_ARGV_MAX];
+};
 
 static int
 command_authorizer(void *userdata, int what,
-		G_GNUC_UNUSED const char *arg1,
+		const char *arg1,
 		const char *arg2,
 		G_GNUC_UNUSED const char *dbname,
 		G_GNUC_UNUSED const char *view)
@@ -67,6 +76,14 @@ command_authorizer(void *userdata, int what,
 	case SQLITE_UPDATE:
 		if (client->perm & PERMISSION_UPDATE)
 			return SQLITE_OK;
+		return SQLITE_DENY;
+	case SQLITE_INSERT:
+	case SQLITE_DELETE:
+		/* Tags are added and removed by linking rows */
+		if ((client->perm & PERMISSION_UPDATE) &&
+				(strcmp(arg1, "tag") == 0 ||
+				 g_str_has_suffix(arg1, "_tag")))
+			return SQLITE_OK;
 		/* fall through */
 	default:
 		return SQLITE_DENY;
@@ -116,11 +133,11 @@ command_error_v(struct client *client, enum ack error, const char *fmt,
 	GString *message;
 
 	g_assert(client != NULL);
-	g_assert(current_command != NULL);
+	g_assert(client->command != NULL);
 
 	message = g_string_new("");
 	g_string_printf(message, PROCOTOL_ACK" [%i] {%s} ",
-			(int)error, current_command);
+			(int)error, client->command);
 	g_string_append_vprintf(message, fmt, args);
 
 	g_debug("[%d]> %s", client->id, message->str);
@@ -128,7 +145,7 @@ command_error_v(struct client *client, enum ack error, const char *fmt,
 
 	server_schedule_write(client, message->str, message->len);
 	g_string_free(message, TRUE);
-	current_command = NULL;
+	client->command = NULL;
 
 	server_flush_write(client);
 }
@@ -1415,6 +1432,40 @@ handle_karma(struct client *client, int argc, char **argv)
 	return COMMAND_RETURN_OK;
 }
 
+static enum command_return
+handle_planner(struct client *client, G_GNUC_UNUSED int argc,
+		G_GNUC_UNUSED char **argv)
+{
+	GError *error;
+	GSList *values, *walk;
+	unsigned int hits, misses;
+
+	error = NULL;
+	values = NULL;
+	if (!db_list_planner(&values, &error)) {
+		command_error(client, error->code, "%s", error->message);
+		g_error_free(error);
+		return COMMAND_RETURN_ERROR;
+	}
+
+	values = g_slist_reverse(values);
+	for (walk = values; walk != NULL; walk = g_slist_next(walk)) {
+		struct db_planner_data *data = (struct db_planner_data *)walk->data;
+		command_puts(client, "table: %s", data->table);
+		if (data->index != NULL)
+			command_puts(client, "index: %s", data->index);
+		command_puts(client, "stat: %s", data->stat);
+		db_planner_data_free(data);
+	}
+	g_slist_free(values);
+
+	db_stmt_cache_stats(&hits, &misses);
+	command_puts(client, "cache_hits: %u", hits);
+	command_puts(client, "cache_misses: %u", misses);
+	command_ok(client);
+	return COMMAND_RETURN_OK;
+}
+
 static enum command_return
 handle_password(struct client *client, G_GNUC_UNUSED int argc, char **argv)
 {
@@ -1474,6 +1525,8 @@ static const struct command commands[] = {
 
 	{ "password", PERMISSION_NONE, 1, 1, handle_password },
 
+	{ "planner", PERMISSION_SELECT, 0, 0, handle_planner },
+
 	{ "rate", PERMISSION_UPDATE, 2, 2, handle_rate },
 	{ "rate_album", PERMISSION_UPDATE, 2, 2, handle_rate_album },
 	{ "rate_artist", PERMISSION_UPDATE, 2, 2, handle_rate_artist },
@@ -1568,7 +1621,7 @@ command_checked_lookup(struct client *client, unsigned permission, int argc,
 	static char unknown[] = "";
 	const struct command *cmd;
 
-	current_command = unknown;
+	client->command = unknown;
 
 	if (argc == 0)
 		return NULL;
@@ -1581,7 +1634,7 @@ command_checked_lookup(struct client *client, unsigned permission, int argc,
 		return NULL;
 	}
 
-	current_command = cmd->cmd;
+	client->command = cmd->cmd;
 
 	if (!command_check_request(cmd, client, permission, argc, argv))
 		return NULL;
@@ -1589,18 +1642,128 @@ command_checked_lookup(struct client *client, unsigned permission, int argc,
 	return cmd;
 }
 
+static void
+command_job_free(struct command_job *job)
+{
+	for (int i = 0; i < job->argc; i++)
+		g_free(job->argv[i]);
+	g_string_free(job->client.buffer, TRUE);
+	g_free(job);
+}
+
+static gboolean
+command_job_finish(G_GNUC_UNUSED gpointer data)
+{
+	struct command_job *job;
+
+	while ((job = g_async_queue_try_pop(command_done)) != NULL) {
+		server_resume(job->client.id, job->client.buffer);
+		command_job_free(job);
+	}
+	return FALSE;
+}
+
+static void
+command_job_run(gpointer data, G_GNUC_UNUSED gpointer userdata)
+{
+	struct command_job *job = (struct command_job *)data;
+
+	db_reader_acquire();
+	db_set_authorizer(command_authorizer, &job->client);
+	job->cmd->handler(&job->client, job->argc, job->argv);
+	db_set_authorizer(NULL, NULL);
+	db_reader_release();
+
+	/* Hand the output over to the main loop */
+	g_async_queue_push(command_done, job);
+	g_idle_add(command_job_finish, command_done);
+}
+
+/* Returns false if the query couldn't be queued, it's run on the main
+ * thread then. */
+static bool
+command_queue(struct client *client, const struct command *cmd,
+		int argc, char **argv)
+{
+	GError *error;
+	struct command_job *job;
+
+	job = g_new0(struct command_job, 1);
+	job->client.id = client->id;
+	job->client.perm = client->perm;
+	job->client.buffer = g_string_new("");
+	job->client.command = cmd->cmd;
+	job->cmd = cmd;
+	job->argc = argc;
+	for (int i = 0; i < argc; i++)
+		job->argv[i] = g_strdup(argv[i]);
+
+	/* Waiting for a reader here would block the main loop */
+	error = NULL;
+	if (!g_thread_pool_push(command_pool, job, &error)) {
+		g_warning("Failed to queue %s: %s", cmd->cmd, error->message);
+		g_error_free(error);
+		command_job_free(job);
+		return false;
+	}
+	client->command = NULL;
+	return true;
+}
+
+void
+command_init(void)
+{
+	GError *error;
+
+	if (globalconf.readers <= 0)
+		return;
+
+	error = NULL;
+	if (!db_readers_open(globalconf.dbpath, globalconf.readers, &error)) {
+		g_warning("Failed to open readers, queries will block: %s",
+				error->message);
+		g_error_free(error);
+		return;
+	}
+
+	command_done = g_async_queue_new();
+	command_pool = g_thread_pool_new(command_job_run, NULL,
+			globalconf.readers, FALSE, NULL);
+}
+
+void
+command_close(void)
+{
+	struct command_job *job;
+
+	if (command_pool == NULL)
+		return;
+
+	/* Let the running queries finish, the clients won't see the output */
+	g_thread_pool_free(command_pool, FALSE, TRUE);
+	command_pool = NULL;
+	while (g_idle_remove_by_data(command_done))
+		;
+	while ((job = g_async_queue_try_pop(command_done)) != NULL)
+		command_job_free(job);
+	g_async_queue_unref(command_done);
+	command_done = NULL;
+
+	db_readers_close();
+}
+
 enum command_return
 command_process(struct client *client, char *line)
 {
 	int argc;
 	char *argv[COMMAND_ARGV_MAX] = { NULL };
-	enum command_return ret = COMMAND_RETURN_ERROR;
+	enum command_return ret;
 	const struct command *cmd;
 	GError *error = NULL;
 
 	argv[0] = tokenizer_next_word(&line, &error);
 	if (argv[0] == NULL) {
-		current_command = "";
+		client->command = "";
 		if (line[0] == '\0')
 			command_error(client, ACK_ERROR_UNKNOWN,
 					"No command given");
@@ -1609,7 +1772,7 @@ command_process(struct client *client, char *line)
 					"%s", error->message);
 			g_error_free(error);
 		}
-		current_command = NULL;
+		client->command = NULL;
 
 		return COMMAND_RETURN_ERROR;
 	}
@@ -1621,46 +1784,42 @@ command_process(struct client *client, char *line)
 		(argv[argc] = tokenizer_next_param(&line, &error)) != NULL)
 		++argc;
 
-	/* Some error checks; we have to set current_command because
+	/* Some error checks; we have to set client->command because
 	 * command_error() expects it to be set.
 	 */
-	current_command = argv[0];
+	client->command = argv[0];
 
 	if (argc >= (int)G_N_ELEMENTS(argv)) {
 		command_error(client, ACK_ERROR_ARG, "Too many arguments");
-		current_command = NULL;
+		client->command = NULL;
 		return COMMAND_RETURN_ERROR;
 	}
 
 	if (*line != 0) {
 		command_error(client, ACK_ERROR_ARG, "%s", error->message);
-		current_command = NULL;
+		client->command = NULL;
 		g_error_free(error);
 		return COMMAND_RETURN_ERROR;
 	}
 
-	/* Remove the previous authorizer */
-	if (!db_set_authorizer(NULL, NULL, &error) ||
-			!db_set_authorizer(command_authorizer, client, &error)) {
-		command_error(client, error->code, "%s", error->message);
-		current_command = NULL;
-		g_error_free(error);
+	/* Look up the command handler. */
+	cmd = command_checked_lookup(client, client->perm, argc, argv);
+	if (cmd == NULL) {
+		client->command = NULL;
 		return COMMAND_RETURN_ERROR;
 	}
 
-	/* Look up and invoke the command handler. */
-	cmd = command_checked_lookup(client, client->perm, argc, argv);
-	if (cmd)
-		ret = cmd->handler(client, argc, argv);
+	/* Queries run on a reader thread */
+	if (command_pool != NULL && cmd->permission == PERMISSION_SELECT &&
+			command_queue(client, cmd, argc, argv))
+		return COMMAND_RETURN_ASYNC;
 
-	/* Disable the authorizer again */
-	if (!db_set_authorizer(NULL, NULL, &error)) {
-		command_error(client, error->code, "%s", error->message);
-		current_command = NULL;
-		g_error_free(error);
-		return COMMAND_RETURN_ERROR;
-	}
+	/* Invoke the command handler, statements it prepares are
+	 * authorized for the client. */
+	db_set_authorizer(command_authorizer, client);
+	ret = cmd->handler(client, argc, argv);
+	db_set_authorizer(NULL, NULL);
 
-	current_command = NULL;
+	client->command = NULL;
 	return ret;
 }
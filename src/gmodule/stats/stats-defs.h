@@ -29,6 +29,13 @@
 #include "../gmodule.h"
 #endif /* !MPDCRON_MODULE */
 
+#ifdef MPDCRON_BUILTIN
+/* Linked into mpdcron next to the other standard modules */
+#define mpdcron_module		mpdcron_module_stats
+#define file_load		stats_file_load
+#define file_cleanup		stats_file_cleanup
+#endif /* MPDCRON_BUILTIN */
+
 #include <stdbool.h>
 
 #include <glib.h>
@@ -42,6 +49,8 @@
 #define DEFAULT_HOST "any"
 #define DEFAULT_PORT 6601
 #define DEFAULT_MAX_CONNECTIONS 16
+#define DEFAULT_OPTIMIZE_INTERVAL 3600
+#define DEFAULT_READERS 4
 
 #define PERMISSION_NONE    0
 #define PERMISSION_SELECT  1
@@ -50,12 +59,18 @@
 
 #define COMMAND_ARGV_MAX 16
 
+/* buffer: Output of a command run on a reader thread, NULL if the output
+ * goes to the stream.
+ * command: Name of the command being processed, for errors.
+ */
 struct client {
 	int id;
 	unsigned perm;
 	GIOStream *stream;
 	GDataInputStream *input;
 	GOutputStream *output;
+	GString *buffer;
+	const char *command;
 };
 
 enum ack {
@@ -70,6 +85,7 @@ enum command_return {
 	COMMAND_RETURN_OK = 0,
 	COMMAND_RETURN_KILL = 10,
 	COMMAND_RETURN_CLOSE = 20,
+	COMMAND_RETURN_ASYNC = 30,
 };
 
 /**
@@ -80,6 +96,8 @@ struct config {
 	char **addrs;
 	int port;
 	char *dbpath;
+	int optimize_interval;
+	int readers;
 	int default_permissions;
 	GHashTable *passwords;
 	char *mpd_hostname;
@@ -101,10 +119,13 @@ void server_start(void);
 void server_close(void);
 void server_schedule_write(struct client *client, const gchar *data, gsize count);
 void server_flush_write(struct client *client);
+void server_resume(int clientid, const GString *output);
 
 /**
  * Commands
  */
+void command_init(void);
+void command_close(void);
 enum command_return command_process(struct client *client, char *line);
 
 #endif /* !MPDCRON_GUARD_STATS_DEFS_H */
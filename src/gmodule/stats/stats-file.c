@@ -68,6 +68,28 @@ file_load(const struct mpdcron_config *conf, GKeyFile *fd)
 	if (globalconf.max_connections <= 0)
 		globalconf.max_connections = DEFAULT_MAX_CONNECTIONS;
 
+	/* Load the interval to refresh the query planner statistics */
+	error = NULL;
+	globalconf.optimize_interval = -1;
+	if (!load_integer(fd, MPDCRON_MODULE, "optimize_interval", false, &globalconf.optimize_interval, &error)) {
+		g_critical("%s", error->message);
+		g_error_free(error);
+		return false;
+	}
+	if (globalconf.optimize_interval < 0)
+		globalconf.optimize_interval = DEFAULT_OPTIMIZE_INTERVAL;
+
+	/* Load the number of read-only connections serving queries */
+	error = NULL;
+	globalconf.readers = -1;
+	if (!load_integer(fd, MPDCRON_MODULE, "readers", false, &globalconf.readers, &error)) {
+		g_critical("%s", error->message);
+		g_error_free(error);
+		return false;
+	}
+	if (globalconf.readers < 0)
+		globalconf.readers = DEFAULT_READERS;
+
 	/* Load default permissions */
 	error = NULL;
 	values = g_key_file_get_string_list(fd, MPDCRON_MODULE, "default_permissions",
@@ -27,68 +27,37 @@
 #include <glib.h>
 #include <sqlite3.h>
 
-static unsigned last_id = -1;
-static bool was_paused = 0;
-static bool is_remote = 0;
-static struct mpd_song *prev = NULL;
-static GTimer *timer = NULL;
-
-static bool
-played_long_enough(int elapsed, int length)
-{
-	return elapsed > 240 || (length >= 30 && elapsed > length / 2);
-}
+/* Globals */
+static int optimize_source_id = -1;
 
 static void
-song_changed(const struct mpd_song *song)
+song_started(const struct mpd_song *song)
 {
 	const char *uri;
 
 	g_assert(song != NULL);
 
-	g_timer_start(timer);
-
 	uri = mpd_song_get_uri(song);
-	is_remote = !!strstr(uri, "://");
-	if (is_remote)
+	if (strstr(uri, "://") != NULL)
 		g_message("New song detected with URL (%s)", uri);
-
-	g_debug("New song detected (%s - %s), id: %u, pos: %u",
-			mpd_song_get_tag(song, MPD_TAG_ARTIST, 0),
-			mpd_song_get_tag(song, MPD_TAG_TITLE, 0),
-			mpd_song_get_id(song), mpd_song_get_pos(song));
-}
-
-static void
-song_started(const struct mpd_song *song)
-{
-	song_changed(song);
 }
 
 static void
-song_ended(const struct mpd_song *song)
+song_ended(const struct mpdcron_play_event *play)
 {
-	bool long_enough;
-	int elapsed, song_duration, percent_played;
 	GError *error;
+	const struct mpd_song *song;
 
+	song = play->song;
 	g_assert(song != NULL);
 
-	elapsed = g_timer_elapsed(timer, NULL);
-	song_duration = mpd_song_get_duration(song);
-	long_enough = played_long_enough(elapsed, song_duration);
-	if (song_duration > 0)
-		percent_played = elapsed * 100 / song_duration;
-	else
-		percent_played = 100;
-
 	g_debug("Saving old song (%s - %s), id: %u, pos: %u",
 			mpd_song_get_tag(song, MPD_TAG_ARTIST, 0),
 			mpd_song_get_tag(song, MPD_TAG_TITLE, 0),
 			mpd_song_get_id(song), mpd_song_get_pos(song));
 
 	error = NULL;
-	if (!db_process(song, long_enough, percent_played, &error)) {
+	if (!db_process(song, play->long_enough, play->percent, &error)) {
 		g_warning("Saving old song failed: %s", error->message);
 		g_error_free(error);
 	}
@@ -98,36 +67,17 @@ song_ended(const struct mpd_song *song)
 	}
 }
 
-static void
-song_playing(const struct mpd_song *song, unsigned elapsed)
-{
-	unsigned prev_elapsed = g_timer_elapsed(timer, NULL);
-	if (prev_elapsed > elapsed) {
-		g_debug("Repeated song detected");
-		song_ended(song);
-		song_started(song);
-	}
-}
-
-static void
-song_continued(void)
-{
-	g_timer_continue(timer);
-}
-
-static void
-song_paused(void)
+static gboolean
+timer_optimize(G_GNUC_UNUSED gpointer data)
 {
-	if (!was_paused)
-		g_timer_stop(timer);
-	was_paused = true;
-}
+	GError *error;
 
-static void
-song_stopped(void)
-{
-	last_id = -1;
-	was_paused = false;
+	error = NULL;
+	if (!db_optimize(&error)) {
+		g_warning("Failed to optimize database: %s", error->message);
+		g_error_free(error);
+	}
+	return TRUE;
 }
 
 /* Module functions */
@@ -151,6 +101,9 @@ init(const struct mpdcron_config *conf, GKeyFile *fd)
 		return MPDCRON_INIT_FAILURE;
 	}
 
+	/* Serve queries from read-only connections */
+	command_init();
+
 	/* Initialize, bind and start the server */
 	server_init();
 	for (unsigned int i = 0; globalconf.addrs[i] != NULL; i++) {
@@ -163,7 +116,13 @@ init(const struct mpdcron_config *conf, GKeyFile *fd)
 	}
 	server_start();
 
-	timer = g_timer_new();
+	/* Refresh the statistics of the query planner when nothing else is
+	 * going on */
+	if (globalconf.optimize_interval > 0)
+		optimize_source_id = g_timeout_add_seconds_full(G_PRIORITY_LOW,
+				globalconf.optimize_interval, timer_optimize,
+				NULL, NULL);
+
 	return MPDCRON_INIT_SUCCESS;
 }
 
@@ -171,74 +130,47 @@ static void
 destroy(void)
 {
 	g_message("Exiting");
-	if (prev != NULL)
-		mpd_song_free(prev);
-	g_timer_destroy(timer);
+	if (optimize_source_id > 0) {
+		g_source_remove(optimize_source_id);
+		optimize_source_id = -1;
+		timer_optimize(NULL);
+	}
+	command_close();
 	server_close();
 	db_close();
 	file_cleanup();
 }
 
 static int
-event_player(G_GNUC_UNUSED const struct mpd_connection *conn,
-		const struct mpd_song *song, const struct mpd_status *status)
+event(G_GNUC_UNUSED const struct mpd_connection *conn,
+		const struct mpdcron_event_batch *batch)
 {
-	enum mpd_state state;
-
-	g_assert(status != NULL);
-
-	state = mpd_status_get_state(status);
+	const struct mpdcron_play_event *play;
 
-	if (state == MPD_STATE_PAUSE) {
-		song_paused();
+	if (batch->play == NULL)
 		return MPDCRON_EVENT_SUCCESS;
-	}
-	else if (state != MPD_STATE_PLAY)
-		song_stopped();
-
-	if (was_paused) {
-		if (song != NULL && mpd_song_get_id(song) == last_id)
-			song_continued();
-		was_paused = false;
-	}
 
-	/* Submit the previous song */
-	if (prev != NULL &&
-	    (song == NULL || mpd_song_get_id(prev) != mpd_song_get_id(song) ||
-	     (is_remote &&
-	      mpd_song_get_tag(song, MPD_TAG_TITLE, 0) != mpd_song_get_tag(prev, MPD_TAG_TITLE, 0))))
-		song_ended(prev);
-
-	if (song != NULL) {
-		if (mpd_song_get_id(song) != last_id ||
-		    (is_remote && prev != NULL &&
-		     mpd_song_get_tag(song, MPD_TAG_TITLE, 0) != mpd_song_get_tag(prev, MPD_TAG_TITLE, 0))) {
-			/* New song. */
-			song_started(song);
-			last_id = mpd_song_get_id(song);
-		}
-		else {
-			/* still playing the previous song */
-			song_playing(song, mpd_status_get_elapsed_time(status));
-		}
-	}
-
-	if (prev != NULL) {
-		mpd_song_free(prev);
-		prev = NULL;
-	}
-	if (song != NULL) {
-		if ((prev = mpd_song_dup(song)) == NULL) {
-			g_critical("mpd_song_dup failed: out of memory");
-			return MPDCRON_EVENT_UNLOAD;
+	for (unsigned i = 0; i < batch->play->count; i++) {
+		play = &batch->play->events[i];
+		switch (play->type) {
+		case MPDCRON_PLAY_STARTED:
+			song_started(play->song);
+			break;
+		case MPDCRON_PLAY_ENDED:
+			song_ended(play);
+			break;
+		default:
+			break;
 		}
 	}
 	return MPDCRON_EVENT_SUCCESS;
 }
 
-struct mpdcron_module module = {
+struct mpdcron_module_v2 mpdcron_module = {
+	.abi_version = MPDCRON_MODULE_ABI_VERSION,
 	.name = "Stats",
+	.events = MPD_IDLE_PLAYER,
 	.init = init,
 	.destroy = destroy,
-	.event_player = event_player,
+	.event = event,
 };
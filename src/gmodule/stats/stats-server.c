@@ -43,6 +43,7 @@ struct buffer {
 static const char GREETING[] = "OK MPDCRON "PROTOCOL_VERSION"\n";
 static GSocketService *server;
 static GHashTable *clients;
+static int next_id;
 
 static void
 client_destroy(gpointer data)
@@ -85,6 +86,7 @@ event_read_line(G_GNUC_UNUSED GObject *source, GAsyncResult *result,
 	gsize length;
 	gchar *line;
 	GError *error;
+	enum command_return ret;
 	struct client *client;
 
 	client = g_hash_table_lookup(clients, clientid);
@@ -113,9 +115,13 @@ event_read_line(G_GNUC_UNUSED GObject *source, GAsyncResult *result,
 	}
 
 	g_debug("[%d]< %s", GPOINTER_TO_INT(clientid), line);
-	command_process(client, line);
+	ret = command_process(client, line);
 	g_free(line);
 
+	/* Reading resumes once a reader thread is done with the command */
+	if (ret == COMMAND_RETURN_ASYNC)
+		return;
+
 	/* Schedule another read */
 	g_data_input_stream_read_line_async(client->input,
 			G_PRIORITY_DEFAULT, NULL, event_read_line, GINT_TO_POINTER(client->id));
@@ -133,13 +139,22 @@ event_incoming(G_GNUC_UNUSED GSocketService *srv, GSocketConnection *conn,
 		g_warning("Maximum connections reached!");
 		return TRUE;
 	}
-	g_debug("[%d]! Connected", num_clients);
 
 	/* Prepare struct client */
 	client = g_new(struct client, 1);
-	client->id = num_clients;
+
+	/* Ids aren't reused, the output of a query run by a reader thread
+	 * must not reach a client which connected after its own left */
+	do {
+		client->id = next_id;
+		next_id = (next_id == G_MAXINT) ? 0 : next_id + 1;
+	} while (g_hash_table_lookup(clients, GINT_TO_POINTER(client->id)) != NULL);
+	g_debug("[%d]! Connected", client->id);
+
 	client->perm = globalconf.default_permissions;
 	client->stream = G_IO_STREAM(conn);
+	client->buffer = NULL;
+	client->command = NULL;
 
 	client->input = g_data_input_stream_new(g_io_stream_get_input_stream(client->stream));
 	g_data_input_stream_set_newline_type(client->input, G_DATA_STREAM_NEWLINE_TYPE_LF);
@@ -304,11 +319,17 @@ server_close(void)
 	g_socket_service_stop(server);
 	g_object_unref(server);
 	g_hash_table_destroy(clients);
+	clients = NULL;
 }
 
 void
 server_schedule_write(struct client *client, const gchar *data, gsize count)
 {
+	if (client->buffer != NULL) {
+		g_string_append_len(client->buffer, data, count);
+		return;
+	}
+
 	/* Since we're writing to a BufferedOutputStream that autogrows this
 	 * call shouldn't fail or block.
 	 */
@@ -318,6 +339,28 @@ server_schedule_write(struct client *client, const gchar *data, gsize count)
 void
 server_flush_write(struct client *client)
 {
+	if (client->buffer != NULL)
+		return;
+
 	g_output_stream_flush_async(client->output, G_PRIORITY_DEFAULT,
 			NULL, event_flush, GINT_TO_POINTER(client->id));
 }
+
+/* Send the output of a command run on a reader thread and read the next one */
+void
+server_resume(int clientid, const GString *output)
+{
+	struct client *client;
+
+	if (clients == NULL ||
+			(client = g_hash_table_lookup(clients, GINT_TO_POINTER(clientid))) == NULL) {
+		/* Disconnected meanwhile */
+		return;
+	}
+
+	server_schedule_write(client, output->str, output->len);
+	server_flush_write(client);
+
+	g_data_input_stream_read_line_async(client->input,
+			G_PRIORITY_DEFAULT, NULL, event_read_line, GINT_TO_POINTER(client->id));
+}
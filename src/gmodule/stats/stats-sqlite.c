@@ -31,7 +31,53 @@
 
 #include "../utils.h"
 
+/* Statements built from client expressions by SQL text, most recently used
+ * first. Statements are authorized when they are prepared, this is fine as
+ * the text decides which commands, hence which permissions, can run them. */
+struct db_stmt_cache_entry {
+	char *sql;
+	sqlite3_stmt *stmt;
+};
+
+struct db_stmt_cache {
+	GHashTable *index;
+	GQueue order;
+	int generation;
+};
+
+struct db_reader {
+	sqlite3 *db;
+	struct db_stmt_cache stmts;
+};
+
+#define DB_STMT_CACHE_SIZE	32
+
+/* Milliseconds a connection waits for a lock held by another one before
+ * the step returns SQLITE_BUSY and the caller tries again. */
+#define DB_BUSY_TIMEOUT		500
+
+/* Bumped when cached statements should be prepared again */
+static gint db_stmt_generation = 0;
+static gint db_stmt_hits = 0;
+static gint db_stmt_misses = 0;
+
+/* The connection recording plays and running updates */
 static sqlite3 *gdb = NULL;
+static struct db_stmt_cache db_stmts;
+
+/* Read-only connections for queries of clients, a thread takes one with
+ * db_reader_acquire() and the read functions use it until it's released. */
+static GAsyncQueue *db_readers = NULL;
+static GPrivate db_reader = G_PRIVATE_INIT(NULL);
+
+/* Authorizer of the statements prepared by the calling thread. Every
+ * connection has the same SQLite authorizer looking it up, changing the
+ * SQLite authorizer would expire the cached statements. */
+struct db_auth {
+	db_auth_func func;
+	void *userdata;
+};
+static GPrivate db_auth = G_PRIVATE_INIT(g_free);
 
 enum {
 	SQL_SET_VERSION,
@@ -42,10 +88,17 @@ enum {
 	SQL_END_TRANSACTION,
 	SQL_ROLLBACK_TRANSACTION,
 
+	SQL_SAVEPOINT,
+	SQL_RELEASE,
+	SQL_ROLLBACK_TO,
+
 	SQL_PRAGMA_SYNC_ON,
 	SQL_PRAGMA_SYNC_OFF,
+	SQL_PRAGMA_JOURNAL_WAL,
+	SQL_PRAGMA_ANALYSIS_LIMIT,
 
 	SQL_VACUUM,
+	SQL_ANALYZE,
 };
 
 enum {
@@ -53,39 +106,61 @@ enum {
 	SQL_DB_CREATE_ARTIST,
 	SQL_DB_CREATE_ALBUM,
 	SQL_DB_CREATE_GENRE,
+
+	SQL_DB_CREATE_TAG,
+	SQL_DB_CREATE_SONG_TAG,
+	SQL_DB_CREATE_ARTIST_TAG,
+	SQL_DB_CREATE_ALBUM_TAG,
+	SQL_DB_CREATE_GENRE_TAG,
+	SQL_DB_CREATE_SONG_TAG_INDEX,
+	SQL_DB_CREATE_ARTIST_TAG_INDEX,
+	SQL_DB_CREATE_ALBUM_TAG_INDEX,
+	SQL_DB_CREATE_GENRE_TAG_INDEX,
+
+	SQL_DB_CREATE_SONG_ARTIST_INDEX,
+	SQL_DB_CREATE_SONG_ALBUM_INDEX,
+	SQL_DB_CREATE_SONG_GENRE_INDEX,
+	SQL_DB_CREATE_SONG_RATING_INDEX,
+	SQL_DB_CREATE_SONG_KARMA_INDEX,
+	SQL_DB_CREATE_SONG_LAST_PLAYED_INDEX,
+	SQL_DB_CREATE_SONG_PLAY_COUNT_INDEX,
+	SQL_DB_CREATE_ALBUM_ARTIST_INDEX,
 };
 
 enum {
 	SQL_DB_MIGRATE_10_11,
+	SQL_DB_MIGRATE_11_12,
+	SQL_DB_MIGRATE_12_13,
+};
+
+enum {
+	SQL_UPSERT_SONG,
+	SQL_UPSERT_SONG_PLAYED,
+	SQL_UPSERT_ARTIST,
+	SQL_UPSERT_ALBUM,
+	SQL_UPSERT_GENRE,
+
+	SQL_UPDATE_ARTIST_ID,
+	SQL_UPDATE_ALBUM_ID,
+	SQL_UPDATE_GENRE_ID,
 };
 
 enum {
-	SQL_HAS_SONG,
-	SQL_HAS_ARTIST,
-	SQL_HAS_ALBUM,
-	SQL_HAS_GENRE,
-
-	SQL_INSERT_SONG,
-	SQL_INSERT_ARTIST,
-	SQL_INSERT_ALBUM,
-	SQL_INSERT_GENRE,
-
-	SQL_UPDATE_SONG,
-	SQL_UPDATE_SONG_PLAYED,
-	SQL_UPDATE_ARTIST,
-	SQL_UPDATE_ALBUM,
-	SQL_UPDATE_GENRE,
+	DB_CACHE_ARTIST,
+	DB_CACHE_ALBUM,
+	DB_CACHE_GENRE,
 };
 
-#define DB_VERSION	11
+#define DB_VERSION	13
 #define DB_MINIMUM_VERSION	10
-#define DB_MIGRATE_STMT_COUNT	2
+#define DB_MIGRATE_STMT_COUNT	21
 #define DB_KARMA_DEFAULT 50
 #define DB_KARMA_DEFAULT_STR "50"
+#define DB_CACHE_SIZE	256
 
 /* Generic database schema independent statements */
 static const char * const db_sql_maint[] = {
-	[SQL_SET_VERSION] = "PRAGMA user_version = 11;",
+	[SQL_SET_VERSION] = "PRAGMA user_version = 13;",
 	[SQL_GET_VERSION] = "PRAGMA user_version;",
 
 	[SQL_SET_ENCODING] = "PRAGMA encoding = \"UTF-8\";",
@@ -94,13 +169,64 @@ static const char * const db_sql_maint[] = {
 	[SQL_END_TRANSACTION] = "END TRANSACTION;",
 	[SQL_ROLLBACK_TRANSACTION] = "ROLLBACK TRANSACTION;",
 
+	[SQL_SAVEPOINT] = "SAVEPOINT db_process;",
+	[SQL_RELEASE] = "RELEASE db_process;",
+	[SQL_ROLLBACK_TO] = "ROLLBACK TO db_process;",
+
 	[SQL_PRAGMA_SYNC_ON] = "PRAGMA synchronous=ON;",
 	[SQL_PRAGMA_SYNC_OFF] = "PRAGMA synchronous=OFF;",
+	[SQL_PRAGMA_JOURNAL_WAL] = "PRAGMA journal_mode=WAL;",
+	[SQL_PRAGMA_ANALYSIS_LIMIT] = "PRAGMA analysis_limit=1000;",
 
 	[SQL_VACUUM] = "VACUUM;",
+	[SQL_ANALYZE] = "ANALYZE;",
 };
 static sqlite3_stmt *db_stmt_maint[G_N_ELEMENTS(db_sql_maint)] = { NULL };
 
+/* Tags are kept in the tag table and linked to the songs, artists, albums
+ * and genres in a table per kind, e.g. song_tag (song, tag). */
+#define DB_SQL_CREATE_TAG						\
+		"create table tag(\n"					\
+			"\tid              INTEGER PRIMARY KEY,\n"		\
+			"\tname            TEXT UNIQUE NOT NULL);\n"
+#define DB_SQL_CREATE_TAG_LINK(table)					\
+		"create table " table "_tag(\n"				\
+			"\t" table "   INTEGER NOT NULL REFERENCES " table "(id),\n" \
+			"\ttag      INTEGER NOT NULL REFERENCES tag(id),\n"	\
+			"\tPRIMARY KEY (" table ", tag)) WITHOUT ROWID;\n"
+#define DB_SQL_CREATE_TAG_INDEX(table)					\
+		"create index " table "_tag_tag on "			\
+			table "_tag (tag, " table ");\n"
+
+/* Colon separated tags of the given row as a column */
+#define DB_SQL_TAGS(table)						\
+		"coalesce((select group_concat(tag.name, ':') "		\
+			"from " table "_tag join tag on tag.id = " table "_tag.tag " \
+			"where " table "_tag." table " = " table ".id), '')"
+
+/* Split the old ":a:b:" tags column of the given table into (id, name) rows */
+#define DB_SQL_SPLIT_TAGS(table)					\
+		"with recursive split(id, name, rest) as ("		\
+			"select id, '', substr(tags, 2) from " table " "	\
+			"union all "						\
+			"select id, substr(rest, 1, instr(rest, ':') - 1),"	\
+				"substr(rest, instr(rest, ':') + 1) "		\
+			"from split where instr(rest, ':') > 0) "
+#define DB_SQL_MIGRATE_TAGS(table)					\
+		"insert or ignore into tag (name) "			\
+			DB_SQL_SPLIT_TAGS(table)				\
+			"select name from split where name <> '';",		\
+		"insert or ignore into " table "_tag (" table ", tag) "	\
+			DB_SQL_SPLIT_TAGS(table)				\
+			"select split.id, tag.id from split "		\
+			"join tag on tag.name = split.name;"
+
+/* Columns eugene expressions usually filter and sort on */
+#define DB_SQL_CREATE_INDEX(table, column)				\
+		"create index " table "_" column " on " table " (" column ");\n"
+#define DB_SQL_CREATE_SONG_ARTIST_INDEX					\
+		"create index song_artist on song (artist, album);\n"
+
 /* Statements for creating a new database */
 static const char * const db_sql_create[] = {
 	[SQL_DB_CREATE_SONG] =
@@ -110,7 +236,6 @@ static const char * const db_sql_create[] = {
 			"\tlove            INTEGER,\n"
 			"\tkill            INTEGER,\n"
 			"\trating          INTEGER,\n"
-			"\ttags            TEXT NOT NULL,\n"
 			"\turi             TEXT UNIQUE NOT NULL,\n"
 			"\tduration        INTEGER,\n"
 			"\tlast_modified   INTEGER,\n"
@@ -138,7 +263,6 @@ static const char * const db_sql_create[] = {
 		"create table artist(\n"
 			"\tid              INTEGER PRIMARY KEY,\n"
 			"\tplay_count      INTEGER,\n"
-			"\ttags            TEXT NOT NULL,\n"
 			"\tname            TEXT UNIQUE NOT NULL,\n"
 			"\tlove            INTEGER,\n"
 			"\tkill            INTEGER,\n"
@@ -147,7 +271,6 @@ static const char * const db_sql_create[] = {
 		"create table album(\n"
 			"\tid              INTEGER PRIMARY KEY,\n"
 			"\tplay_count      INTEGER,\n"
-			"\ttags            TEXT NOT NULL,\n"
 			"\tartist          TEXT,\n"
 			"\tname            TEXT UNIQUE NOT NULL,\n"
 			"\tlove            INTEGER,\n"
@@ -157,13 +280,30 @@ static const char * const db_sql_create[] = {
 		"create table genre(\n"
 			"\tid              INTEGER PRIMARY KEY,\n"
 			"\tplay_count      INTEGER,\n"
-			"\ttags            TEXT NOT NULL,\n"
 			"\tname            TEXT UNIQUE NOT NULL,\n"
 			"\tlove            INTEGER,\n"
 			"\tkill            INTEGER,\n"
 			"\trating          INTEGER);",
+
+	[SQL_DB_CREATE_TAG] = DB_SQL_CREATE_TAG,
+	[SQL_DB_CREATE_SONG_TAG] = DB_SQL_CREATE_TAG_LINK("song"),
+	[SQL_DB_CREATE_ARTIST_TAG] = DB_SQL_CREATE_TAG_LINK("artist"),
+	[SQL_DB_CREATE_ALBUM_TAG] = DB_SQL_CREATE_TAG_LINK("album"),
+	[SQL_DB_CREATE_GENRE_TAG] = DB_SQL_CREATE_TAG_LINK("genre"),
+	[SQL_DB_CREATE_SONG_TAG_INDEX] = DB_SQL_CREATE_TAG_INDEX("song"),
+	[SQL_DB_CREATE_ARTIST_TAG_INDEX] = DB_SQL_CREATE_TAG_INDEX("artist"),
+	[SQL_DB_CREATE_ALBUM_TAG_INDEX] = DB_SQL_CREATE_TAG_INDEX("album"),
+	[SQL_DB_CREATE_GENRE_TAG_INDEX] = DB_SQL_CREATE_TAG_INDEX("genre"),
+
+	[SQL_DB_CREATE_SONG_ARTIST_INDEX] = DB_SQL_CREATE_SONG_ARTIST_INDEX,
+	[SQL_DB_CREATE_SONG_ALBUM_INDEX] = DB_SQL_CREATE_INDEX("song", "album"),
+	[SQL_DB_CREATE_SONG_GENRE_INDEX] = DB_SQL_CREATE_INDEX("song", "genre"),
+	[SQL_DB_CREATE_SONG_RATING_INDEX] = DB_SQL_CREATE_INDEX("song", "rating"),
+	[SQL_DB_CREATE_SONG_KARMA_INDEX] = DB_SQL_CREATE_INDEX("song", "karma"),
+	[SQL_DB_CREATE_SONG_LAST_PLAYED_INDEX] = DB_SQL_CREATE_INDEX("song", "last_played"),
+	[SQL_DB_CREATE_SONG_PLAY_COUNT_INDEX] = DB_SQL_CREATE_INDEX("song", "play_count"),
+	[SQL_DB_CREATE_ALBUM_ARTIST_INDEX] = DB_SQL_CREATE_INDEX("album", "artist"),
 };
-static sqlite3_stmt *db_stmt_create[G_N_ELEMENTS(db_sql_maint)] = { NULL };
 
 static const char * const db_sql_migrate[][DB_MIGRATE_STMT_COUNT] = {
 	[SQL_DB_MIGRATE_10_11] = {
@@ -176,108 +316,172 @@ static const char * const db_sql_migrate[][DB_MIGRATE_STMT_COUNT] = {
 				"CHECK (karma >= 0 AND karma <= 100)\n"
 			"\t\tDEFAULT 50\n;",
 	},
-};
-static sqlite3_stmt
-*db_stmt_migrate[G_N_ELEMENTS(db_sql_migrate)][DB_MIGRATE_STMT_COUNT] = {
-	{ NULL },
+	[SQL_DB_MIGRATE_11_12] = {
+		DB_SQL_CREATE_TAG,
+		DB_SQL_CREATE_TAG_LINK("song"),
+		DB_SQL_CREATE_TAG_LINK("artist"),
+		DB_SQL_CREATE_TAG_LINK("album"),
+		DB_SQL_CREATE_TAG_LINK("genre"),
+		DB_SQL_CREATE_TAG_INDEX("song"),
+		DB_SQL_CREATE_TAG_INDEX("artist"),
+		DB_SQL_CREATE_TAG_INDEX("album"),
+		DB_SQL_CREATE_TAG_INDEX("genre"),
+		DB_SQL_MIGRATE_TAGS("song"),
+		DB_SQL_MIGRATE_TAGS("artist"),
+		DB_SQL_MIGRATE_TAGS("album"),
+		DB_SQL_MIGRATE_TAGS("genre"),
+		"alter table song drop column tags;",
+		"alter table artist drop column tags;",
+		"alter table album drop column tags;",
+		"alter table genre drop column tags;",
+	},
+	[SQL_DB_MIGRATE_12_13] = {
+		DB_SQL_CREATE_SONG_ARTIST_INDEX,
+		DB_SQL_CREATE_INDEX("song", "album"),
+		DB_SQL_CREATE_INDEX("song", "genre"),
+		DB_SQL_CREATE_INDEX("song", "rating"),
+		DB_SQL_CREATE_INDEX("song", "karma"),
+		DB_SQL_CREATE_INDEX("song", "last_played"),
+		DB_SQL_CREATE_INDEX("song", "play_count"),
+		DB_SQL_CREATE_INDEX("album", "artist"),
+		"ANALYZE;",
+	},
 };
 
 static const char * const db_sql[] = {
-	[SQL_HAS_SONG] = "select id from song where uri=?",
-	[SQL_HAS_ARTIST] = "select id from artist where name=?",
-	[SQL_HAS_ALBUM] = "select id from album where name=?",
-	[SQL_HAS_GENRE] = "select id from genre where name=?",
-
-	[SQL_INSERT_SONG] =
+	[SQL_UPSERT_SONG] =
 			"insert into song ("
 				"play_count,"
-				"love, kill, rating, karma, tags,"
+				"love, kill, rating, karma,"
 				"uri, duration, last_modified, last_played,"
 				"artist, album, title,"
 				"track, name, genre,"
 				"date, composer, performer, disc,"
 				"mb_artistid, mb_albumid, mb_trackid)"
 				" values (?,"
-					"0, 0, 0, ?, ':',"
+					"0, 0, 0, ?,"
 					"?, ?, ?, ?,"
 					"?, ?, ?,"
 					"?, ?, ?,"
 					"?, ?, ?, ?,"
-					"?, ?, ?);",
-	[SQL_INSERT_ARTIST] =
+					"?, ?, ?)"
+				" on conflict(uri) do update "
+				"set play_count = play_count + excluded.play_count,"
+				"duration = excluded.duration,"
+				"last_modified = excluded.last_modified,"
+				"artist = excluded.artist,"
+				"album = excluded.album,"
+				"title = excluded.title,"
+				"track = excluded.track,"
+				"name = excluded.name,"
+				"genre = excluded.genre,"
+				"date = excluded.date,"
+				"composer = excluded.composer,"
+				"performer = excluded.performer,"
+				"disc = excluded.disc,"
+				"mb_artistid = excluded.mb_artistid,"
+				"mb_albumid = excluded.mb_albumid,"
+				"mb_trackid = excluded.mb_trackid;",
+	[SQL_UPSERT_SONG_PLAYED] =
+			"insert into song ("
+				"play_count,"
+				"love, kill, rating, karma,"
+				"uri, duration, last_modified, last_played,"
+				"artist, album, title,"
+				"track, name, genre,"
+				"date, composer, performer, disc,"
+				"mb_artistid, mb_albumid, mb_trackid)"
+				" values (?,"
+					"0, 0, 0, ?,"
+					"?, ?, ?, ?,"
+					"?, ?, ?,"
+					"?, ?, ?,"
+					"?, ?, ?, ?,"
+					"?, ?, ?)"
+				" on conflict(uri) do update "
+				"set play_count = play_count + excluded.play_count,"
+				"duration = excluded.duration,"
+				"last_modified = excluded.last_modified,"
+				"last_played = excluded.last_played,"
+				/* Round up to be able to reach 100% */
+				"karma = (karma + ? + 1) / 2,"
+				"artist = excluded.artist,"
+				"album = excluded.album,"
+				"title = excluded.title,"
+				"track = excluded.track,"
+				"name = excluded.name,"
+				"genre = excluded.genre,"
+				"date = excluded.date,"
+				"composer = excluded.composer,"
+				"performer = excluded.performer,"
+				"disc = excluded.disc,"
+				"mb_artistid = excluded.mb_artistid,"
+				"mb_albumid = excluded.mb_albumid,"
+				"mb_trackid = excluded.mb_trackid;",
+	[SQL_UPSERT_ARTIST] =
 			"insert into artist ("
 				"play_count, name,"
-				"love, kill, rating, tags)"
-				" values (?, ?, 0, 0, 0, ':');",
-	[SQL_INSERT_ALBUM] =
+				"love, kill, rating)"
+				" values (?, ?, 0, 0, 0)"
+				" on conflict(name) do update "
+				"set play_count = play_count + excluded.play_count"
+				" returning id;",
+	[SQL_UPSERT_ALBUM] =
 			"insert into album ("
-				"play_count, artist, name,"
-				"love, kill, rating, tags)"
-				" values (?, ?, ?, 0, 0, 0, ':');",
-	[SQL_INSERT_GENRE] =
+				"play_count, name, artist,"
+				"love, kill, rating)"
+				" values (?, ?, ?, 0, 0, 0)"
+				" on conflict(name) do update "
+				"set play_count = play_count + excluded.play_count,"
+				"artist = excluded.artist"
+				" returning id;",
+	[SQL_UPSERT_GENRE] =
 			"insert into genre ("
 				"play_count, name,"
-				"love, kill, rating, tags)"
-				" values (?, ?, 0, 0, 0, ':');",
-
-	[SQL_UPDATE_SONG] =
-			"update song "
-				"set play_count = play_count + ?,"
-				"uri=?,"
-				"duration=?,"
-				"last_modified=?,"
-				"artist=?,"
-				"album=?,"
-				"title=?,"
-				"track=?,"
-				"name=?,"
-				"genre=?,"
-				"date=?,"
-				"composer=?,"
-				"performer=?,"
-				"disc=?,"
-				"mb_artistid=?,"
-				"mb_albumid=?,"
-				"mb_trackid=?"
-				" where id=?;",
-	[SQL_UPDATE_SONG_PLAYED] =
-			"update song "
-				"set play_count = play_count + ?,"
-				"uri=?,"
-				"duration=?,"
-				"last_modified=?,"
-				"last_played = strftime('%s'),"
-				/* Round up to be able to reach 100% */
-				"karma = (karma + ? + 1) / 2,"
-				"artist=?,"
-				"album=?,"
-				"title=?,"
-				"track=?,"
-				"name=?,"
-				"genre=?,"
-				"date=?,"
-				"composer=?,"
-				"performer=?,"
-				"disc=?,"
-				"mb_artistid=?,"
-				"mb_albumid=?,"
-				"mb_trackid=?"
-				" where id=?;",
-	[SQL_UPDATE_ARTIST] =
+				"love, kill, rating)"
+				" values (?, ?, 0, 0, 0)"
+				" on conflict(name) do update "
+				"set play_count = play_count + excluded.play_count"
+				" returning id;",
+
+	/* The name guards against ids of rows removed or renamed by clients
+	 * since they were cached. */
+	[SQL_UPDATE_ARTIST_ID] =
 			"update artist "
-			"set play_count = play_count + ?,"
-			"name=? where id=?;",
-	[SQL_UPDATE_ALBUM] =
+			"set play_count = play_count + ?"
+			" where id=? and name=?;",
+	[SQL_UPDATE_ALBUM_ID] =
 			"update album "
 			"set play_count = play_count + ?,"
-			"artist=?, name=? where id=?;",
-	[SQL_UPDATE_GENRE] =
+			"artist=? where id=? and name=?;",
+	[SQL_UPDATE_GENRE_ID] =
 			"update genre "
-			"set play_count = play_count + ?,"
-			"name=? where id=?;",
+			"set play_count = play_count + ?"
+			" where id=? and name=?;",
 };
 static sqlite3_stmt *db_stmt[G_N_ELEMENTS(db_sql)] = { NULL };
 
+static const struct {
+	unsigned int upsert;
+	unsigned int update;
+} db_name_sql[] = {
+	[DB_CACHE_ARTIST] = { SQL_UPSERT_ARTIST, SQL_UPDATE_ARTIST_ID },
+	[DB_CACHE_ALBUM] = { SQL_UPSERT_ALBUM, SQL_UPDATE_ALBUM_ID },
+	[DB_CACHE_GENRE] = { SQL_UPSERT_GENRE, SQL_UPDATE_GENRE_ID },
+};
+
+/* Ids of the most recently played artists, albums and genres by name */
+struct db_cache_entry {
+	char *name;
+	sqlite3_int64 id;
+};
+
+struct db_cache {
+	GHashTable *index;
+	GQueue order;
+};
+static struct db_cache db_cache[G_N_ELEMENTS(db_name_sql)];
+
 /**
  * Utility Functions
  */
@@ -299,6 +503,106 @@ escape_string(const char *src)
 	return dest;
 }
 
+static int
+db_authorize(G_GNUC_UNUSED void *userdata, int what,
+		const char *arg1, const char *arg2,
+		const char *dbname, const char *view)
+{
+	struct db_auth *auth;
+
+	auth = g_private_get(&db_auth);
+	if (auth == NULL || auth->func == NULL)
+		return SQLITE_OK;
+	return auth->func(auth->userdata, what, arg1, arg2, dbname, view);
+}
+
+static inline sqlite3 *
+db_handle(void)
+{
+	struct db_reader *reader;
+
+	reader = g_private_get(&db_reader);
+	return (reader != NULL) ? reader->db : gdb;
+}
+
+static void
+db_stmt_cache_clear(struct db_stmt_cache *cache)
+{
+	struct db_stmt_cache_entry *entry;
+
+	if (cache->index == NULL)
+		return;
+
+	g_hash_table_destroy(cache->index);
+	cache->index = NULL;
+	while ((entry = g_queue_pop_head(&cache->order)) != NULL) {
+		sqlite3_finalize(entry->stmt);
+		g_free(entry->sql);
+		g_free(entry);
+	}
+}
+
+/*
+ * Return a prepared statement for the SQL text on the connection of the
+ * calling thread, reset to be stepped again. Reset it when done instead of
+ * finalizing it.
+ */
+static sqlite3_stmt *
+db_prepare(const char *sql, GError **error)
+{
+	sqlite3 *db;
+	sqlite3_stmt *stmt;
+	struct db_reader *reader;
+	struct db_stmt_cache *cache;
+	struct db_stmt_cache_entry *entry;
+	GList *link;
+
+	reader = g_private_get(&db_reader);
+	db = (reader != NULL) ? reader->db : gdb;
+	cache = (reader != NULL) ? &reader->stmts : &db_stmts;
+
+	if (cache->generation != g_atomic_int_get(&db_stmt_generation)) {
+		db_stmt_cache_clear(cache);
+		cache->generation = g_atomic_int_get(&db_stmt_generation);
+	}
+
+	if (cache->index != NULL &&
+			(link = g_hash_table_lookup(cache->index, sql)) != NULL) {
+		g_atomic_int_inc(&db_stmt_hits);
+		g_queue_unlink(&cache->order, link);
+		g_queue_push_head_link(&cache->order, link);
+
+		entry = link->data;
+		sqlite3_reset(entry->stmt);
+		sqlite3_clear_bindings(entry->stmt);
+		return entry->stmt;
+	}
+
+	g_atomic_int_inc(&db_stmt_misses);
+	if (sqlite3_prepare_v2(db, sql, -1, &stmt, NULL) != SQLITE_OK) {
+		g_set_error(error, db_quark(), ACK_ERROR_DATABASE_PREPARE,
+				"sqlite3_prepare_v2: %s", sqlite3_errmsg(db));
+		return NULL;
+	}
+
+	if (cache->index == NULL)
+		cache->index = g_hash_table_new(g_str_hash, g_str_equal);
+	else if (cache->order.length >= DB_STMT_CACHE_SIZE) {
+		entry = g_queue_pop_tail(&cache->order);
+		g_hash_table_remove(cache->index, entry->sql);
+		sqlite3_finalize(entry->stmt);
+		g_free(entry->sql);
+		g_free(entry);
+	}
+
+	entry = g_new(struct db_stmt_cache_entry, 1);
+	entry->sql = g_strdup(sql);
+	entry->stmt = stmt;
+	g_queue_push_head(&cache->order, entry);
+	g_hash_table_insert(cache->index, entry->sql, cache->order.head);
+	return stmt;
+}
+
 static int
 db_step(sqlite3_stmt *stmt)
 {
@@ -323,29 +627,6 @@ validate_tag(const char *tag, GError **error)
 	return true;
 }
 
-static char *
-remove_tag(const char *tags, const char *tag)
-{
-	int len;
-	char **list;
-	GString *new;
-
-	len = strlen(tag) + 1;
-	new = g_string_new(":");
-	list = g_strsplit(tags, ":", -1);
-
-	for (unsigned int i = 0; list[i] != NULL; i++) {
-		if (list[i][0] == '\0')
-			continue;
-		else if (strncmp(list[i], tag, len) == 0)
-			continue;
-		g_string_append_printf(new, "%s:", list[i]);
-	}
-	g_strfreev(list);
-
-	return g_string_free(new, FALSE);
-}
-
 void
 db_generic_data_free(struct db_generic_data *data)
 {
@@ -377,388 +658,182 @@ db_song_data_free(struct db_song_data *song)
 }
 
 /**
- * Database Queries
+ * Id Caches
  */
-static int
-db_has_artist(const char *name, GError **error)
+static void
+db_cache_entry_free(gpointer data)
 {
-	int id, ret;
-
-	g_assert(gdb != NULL);
+	struct db_cache_entry *entry = data;
 
-	/* Reset the statement to its initial state */
-	if (sqlite3_reset(db_stmt[SQL_HAS_ARTIST]) != SQLITE_OK) {
-		g_set_error(error, db_quark(), ACK_ERROR_DATABASE_RESET,
-				"sqlite3_reset: %s", sqlite3_errmsg(gdb));
-		return -2;
-	}
-
-	/* Bind the argument */
-	if (sqlite3_bind_text(db_stmt[SQL_HAS_ARTIST], 1, name,
-			-1, SQLITE_STATIC) != SQLITE_OK) {
-		g_set_error(error, db_quark(), ACK_ERROR_DATABASE_BIND,
-				"sqlite3_bind: %s", sqlite3_errmsg(gdb));
-		return -2;
-	}
-
-	/* Step and get the id */
-	id = -1;
-	do {
-		ret = sqlite3_step(db_stmt[SQL_HAS_ARTIST]);
-		if (ret == SQLITE_ROW)
-			id = sqlite3_column_int(db_stmt[SQL_HAS_ARTIST], 0);
-	} while (ret == SQLITE_BUSY || ret == SQLITE_ROW);
-
-	if (ret != SQLITE_DONE) {
-		g_set_error(error, db_quark(), ACK_ERROR_DATABASE_SELECT,
-				"sqlite3_step: %s", sqlite3_errmsg(gdb));
-		return -2;
-	}
-
-	return id;
+	g_free(entry->name);
+	g_free(entry);
 }
 
-static int
-db_has_album(const char *name, GError **error)
+static sqlite3_int64
+db_cache_lookup(struct db_cache *cache, const char *name)
 {
-	int id, ret;
+	GList *link;
 
-	g_assert(gdb != NULL);
+	if (cache->index == NULL ||
+			(link = g_hash_table_lookup(cache->index, name)) == NULL)
+		return -1;
 
-	/* Reset the statement to its initial state */
-	if (sqlite3_reset(db_stmt[SQL_HAS_ALBUM]) != SQLITE_OK) {
-		g_set_error(error, db_quark(), ACK_ERROR_DATABASE_RESET,
-				"sqlite3_reset: %s", sqlite3_errmsg(gdb));
-		return -2;
-	}
+	/* Most recently used first */
+	g_queue_unlink(&cache->order, link);
+	g_queue_push_head_link(&cache->order, link);
+	return ((struct db_cache_entry *)link->data)->id;
+}
 
-	/* Bind the argument */
-	if (sqlite3_bind_text(db_stmt[SQL_HAS_ALBUM], 1, name,
-			-1, SQLITE_STATIC) != SQLITE_OK) {
-		g_set_error(error, db_quark(), ACK_ERROR_DATABASE_BIND,
-				"sqlite3_bind: %s", sqlite3_errmsg(gdb));
-		return -2;
-	}
+static void
+db_cache_remove(struct db_cache *cache, const char *name)
+{
+	GList *link;
 
-	/* Step and get the id */
-	id = -1;
-	do {
-		ret = sqlite3_step(db_stmt[SQL_HAS_ALBUM]);
-		if (ret == SQLITE_ROW)
-			id = sqlite3_column_int(db_stmt[SQL_HAS_ALBUM], 0);
-	} while (ret == SQLITE_BUSY || ret == SQLITE_ROW);
+	if (cache->index == NULL ||
+			(link = g_hash_table_lookup(cache->index, name)) == NULL)
+		return;
 
-	if (ret != SQLITE_DONE) {
-		g_set_error(error, db_quark(), ACK_ERROR_DATABASE_SELECT,
-				"sqlite3_step: %s", sqlite3_errmsg(gdb));
-		return -2;
-	}
-
-	return id;
+	g_hash_table_remove(cache->index, name);
+	g_queue_unlink(&cache->order, link);
+	db_cache_entry_free(link->data);
+	g_list_free_1(link);
 }
 
-static int
-db_has_genre(const char *name, GError **error)
+static void
+db_cache_insert(struct db_cache *cache, const char *name, sqlite3_int64 id)
 {
-	int id, ret;
-
-	g_assert(gdb != NULL);
+	struct db_cache_entry *entry;
 
-	/* Reset the statement to its initial state */
-	if (sqlite3_reset(db_stmt[SQL_HAS_GENRE]) != SQLITE_OK) {
-		g_set_error(error, db_quark(), ACK_ERROR_DATABASE_RESET,
-				"sqlite3_reset: %s", sqlite3_errmsg(gdb));
-		return -2;
+	if (cache->index == NULL) {
+		cache->index = g_hash_table_new(g_str_hash, g_str_equal);
+		g_queue_init(&cache->order);
 	}
+	else
+		db_cache_remove(cache, name);
 
-	/* Bind the argument */
-	if (sqlite3_bind_text(db_stmt[SQL_HAS_GENRE], 1, name,
-			-1, SQLITE_STATIC) != SQLITE_OK) {
-		g_set_error(error, db_quark(), ACK_ERROR_DATABASE_BIND,
-				"sqlite3_bind: %s", sqlite3_errmsg(gdb));
-		return -2;
+	if (cache->order.length >= DB_CACHE_SIZE) {
+		entry = g_queue_pop_tail(&cache->order);
+		g_hash_table_remove(cache->index, entry->name);
+		db_cache_entry_free(entry);
 	}
 
-	/* Step and get the id */
-	id = -1;
-	do {
-		ret = sqlite3_step(db_stmt[SQL_HAS_GENRE]);
-		if (ret == SQLITE_ROW)
-			id = sqlite3_column_int(db_stmt[SQL_HAS_GENRE], 0);
-	} while (ret == SQLITE_BUSY || ret == SQLITE_ROW);
-
-	if (ret != SQLITE_DONE) {
-		g_set_error(error, db_quark(), ACK_ERROR_DATABASE_SELECT,
-				"sqlite3_step: %s", sqlite3_errmsg(gdb));
-		return -2;
-	}
-
-	return id;
+	entry = g_new(struct db_cache_entry, 1);
+	entry->name = g_strdup(name);
+	entry->id = id;
+	g_queue_push_head(&cache->order, entry);
+	g_hash_table_insert(cache->index, entry->name, cache->order.head);
 }
 
-static int
-db_has_song(const char *uri, GError **error)
+static void
+db_cache_clear(void)
 {
-	int id, ret;
-
-	g_assert(gdb != NULL);
-
-	/* Reset the statement to its initial state */
-	if (sqlite3_reset(db_stmt[SQL_HAS_SONG]) != SQLITE_OK) {
-		g_set_error(error, db_quark(), ACK_ERROR_DATABASE_RESET,
-				"sqlite3_reset: %s", sqlite3_errmsg(gdb));
-		return -2;
-	}
-
-	/* Bind the argument */
-	if (sqlite3_bind_text(db_stmt[SQL_HAS_SONG], 1, uri,
-			-1, SQLITE_STATIC) != SQLITE_OK) {
-		g_set_error(error, db_quark(), ACK_ERROR_DATABASE_BIND,
-				"sqlite3_bind: %s", sqlite3_errmsg(gdb));
-		return -2;
-	}
-
-	/* Step and get the id */
-	id = -1;
-	do {
-		ret = sqlite3_step(db_stmt[SQL_HAS_SONG]);
-		if (ret == SQLITE_ROW)
-			id = sqlite3_column_int(db_stmt[SQL_HAS_SONG], 0);
-	} while (ret == SQLITE_BUSY || ret == SQLITE_ROW);
+	struct db_cache_entry *entry;
 
-	if (ret != SQLITE_DONE) {
-		g_set_error(error, db_quark(), ACK_ERROR_DATABASE_SELECT,
-				"sqlite3_step: %s", sqlite3_errmsg(gdb));
-		return -2;
+	for (unsigned int i = 0; i < G_N_ELEMENTS(db_cache); i++) {
+		if (db_cache[i].index == NULL)
+			continue;
+		g_hash_table_destroy(db_cache[i].index);
+		db_cache[i].index = NULL;
+		while ((entry = g_queue_pop_head(&db_cache[i].order)) != NULL)
+			db_cache_entry_free(entry);
 	}
-
-	return id;
 }
 
 /**
  * Database Inserts/Updates
  */
 static bool
-db_insert_artist(const char *artist, bool increment, GError **error)
-{
-	g_assert(gdb != NULL);
-	g_assert(artist != NULL);
-
-	/* Reset the statement to its initial state */
-	if (sqlite3_reset(db_stmt[SQL_INSERT_ARTIST]) != SQLITE_OK) {
-		g_set_error(error, db_quark(), ACK_ERROR_DATABASE_RESET,
-				"sqlite3_reset: %s", sqlite3_errmsg(gdb));
-		return false;
-	}
-
-	if (sqlite3_bind_int(db_stmt[SQL_INSERT_ARTIST],
-				1, increment ? 1 : 0) != SQLITE_OK
-			|| sqlite3_bind_text(db_stmt[SQL_INSERT_ARTIST],
-				2, artist,
-				-1, SQLITE_STATIC) != SQLITE_OK) {
-		g_set_error(error, db_quark(), ACK_ERROR_DATABASE_BIND,
-				"sqlite3_bind: %s", sqlite3_errmsg(gdb));
-		return false;
-	}
-
-	if (db_step(db_stmt[SQL_INSERT_ARTIST]) != SQLITE_DONE) {
-		g_set_error(error, db_quark(), ACK_ERROR_DATABASE_STEP,
-				"sqlite3_step: %s", sqlite3_errmsg(gdb));
-		return false;
-	}
-
-	return true;
-}
-
-static bool
-db_insert_album(const struct mpd_song *song, bool increment,
-		GError **error)
-{
-	g_assert(gdb != NULL);
-	g_assert(song != NULL);
-
-	/* Reset the statement to its initial state */
-	if (sqlite3_reset(db_stmt[SQL_INSERT_ALBUM]) != SQLITE_OK) {
-		g_set_error(error, db_quark(), ACK_ERROR_DATABASE_RESET,
-				"sqlite3_reset: %s", sqlite3_errmsg(gdb));
-		return false;
-	}
-
-	if (sqlite3_bind_int(db_stmt[SQL_INSERT_ALBUM],
-				1, increment ? 1 : 0) != SQLITE_OK
-			|| sqlite3_bind_text(db_stmt[SQL_INSERT_ALBUM],
-				2, mpd_song_get_tag(song, MPD_TAG_ARTIST, 0),
-				-1, SQLITE_STATIC) != SQLITE_OK
-			|| sqlite3_bind_text(db_stmt[SQL_INSERT_ALBUM],
-				3, mpd_song_get_tag(song, MPD_TAG_ALBUM, 0),
-				-1, SQLITE_STATIC) != SQLITE_OK) {
-		g_set_error(error, db_quark(), ACK_ERROR_DATABASE_BIND,
-				"sqlite3_bind: %s", sqlite3_errmsg(gdb));
-		return false;
-	}
-
-	if (db_step(db_stmt[SQL_INSERT_ALBUM]) != SQLITE_DONE) {
-		g_set_error(error, db_quark(), ACK_ERROR_DATABASE_STEP,
-				"sqlite3_step: %s", sqlite3_errmsg(gdb));
-		return false;
-	}
-
-	return true;
-}
-
-static bool
-db_insert_genre(const struct mpd_song *song, bool increment,
-		GError **error)
-{
-	g_assert(gdb != NULL);
-	g_assert(song != NULL);
-
-	/* Reset the statement to its initial state */
-	if (sqlite3_reset(db_stmt[SQL_INSERT_GENRE]) != SQLITE_OK) {
-		g_set_error(error, db_quark(), ACK_ERROR_DATABASE_RESET,
-				"sqlite3_reset (%s): %s",
-				db_sql[SQL_INSERT_GENRE], sqlite3_errmsg(gdb));
-		return false;
-	}
-
-	if (sqlite3_bind_int(db_stmt[SQL_INSERT_GENRE],
-				1, increment ? 1 : 0) != SQLITE_OK
-			|| sqlite3_bind_text(db_stmt[SQL_INSERT_GENRE],
-				2, mpd_song_get_tag(song, MPD_TAG_GENRE, 0),
-				-1, SQLITE_STATIC) != SQLITE_OK) {
-		g_set_error(error, db_quark(), ACK_ERROR_DATABASE_BIND,
-				"sqlite3_bind: %s", sqlite3_errmsg(gdb));
-		return false;
-	}
-
-	if (db_step(db_stmt[SQL_INSERT_GENRE]) != SQLITE_DONE) {
-		g_set_error(error, db_quark(), ACK_ERROR_DATABASE_STEP,
-				"sqlite3_step: %s", sqlite3_errmsg(gdb));
-		return false;
-	}
-
-	return true;
-}
-
-static bool
-db_insert_song(const struct mpd_song *song, const char *artist, const char *title,
+db_upsert_song(const struct mpd_song *song, const char *artist, const char *title,
 	       bool increment, int percent_played, GError **error)
 {
-	int karma;
+	int karma, upsert;
 	bool played;
 
 	g_assert(gdb != NULL);
 	g_assert(song != NULL);
 
-	if (sqlite3_reset(db_stmt[SQL_INSERT_SONG]) != SQLITE_OK) {
-		g_set_error(error, db_quark(), ACK_ERROR_DATABASE_RESET,
-				"sqlite3_reset: %s", sqlite3_errmsg(gdb));
-		return false;
-	}
-
 	if (percent_played >= 0 && percent_played <= 100) {
 		/* Round up to be able to reach 100% */
 		karma = (DB_KARMA_DEFAULT + percent_played + 1) / 2;
 		played = true;
+		upsert = SQL_UPSERT_SONG_PLAYED;
 	} else {
 		karma = DB_KARMA_DEFAULT;
 		played = false;
+		upsert = SQL_UPSERT_SONG;
 	}
 
-	if (sqlite3_bind_int(db_stmt[SQL_INSERT_SONG], 1, increment ? 1 : 0) != SQLITE_OK
-		|| sqlite3_bind_int(db_stmt[SQL_INSERT_SONG], 2, karma)
+	if (sqlite3_reset(db_stmt[upsert]) != SQLITE_OK) {
+		g_set_error(error, db_quark(), ACK_ERROR_DATABASE_RESET,
+				"sqlite3_reset: %s", sqlite3_errmsg(gdb));
+		return false;
+	}
+
+	if (sqlite3_bind_int(db_stmt[upsert], 1, increment ? 1 : 0) != SQLITE_OK
+		|| sqlite3_bind_int(db_stmt[upsert], 2, karma)
 			!= SQLITE_OK
-		|| sqlite3_bind_text(db_stmt[SQL_INSERT_SONG], 3,
+		|| sqlite3_bind_text(db_stmt[upsert], 3,
 			mpd_song_get_uri(song),
 			-1, SQLITE_STATIC) != SQLITE_OK
-		|| sqlite3_bind_int(db_stmt[SQL_INSERT_SONG], 4,
+		|| sqlite3_bind_int(db_stmt[upsert], 4,
 			mpd_song_get_duration(song)) != SQLITE_OK
-		|| sqlite3_bind_int(db_stmt[SQL_INSERT_SONG], 5,
+		|| sqlite3_bind_int(db_stmt[upsert], 5,
 			mpd_song_get_last_modified(song)) != SQLITE_OK
 		|| (played ?
-			sqlite3_bind_int(db_stmt[SQL_INSERT_SONG], 6,
+			sqlite3_bind_int(db_stmt[upsert], 6,
 				time(NULL)) :
-			sqlite3_bind_null(db_stmt[SQL_INSERT_SONG], 6)
+			sqlite3_bind_null(db_stmt[upsert], 6)
 		   ) != SQLITE_OK
-		|| sqlite3_bind_text(db_stmt[SQL_INSERT_SONG], 7,
+		|| sqlite3_bind_text(db_stmt[upsert], 7,
 			artist,
 			-1, SQLITE_STATIC) != SQLITE_OK
-		|| sqlite3_bind_text(db_stmt[SQL_INSERT_SONG], 8,
+		|| sqlite3_bind_text(db_stmt[upsert], 8,
 			mpd_song_get_tag(song, MPD_TAG_ALBUM, 0),
 			-1, SQLITE_STATIC) != SQLITE_OK
-		|| sqlite3_bind_text(db_stmt[SQL_INSERT_SONG], 9,
+		|| sqlite3_bind_text(db_stmt[upsert], 9,
 			title,
 			-1, SQLITE_STATIC) != SQLITE_OK
-		|| sqlite3_bind_text(db_stmt[SQL_INSERT_SONG], 10,
+		|| sqlite3_bind_text(db_stmt[upsert], 10,
 			mpd_song_get_tag(song, MPD_TAG_TRACK, 0),
 			-1, SQLITE_STATIC) != SQLITE_OK
-		|| sqlite3_bind_text(db_stmt[SQL_INSERT_SONG], 11,
+		|| sqlite3_bind_text(db_stmt[upsert], 11,
 			mpd_song_get_tag(song, MPD_TAG_NAME, 0),
 			-1, SQLITE_STATIC) != SQLITE_OK
-		|| sqlite3_bind_text(db_stmt[SQL_INSERT_SONG], 12,
+		|| sqlite3_bind_text(db_stmt[upsert], 12,
 			mpd_song_get_tag(song, MPD_TAG_GENRE, 0),
 			-1, SQLITE_STATIC) != SQLITE_OK
-		|| sqlite3_bind_text(db_stmt[SQL_INSERT_SONG], 13,
+		|| sqlite3_bind_text(db_stmt[upsert], 13,
 			mpd_song_get_tag(song, MPD_TAG_DATE, 0),
 			-1, SQLITE_STATIC) != SQLITE_OK
-		|| sqlite3_bind_text(db_stmt[SQL_INSERT_SONG], 14,
+		|| sqlite3_bind_text(db_stmt[upsert], 14,
 			mpd_song_get_tag(song, MPD_TAG_COMPOSER, 0),
 			-1, SQLITE_STATIC) != SQLITE_OK
-		|| sqlite3_bind_text(db_stmt[SQL_INSERT_SONG], 15,
+		|| sqlite3_bind_text(db_stmt[upsert], 15,
 			mpd_song_get_tag(song, MPD_TAG_PERFORMER, 0),
 			-1, SQLITE_STATIC) != SQLITE_OK
-		|| sqlite3_bind_text(db_stmt[SQL_INSERT_SONG], 16,
+		|| sqlite3_bind_text(db_stmt[upsert], 16,
 			mpd_song_get_tag(song, MPD_TAG_DISC, 0),
 			-1, SQLITE_STATIC) != SQLITE_OK
-		|| sqlite3_bind_text(db_stmt[SQL_INSERT_SONG], 17,
+		|| sqlite3_bind_text(db_stmt[upsert], 17,
 			mpd_song_get_tag(song, MPD_TAG_MUSICBRAINZ_ARTISTID, 0),
 			-1, SQLITE_STATIC) != SQLITE_OK
-		|| sqlite3_bind_text(db_stmt[SQL_INSERT_SONG], 18,
+		|| sqlite3_bind_text(db_stmt[upsert], 18,
 			mpd_song_get_tag(song, MPD_TAG_MUSICBRAINZ_ALBUMID, 0),
 			-1, SQLITE_STATIC) != SQLITE_OK
-		|| sqlite3_bind_text(db_stmt[SQL_INSERT_SONG], 19,
+		|| sqlite3_bind_text(db_stmt[upsert], 19,
 			mpd_song_get_tag(song, MPD_TAG_MUSICBRAINZ_TRACKID, 0),
-			-1, SQLITE_STATIC) != SQLITE_OK) {
-		g_set_error(error, db_quark(), ACK_ERROR_DATABASE_BIND,
-				"sqlite3_bind: %s", sqlite3_errmsg(gdb));
-		return false;
-	}
-
-	if (db_step(db_stmt[SQL_INSERT_SONG]) != SQLITE_DONE) {
-		g_set_error(error, db_quark(), ACK_ERROR_DATABASE_STEP,
-				"sqlite3_step: %s", sqlite3_errmsg(gdb));
-		return false;
-	}
-
-	return true;
-}
-
-static bool
-db_update_artist(const char *artist, int id, bool increment, GError **error)
-{
-	g_assert(gdb != NULL);
-	g_assert(artist != NULL);
-
-	/* Reset the statement to its initial state */
-	if (sqlite3_reset(db_stmt[SQL_UPDATE_ARTIST]) != SQLITE_OK) {
-		g_set_error(error, db_quark(), ACK_ERROR_DATABASE_RESET,
-				"sqlite3_reset: %s", sqlite3_errmsg(gdb));
-		return false;
-	}
-
-	if (sqlite3_bind_int(db_stmt[SQL_UPDATE_ARTIST],
-				1, increment ? 1 : 0) != SQLITE_OK
-			|| sqlite3_bind_text(db_stmt[SQL_UPDATE_ARTIST],
-				2, artist,
-				-1, SQLITE_STATIC) != SQLITE_OK
-			|| sqlite3_bind_int(db_stmt[SQL_UPDATE_ARTIST],
-				3, id) != SQLITE_OK) {
+			-1, SQLITE_STATIC) != SQLITE_OK
+		|| (played ?
+			sqlite3_bind_int(db_stmt[upsert], 20,
+				percent_played) :
+			SQLITE_OK
+		   ) != SQLITE_OK) {
 		g_set_error(error, db_quark(), ACK_ERROR_DATABASE_BIND,
 				"sqlite3_bind: %s", sqlite3_errmsg(gdb));
 		return false;
 	}
 
-	if (db_step(db_stmt[SQL_UPDATE_ARTIST]) != SQLITE_DONE) {
+	if (db_step(db_stmt[upsert]) != SQLITE_DONE) {
 		g_set_error(error, db_quark(), ACK_ERROR_DATABASE_STEP,
 				"sqlite3_step: %s", sqlite3_errmsg(gdb));
 		return false;
@@ -767,174 +842,117 @@ db_update_artist(const char *artist, int id, bool increment, GError **error)
 	return true;
 }
 
-static bool
-db_update_album(const struct mpd_song *song, int id,
-		bool increment, GError **error)
+/* Count a play of an artist, album or genre whose id is cached.
+ * Returns 1 if the row was updated, 0 if it no longer exists under this
+ * name and -1 on error. */
+static int
+db_update_name(unsigned int table, sqlite3_int64 id, const char *name,
+		const char *artist, bool increment, GError **error)
 {
-	g_assert(gdb != NULL);
-	g_assert(song != NULL);
-
-	/* Reset the statement to its initial state */
-	if (sqlite3_reset(db_stmt[SQL_UPDATE_ALBUM]) != SQLITE_OK) {
-		g_set_error(error, db_quark(), ACK_ERROR_DATABASE_RESET,
-				"sqlite3_reset: %s", sqlite3_errmsg(gdb));
-		return false;
-	}
-
-	if (sqlite3_bind_int(db_stmt[SQL_UPDATE_ALBUM],
-				1, increment ? 1 : 0) != SQLITE_OK
-			|| sqlite3_bind_text(db_stmt[SQL_UPDATE_ALBUM],
-				2, mpd_song_get_tag(song, MPD_TAG_ARTIST, 0),
-				-1, SQLITE_STATIC) != SQLITE_OK
-			|| sqlite3_bind_text(db_stmt[SQL_UPDATE_ALBUM],
-				3, mpd_song_get_tag(song, MPD_TAG_ALBUM, 0),
-				-1, SQLITE_STATIC) != SQLITE_OK
-			|| sqlite3_bind_int(db_stmt[SQL_UPDATE_ALBUM],
-				4, id) != SQLITE_OK) {
-		g_set_error(error, db_quark(), ACK_ERROR_DATABASE_BIND,
-				"sqlite3_bind: %s", sqlite3_errmsg(gdb));
-		return false;
-	}
-
-	if (db_step(db_stmt[SQL_UPDATE_ALBUM]) != SQLITE_DONE) {
-		g_set_error(error, db_quark(), ACK_ERROR_DATABASE_STEP,
-				"sqlite3_step: %s", sqlite3_errmsg(gdb));
-		return false;
-	}
-
-	return true;
-}
+	int parameter = 1;
+	sqlite3_stmt *stmt;
 
-static bool
-db_update_genre(const struct mpd_song *song, int id,
-		bool increment, GError **error)
-{
 	g_assert(gdb != NULL);
-	g_assert(song != NULL);
+	g_assert(name != NULL);
 
-	/* Reset the statement to its initial state */
-	if (sqlite3_reset(db_stmt[SQL_UPDATE_GENRE]) != SQLITE_OK) {
+	stmt = db_stmt[db_name_sql[table].update];
+	if (sqlite3_reset(stmt) != SQLITE_OK) {
 		g_set_error(error, db_quark(), ACK_ERROR_DATABASE_RESET,
 				"sqlite3_reset: %s", sqlite3_errmsg(gdb));
-		return false;
+		return -1;
 	}
 
-	if (sqlite3_bind_int(db_stmt[SQL_UPDATE_GENRE],
-				1, increment ? 1 : 0) != SQLITE_OK
-			|| sqlite3_bind_text(db_stmt[SQL_UPDATE_GENRE],
-				2, mpd_song_get_tag(song, MPD_TAG_GENRE, 0),
-				-1, SQLITE_STATIC) != SQLITE_OK
-			|| sqlite3_bind_int(db_stmt[SQL_UPDATE_GENRE],
-				3, id) != SQLITE_OK) {
+	if (sqlite3_bind_int(stmt, parameter++, increment ? 1 : 0) != SQLITE_OK
+			|| (table == DB_CACHE_ALBUM ?
+				sqlite3_bind_text(stmt, parameter++, artist,
+					-1, SQLITE_STATIC) :
+				SQLITE_OK) != SQLITE_OK
+			|| sqlite3_bind_int64(stmt, parameter++, id) != SQLITE_OK
+			|| sqlite3_bind_text(stmt, parameter++, name,
+				-1, SQLITE_STATIC) != SQLITE_OK) {
 		g_set_error(error, db_quark(), ACK_ERROR_DATABASE_BIND,
 				"sqlite3_bind: %s", sqlite3_errmsg(gdb));
-		return false;
+		return -1;
 	}
 
-	if (db_step(db_stmt[SQL_UPDATE_GENRE]) != SQLITE_DONE) {
+	if (db_step(stmt) != SQLITE_DONE) {
 		g_set_error(error, db_quark(), ACK_ERROR_DATABASE_STEP,
 				"sqlite3_step: %s", sqlite3_errmsg(gdb));
-		return false;
+		return -1;
 	}
 
-	return true;
+	return (sqlite3_changes(gdb) > 0) ? 1 : 0;
 }
-
-static bool
-db_update_song(const struct mpd_song *song, const char *artist, const char *title,
-	       int id, bool increment, int percent_played, GError **error)
-{
-	int update;
-	bool played;
-	int ret;
-	int parameter = 1;
-
-	g_assert(gdb != NULL);
-	g_assert(song != NULL);
-
-	if (percent_played >= 0 && percent_played <= 100) {
-		played = true;
-		update = SQL_UPDATE_SONG_PLAYED;
-	} else {
-		played = false;
-		update = SQL_UPDATE_SONG;
-	}
-
-	if (sqlite3_reset(db_stmt[update]) != SQLITE_OK) {
-		g_set_error(error, db_quark(), ACK_ERROR_DATABASE_RESET,
-				"sqlite3_reset: %s", sqlite3_errmsg(gdb));
-		return false;
-	}
-
-	if (sqlite3_bind_int(db_stmt[update], parameter++, increment ? 1 : 0)
-			!= SQLITE_OK
-		|| sqlite3_bind_text(db_stmt[update], parameter++,
-			mpd_song_get_uri(song),
-			-1, SQLITE_STATIC) != SQLITE_OK
-		|| sqlite3_bind_int(db_stmt[update], parameter++,
-			mpd_song_get_duration(song)) != SQLITE_OK
-		|| sqlite3_bind_int(db_stmt[update], parameter++,
-			mpd_song_get_last_modified(song)) != SQLITE_OK
-		|| (played ?
-			sqlite3_bind_int(db_stmt[update], parameter++,
-				percent_played) != SQLITE_OK :
-			false)
-		|| sqlite3_bind_text(db_stmt[update], parameter++,
-			artist,
-			-1, SQLITE_STATIC) != SQLITE_OK
-		|| sqlite3_bind_text(db_stmt[update], parameter++,
-			mpd_song_get_tag(song, MPD_TAG_ALBUM, 0),
-			-1, SQLITE_STATIC) != SQLITE_OK
-		|| sqlite3_bind_text(db_stmt[update], parameter++,
-			title,
-			-1, SQLITE_STATIC) != SQLITE_OK
-		|| sqlite3_bind_text(db_stmt[update], parameter++,
-			mpd_song_get_tag(song, MPD_TAG_TRACK, 0),
-			-1, SQLITE_STATIC) != SQLITE_OK
-		|| sqlite3_bind_text(db_stmt[update], parameter++,
-			mpd_song_get_tag(song, MPD_TAG_NAME, 0),
-			-1, SQLITE_STATIC) != SQLITE_OK
-		|| sqlite3_bind_text(db_stmt[update], parameter++,
-			mpd_song_get_tag(song, MPD_TAG_GENRE, 0),
-			-1, SQLITE_STATIC) != SQLITE_OK
-		|| sqlite3_bind_text(db_stmt[update], parameter++,
-			mpd_song_get_tag(song, MPD_TAG_DATE, 0),
-			-1, SQLITE_STATIC) != SQLITE_OK
-		|| sqlite3_bind_text(db_stmt[update], parameter++,
-			mpd_song_get_tag(song, MPD_TAG_COMPOSER, 0),
-			-1, SQLITE_STATIC) != SQLITE_OK
-		|| sqlite3_bind_text(db_stmt[update], parameter++,
-			mpd_song_get_tag(song, MPD_TAG_PERFORMER, 0),
-			-1, SQLITE_STATIC) != SQLITE_OK
-		|| sqlite3_bind_text(db_stmt[update], parameter++,
-			mpd_song_get_tag(song, MPD_TAG_DISC, 0),
-			-1, SQLITE_STATIC) != SQLITE_OK
-		|| sqlite3_bind_text(db_stmt[update], parameter++,
-			mpd_song_get_tag(song, MPD_TAG_MUSICBRAINZ_ARTISTID, 0),
-			-1, SQLITE_STATIC) != SQLITE_OK
-		|| sqlite3_bind_text(db_stmt[update], parameter++,
-			mpd_song_get_tag(song, MPD_TAG_MUSICBRAINZ_ALBUMID, 0),
-			-1, SQLITE_STATIC) != SQLITE_OK
-		|| sqlite3_bind_text(db_stmt[update], parameter++,
-			mpd_song_get_tag(song, MPD_TAG_MUSICBRAINZ_TRACKID, 0),
-			-1, SQLITE_STATIC) != SQLITE_OK
-		|| sqlite3_bind_int(db_stmt[update], parameter++, id)
-			!= SQLITE_OK)
-	{
+
+/* Insert an artist, album or genre or count a play of it.
+ * Returns the id of the row or -1 on error. */
+static sqlite3_int64
+db_upsert_name(unsigned int table, const char *name, const char *artist,
+		bool increment, GError **error)
+{
+	int ret;
+	sqlite3_int64 id;
+	sqlite3_stmt *stmt;
+
+	g_assert(gdb != NULL);
+	g_assert(name != NULL);
+
+	stmt = db_stmt[db_name_sql[table].upsert];
+	if (sqlite3_reset(stmt) != SQLITE_OK) {
+		g_set_error(error, db_quark(), ACK_ERROR_DATABASE_RESET,
+				"sqlite3_reset: %s", sqlite3_errmsg(gdb));
+		return -1;
+	}
+
+	if (sqlite3_bind_int(stmt, 1, increment ? 1 : 0) != SQLITE_OK
+			|| sqlite3_bind_text(stmt, 2, name,
+				-1, SQLITE_STATIC) != SQLITE_OK
+			|| (table == DB_CACHE_ALBUM ?
+				sqlite3_bind_text(stmt, 3, artist,
+					-1, SQLITE_STATIC) :
+				SQLITE_OK) != SQLITE_OK) {
 		g_set_error(error, db_quark(), ACK_ERROR_DATABASE_BIND,
 				"sqlite3_bind: %s", sqlite3_errmsg(gdb));
-		return false;
+		return -1;
 	}
 
+	/* Step and get the id */
+	id = -1;
 	do {
-		ret = sqlite3_step(db_stmt[update]);
-	} while (ret == SQLITE_BUSY);
+		ret = sqlite3_step(stmt);
+		if (ret == SQLITE_ROW)
+			id = sqlite3_column_int64(stmt, 0);
+	} while (ret == SQLITE_BUSY || ret == SQLITE_ROW);
 
-	if (ret != SQLITE_DONE) {
+	if (ret != SQLITE_DONE || id < 0) {
 		g_set_error(error, db_quark(), ACK_ERROR_DATABASE_STEP,
 				"sqlite3_step: %s", sqlite3_errmsg(gdb));
-		return false;
+		return -1;
+	}
+
+	return id;
+}
+
+static bool
+db_process_name(unsigned int table, const char *name, const char *artist,
+		bool increment, GError **error)
+{
+	int ret;
+	sqlite3_int64 id;
+
+	/* The cached id saves the lookup of the name */
+	if ((id = db_cache_lookup(&db_cache[table], name)) >= 0) {
+		if ((ret = db_update_name(table, id, name, artist, increment, error)) < 0)
+			return false;
+		else if (ret > 0)
+			return true;
+		/* Removed or renamed meanwhile */
+		db_cache_remove(&db_cache[table], name);
 	}
+
+	if ((id = db_upsert_name(table, name, artist, increment, error)) < 0)
+		return false;
+	db_cache_insert(&db_cache[table], name, id);
 	return true;
 }
 
@@ -954,9 +972,7 @@ sql_update_entry(const char *tbl, const char *stmt,
 	g_assert(expr != NULL);
 
 	sql = g_strdup_printf("update %s set %s where %s ;", tbl, stmt, expr);
-	if (sqlite3_prepare_v2(gdb, sql, -1, &sql_stmt, NULL) != SQLITE_OK) {
-		g_set_error(error, db_quark(), ACK_ERROR_DATABASE_PREPARE,
-				"sqlite3_prepare_v2: %s", sqlite3_errmsg(gdb));
+	if ((sql_stmt = db_prepare(sql, error)) == NULL) {
 		g_free(sql);
 		return false;
 	}
@@ -965,10 +981,10 @@ sql_update_entry(const char *tbl, const char *stmt,
 	if (db_step(sql_stmt) != SQLITE_DONE) {
 		g_set_error(error, db_quark(), ACK_ERROR_DATABASE_STEP,
 				"sqlite3_step: %s", sqlite3_errmsg(gdb));
-		sqlite3_finalize(sql_stmt);
+		sqlite3_reset(sql_stmt);
 		return false;
 	}
-	sqlite3_finalize(sql_stmt);
+	sqlite3_reset(sql_stmt);
 	return true;
 }
 
@@ -1003,24 +1019,55 @@ sql_update_song(const char *stmt, const char *expr,
 /**
  * Database Maintenance
  */
+/*
+ * Prepare and execute a single statement. Statements of the schema may refer
+ * to tables created by the previous ones so they can not be prepared at once.
+ */
+static bool
+db_exec_schema(const char *sql, GError **error)
+{
+	sqlite3_stmt *stmt;
+
+	g_assert(gdb != NULL);
+
+	if (sqlite3_prepare_v2(gdb, sql, -1, &stmt, NULL) != SQLITE_OK) {
+		g_set_error(error, db_quark(), ACK_ERROR_DATABASE_PREPARE,
+				"sqlite3_prepare_v2 (%s): %s",
+				sql, sqlite3_errmsg(gdb));
+		return false;
+	}
+
+	if (db_step(stmt) != SQLITE_DONE) {
+		g_set_error(error, db_quark(), ACK_ERROR_DATABASE_STEP,
+				"sqlite3_step (%s): %s",
+				sql, sqlite3_errmsg(gdb));
+		sqlite3_finalize(stmt);
+		return false;
+	}
+
+	sqlite3_finalize(stmt);
+	return true;
+}
+
 static bool
 db_create(GError **error)
 {
 	g_assert(gdb != NULL);
-	g_assert(db_stmt_create[SQL_DB_CREATE_SONG] != NULL);
-	g_assert(db_stmt_create[SQL_DB_CREATE_ARTIST] != NULL);
-	g_assert(db_stmt_create[SQL_DB_CREATE_ALBUM] != NULL);
-	g_assert(db_stmt_create[SQL_DB_CREATE_GENRE] != NULL);
 	g_assert(db_stmt_maint[SQL_SET_ENCODING] != NULL);
 	g_assert(db_stmt_maint[SQL_SET_VERSION] != NULL);
 
 	/**
 	 * Create tables
 	 */
-	if (db_step(db_stmt_create[SQL_DB_CREATE_SONG]) != SQLITE_DONE
-		|| db_step(db_stmt_create[SQL_DB_CREATE_ARTIST]) != SQLITE_DONE
-		|| db_step(db_stmt_create[SQL_DB_CREATE_ALBUM]) != SQLITE_DONE
-		|| db_step(db_stmt_create[SQL_DB_CREATE_GENRE]) != SQLITE_DONE) {
+	for (unsigned int i = 0; i < G_N_ELEMENTS(db_sql_create); i++) {
+		if (!db_exec_schema(db_sql_create[i], error))
+			return false;
+	}
+
+	/**
+	 * Create sqlite_stat1 for the query planner
+	 */
+	if (db_step(db_stmt_maint[SQL_ANALYZE]) != SQLITE_DONE) {
 		g_set_error(error, db_quark(), ACK_ERROR_DATABASE_CREATE,
 				"sqlite3_step: %s", sqlite3_errmsg(gdb));
 		return false;
@@ -1056,40 +1103,10 @@ db_migrate(int stmt_migrate, GError **error)
 {
 	g_assert(gdb != NULL);
 
-	/* Prepare all statements for the migration step */
-	for (unsigned int i = 0; i < DB_MIGRATE_STMT_COUNT; i++) {
-		if (db_sql_migrate[stmt_migrate][i] == NULL) {
-			db_stmt_migrate[stmt_migrate][i] = NULL;
-		} else if (sqlite3_prepare_v2(gdb,
-			db_sql_migrate[stmt_migrate][i], -1,
-			&db_stmt_migrate[stmt_migrate][i], NULL) != SQLITE_OK)
-		{
-			db_stmt_migrate[stmt_migrate][i] = NULL;
-			g_set_error(error, db_quark(),
-					ACK_ERROR_DATABASE_PREPARE,
-					"sqlite3_prepare_v2 (%s): %s",
-					db_sql_migrate[stmt_migrate][i],
-					sqlite3_errmsg(gdb));
-			return false;
-		}
-	}
-	/* Execute all statements for the migration step */
 	for (unsigned int i = 0; i < DB_MIGRATE_STMT_COUNT &&
-			db_stmt_migrate[stmt_migrate][i] != NULL; i++) {
-		if (db_step(db_stmt_migrate[stmt_migrate][i]) != SQLITE_DONE) {
-			g_set_error(error, db_quark(), ACK_ERROR_DATABASE_STEP,
-					"sqlite3_step (%s): %s",
-					db_sql_migrate[stmt_migrate][i],
-					sqlite3_errmsg(gdb));
+			db_sql_migrate[stmt_migrate][i] != NULL; i++) {
+		if (!db_exec_schema(db_sql_migrate[stmt_migrate][i], error))
 			return false;
-		}
-	}
-	for (unsigned int i = 0; i < DB_MIGRATE_STMT_COUNT &&
-			db_stmt_migrate[stmt_migrate][i] != NULL; i++) {
-		if (db_stmt_migrate[stmt_migrate][i] != NULL) {
-			sqlite3_finalize(db_stmt_migrate[stmt_migrate][i]);
-			db_stmt_migrate[stmt_migrate][i] = NULL;
-		}
 	}
 	return true;
 }
@@ -1139,6 +1156,16 @@ db_check_ver(GError **error)
 				"%d to %d", 10, 11);
 			success &= db_migrate(SQL_DB_MIGRATE_10_11, error);
 			/* fall-through to the next version */
+		case 11:
+			g_debug("Upgrading database schema from version "
+				"%d to %d", 11, 12);
+			success = success && db_migrate(SQL_DB_MIGRATE_11_12, error);
+			/* fall-through to the next version */
+		case 12:
+			g_debug("Upgrading database schema from version "
+				"%d to %d", 12, 13);
+			success = success && db_migrate(SQL_DB_MIGRATE_12_13, error);
+			/* fall-through to the next version */
 		}
 		if (db_step(db_stmt_maint[SQL_SET_VERSION]) != SQLITE_DONE) {
 			g_set_error(error, db_quark(), ACK_ERROR_DATABASE_CREATE,
@@ -1159,6 +1186,35 @@ db_check_ver(GError **error)
 	return true;
 }
 
+/* Run a pragma which returns the new value as a row */
+static bool
+db_run_pragma(unsigned int pragma, GError **error)
+{
+	int ret;
+	sqlite3_stmt *stmt;
+
+	g_assert(gdb != NULL);
+
+	stmt = db_stmt_maint[pragma];
+	if (sqlite3_reset(stmt) != SQLITE_OK) {
+		g_set_error(error, db_quark(), ACK_ERROR_DATABASE_RESET,
+				"sqlite3_reset: %s", sqlite3_errmsg(gdb));
+		return false;
+	}
+
+	do {
+		ret = sqlite3_step(stmt);
+	} while (ret == SQLITE_BUSY || ret == SQLITE_ROW);
+
+	if (ret != SQLITE_DONE) {
+		g_set_error(error, db_quark(), ACK_ERROR_DATABASE_STEP,
+				"sqlite3_step: %s", sqlite3_errmsg(gdb));
+		return false;
+	}
+
+	return true;
+}
+
 bool
 db_initialized(void)
 {
@@ -1192,6 +1248,8 @@ db_init(const char *path, bool create, bool readonly,
 		gdb = NULL;
 		return false;
 	}
+	sqlite3_busy_timeout(gdb, DB_BUSY_TIMEOUT);
+	sqlite3_set_authorizer(gdb, db_authorize, NULL);
 
 	for (unsigned int i = 0; i < G_N_ELEMENTS(db_sql_maint); i++) {
 		if (sqlite3_prepare_v2(gdb, db_sql_maint[i], -1,
@@ -1204,29 +1262,10 @@ db_init(const char *path, bool create, bool readonly,
 	}
 
 	if (new) {
-		for (unsigned int i = 0; i < G_N_ELEMENTS(db_sql_create); i++) {
-			if (sqlite3_prepare_v2(gdb, db_sql_create[i], -1,
-					&db_stmt_create[i], NULL) != SQLITE_OK) {
-				g_set_error(error, db_quark(), ACK_ERROR_DATABASE_PREPARE,
-						"sqlite3_prepare_v2 (%s): %s",
-						db_sql_maint[i], sqlite3_errmsg(gdb));
-				db_close();
-				return false;
-			}
-		}
-
 		if (!db_create(error)) {
 			db_close();
 			return false;
 		}
-
-		for (unsigned int i = 0; i < G_N_ELEMENTS(db_sql_create); i++) {
-			if (db_stmt_create[i] != NULL) {
-				sqlite3_finalize(db_stmt_create[i]);
-				db_stmt_create[i] = NULL;
-			}
-		}
-
 	}
 	else {
 		if (!db_check_ver(error)) {
@@ -1235,6 +1274,21 @@ db_init(const char *path, bool create, bool readonly,
 		}
 	}
 
+	/* Readers don't block the writer and each other in WAL mode, where
+	 * synchronous=NORMAL is safe */
+	if (!readonly && (!db_run_pragma(SQL_PRAGMA_JOURNAL_WAL, error) ||
+				!db_set_sync(true, error))) {
+		db_close();
+		return false;
+	}
+
+	/* Bound the rows ANALYZE looks at per index, db_optimize() runs it
+	 * periodically on databases of any size. */
+	if (!readonly && !db_run_pragma(SQL_PRAGMA_ANALYSIS_LIMIT, error)) {
+		db_close();
+		return false;
+	}
+
 	/* Prepare common statements */
 	for (unsigned int i = 0; i < G_N_ELEMENTS(db_sql); i++) {
 		g_assert(db_stmt[i] == NULL);
@@ -1253,6 +1307,8 @@ db_init(const char *path, bool create, bool readonly,
 void
 db_close(void)
 {
+	db_cache_clear();
+	db_stmt_cache_clear(&db_stmts);
 	for (unsigned int i = 0; i < G_N_ELEMENTS(db_sql_maint); i++) {
 		if (db_stmt_maint[i] != NULL) {
 			sqlite3_finalize(db_stmt_maint[i]);
@@ -1270,21 +1326,92 @@ db_close(void)
 }
 
 bool
-db_set_authorizer(int (*xAuth)(void *, int, const char *, const char *,
-			const char *,const char *),
-		void *userdata, GError **error)
+db_readers_open(const char *path, unsigned int count, GError **error)
 {
-	g_assert(gdb != NULL);
+	sqlite3 *db;
+	struct db_reader *reader;
 
-	if (sqlite3_set_authorizer(gdb, xAuth, userdata) != SQLITE_OK) {
-		g_set_error(error, db_quark(), ACK_ERROR_DATABASE_AUTH,
-				"sqlite3_set_authorizer: %s",
-				sqlite3_errmsg(gdb));
-		return false;
+	g_assert(db_readers == NULL);
+
+	db_readers = g_async_queue_new();
+	for (unsigned int i = 0; i < count; i++) {
+		if (sqlite3_open_v2(path, &db, SQLITE_OPEN_READONLY, NULL) != SQLITE_OK) {
+			g_set_error(error, db_quark(), ACK_ERROR_DATABASE_OPEN,
+					"sqlite3_open_v2: %s", sqlite3_errmsg(db));
+			sqlite3_close(db);
+			db_readers_close();
+			return false;
+		}
+		sqlite3_busy_timeout(db, DB_BUSY_TIMEOUT);
+		sqlite3_set_authorizer(db, db_authorize, NULL);
+		reader = g_new0(struct db_reader, 1);
+		reader->db = db;
+		g_async_queue_push(db_readers, reader);
 	}
 	return true;
 }
 
+void
+db_readers_close(void)
+{
+	struct db_reader *reader;
+
+	if (db_readers == NULL)
+		return;
+
+	while ((reader = g_async_queue_try_pop(db_readers)) != NULL) {
+		db_stmt_cache_clear(&reader->stmts);
+		sqlite3_close(reader->db);
+		g_free(reader);
+	}
+	g_async_queue_unref(db_readers);
+	db_readers = NULL;
+}
+
+/* Wait for a free reader and use it in the calling thread */
+void
+db_reader_acquire(void)
+{
+	g_assert(db_readers != NULL);
+	g_assert(g_private_get(&db_reader) == NULL);
+
+	g_private_set(&db_reader, g_async_queue_pop(db_readers));
+}
+
+void
+db_reader_release(void)
+{
+	struct db_reader *reader;
+
+	reader = g_private_get(&db_reader);
+	g_assert(reader != NULL);
+
+	g_private_set(&db_reader, NULL);
+	g_async_queue_push(db_readers, reader);
+}
+
+void
+db_stmt_cache_stats(unsigned int *hits, unsigned int *misses)
+{
+	*hits = g_atomic_int_get(&db_stmt_hits);
+	*misses = g_atomic_int_get(&db_stmt_misses);
+}
+
+/* Authorize the statements the calling thread prepares with xAuth, NULL
+ * allows everything */
+void
+db_set_authorizer(db_auth_func xAuth, void *userdata)
+{
+	struct db_auth *auth;
+
+	if ((auth = g_private_get(&db_auth)) == NULL) {
+		auth = g_new(struct db_auth, 1);
+		g_private_set(&db_auth, auth);
+	}
+	auth->func = xAuth;
+	auth->userdata = userdata;
+}
+
 /**
  * Execute a single SQL statement without an expected result
  */
@@ -1292,7 +1419,7 @@ bool
 db_run_stmt(unsigned int stmt, GError **error)
 {
 	g_assert(gdb != NULL);
-	g_assert(stmt < G_N_ELEMENTS(db_stmt));
+	g_assert(stmt < G_N_ELEMENTS(db_stmt_maint));
 
 	if (sqlite3_reset(db_stmt_maint[stmt]) != SQLITE_OK) {
 		g_set_error(error, db_quark(), ACK_ERROR_DATABASE_RESET,
@@ -1375,12 +1502,97 @@ db_vacuum(GError **error)
 	return true;
 }
 
+/* Refresh the statistics of the query planner. PRAGMA optimize would only
+ * look at tables queried on this connection, but client queries run on the
+ * read-only connections, so run an ANALYZE bounded by analysis_limit. */
+bool
+db_optimize(GError **error)
+{
+	if (!db_run_stmt(SQL_ANALYZE, error))
+		return false;
+
+	/* Plan the cached statements again with the new statistics */
+	g_atomic_int_inc(&db_stmt_generation);
+	return true;
+}
+
+void
+db_planner_data_free(struct db_planner_data *data)
+{
+	g_free(data->table);
+	g_free(data->index);
+	g_free(data->stat);
+	g_free(data);
+}
+
+bool
+db_list_planner(GSList **values, GError **error)
+{
+	sqlite3 *db = db_handle();
+	int ret;
+	sqlite3_stmt *stmt;
+	struct db_planner_data *data;
+
+	g_assert(db != NULL);
+	g_assert(values != NULL);
+
+	if (sqlite3_prepare_v2(db, "select tbl, idx, stat from sqlite_stat1 "
+				"order by tbl, idx;", -1, &stmt, NULL) != SQLITE_OK) {
+		g_set_error(error, db_quark(), ACK_ERROR_DATABASE_PREPARE,
+				"sqlite3_prepare_v2: %s", sqlite3_errmsg(db));
+		return false;
+	}
+
+	do {
+		ret = sqlite3_step(stmt);
+		switch (ret) {
+		case SQLITE_ROW:
+			data = g_new0(struct db_planner_data, 1);
+			data->table = g_strdup((const char *)sqlite3_column_text(stmt, 0));
+			data->index = g_strdup((const char *)sqlite3_column_text(stmt, 1));
+			data->stat = g_strdup((const char *)sqlite3_column_text(stmt, 2));
+			*values = g_slist_prepend(*values, data);
+			break;
+		case SQLITE_DONE:
+			break;
+		case SQLITE_BUSY:
+			/* no-op */
+			break;
+		default:
+			g_set_error(error, db_quark(), ACK_ERROR_DATABASE_STEP,
+					"sqlite3_step: %s", sqlite3_errmsg(db));
+			sqlite3_finalize(stmt);
+			return false;
+		}
+	} while (ret != SQLITE_DONE);
+
+	sqlite3_finalize(stmt);
+	return true;
+}
+
+/* Undo the changes of a failed db_process() without touching the
+ * transaction of the caller, if any. */
+static void
+db_process_rollback(void)
+{
+	GError *error = NULL;
+
+	/* The cached ids may refer to rows which were rolled back */
+	db_cache_clear();
+
+	if (!db_run_stmt(SQL_ROLLBACK_TO, &error) ||
+			!db_run_stmt(SQL_RELEASE, &error)) {
+		g_warning("Failed to roll back: %s", error->message);
+		g_error_free(error);
+	}
+}
+
 bool
 db_process(const struct mpd_song *song, bool increment, int percent_played,
 		GError **error)
 {
-	int id;
 	char *artist, *title;
+	const char *tag;
 
 	g_assert(gdb != NULL);
 	g_assert(song != NULL);
@@ -1392,72 +1604,39 @@ db_process(const struct mpd_song *song, bool increment, int percent_played,
 		return true;
 	}
 
-	if ((id = db_has_song(mpd_song_get_uri(song), error)) < -1) {
+	if (!db_run_stmt(SQL_SAVEPOINT, error)) {
 		g_free(artist);
 		g_free(title);
 		return false;
-	} else if (id == -1) {
-		if (!db_insert_song(song, artist, title, increment, percent_played, error)) {
-			g_free(artist);
-			g_free(title);
-			return false;
-		}
-	}
-	else {
-		if (!db_update_song(song, artist, title, id, increment, percent_played, error)) {
-			g_free(artist);
-			g_free(title);
-			return false;
-		}
 	}
-	g_free(title);
 
-	if ((id = db_has_artist(artist, error)) < -1) {
-		g_free(artist);
-		return false;
-	} else if (id == -1) {
-		if (!db_insert_artist(artist, increment, error)) {
-			g_free(artist);
-			return false;
-		}
-	}
-	else {
-		if (!db_update_artist(artist, id, increment, error)) {
-			g_free(artist);
-			return false;
-		}
-	}
-	g_free(artist);
+	if (!db_upsert_song(song, artist, title, increment, percent_played, error))
+		goto fail;
+	if (!db_process_name(DB_CACHE_ARTIST, artist, NULL, increment, error))
+		goto fail;
+	if ((tag = mpd_song_get_tag(song, MPD_TAG_ALBUM, 0)) != NULL &&
+			!db_process_name(DB_CACHE_ALBUM, tag,
+				mpd_song_get_tag(song, MPD_TAG_ARTIST, 0),
+				increment, error))
+		goto fail;
+	if ((tag = mpd_song_get_tag(song, MPD_TAG_GENRE, 0)) != NULL &&
+			!db_process_name(DB_CACHE_GENRE, tag, NULL, increment, error))
+		goto fail;
 
-	if (mpd_song_get_tag(song, MPD_TAG_ALBUM, 0) != NULL) {
-		if ((id = db_has_album(mpd_song_get_tag(song, MPD_TAG_ALBUM, 0),
-				error)) < -1)
-			return false;
-		else if (id == -1) {
-			if (!db_insert_album(song, increment, error))
-				return false;
-		}
-		else {
-			if (!db_update_album(song, id, increment, error))
-				return false;
-		}
-	}
+	g_free(artist);
+	g_free(title);
 
-	if (mpd_song_get_tag(song, MPD_TAG_GENRE, 0) != NULL) {
-		if ((id = db_has_genre(mpd_song_get_tag(song, MPD_TAG_GENRE, 0),
-				error)) < -1)
-			return false;
-		else if (id == -1) {
-			if (!db_insert_genre(song, increment, error))
-				return false;
-		}
-		else {
-			if (!db_update_genre(song, id, increment, error))
-				return false;
-		}
+	if (!db_run_stmt(SQL_RELEASE, error)) {
+		db_process_rollback();
+		return false;
 	}
-
 	return true;
+
+fail:
+	g_free(artist);
+	g_free(title);
+	db_process_rollback();
+	return false;
 }
 
 /**
@@ -1471,19 +1650,18 @@ bool
 db_list_artist_expr(const char *expr, GSList **values,
 		GError **error)
 {
+	sqlite3 *db = db_handle();
 	int ret;
 	char *sql;
 	sqlite3_stmt *stmt;
 	struct db_generic_data *data;
 
-	g_assert(gdb != NULL);
+	g_assert(db != NULL);
 	g_assert(expr != NULL);
 	g_assert(values != NULL);
 
 	sql = g_strdup_printf("select id, name from artist where %s ;", expr);
-	if (sqlite3_prepare_v2(gdb, sql, -1, &stmt, NULL) != SQLITE_OK) {
-		g_set_error(error, db_quark(), ACK_ERROR_DATABASE_PREPARE,
-				"sqlite3_prepare_v2: %s", sqlite3_errmsg(gdb));
+	if ((stmt = db_prepare(sql, error)) == NULL) {
 		g_free(sql);
 		return false;
 	}
@@ -1505,13 +1683,13 @@ db_list_artist_expr(const char *expr, GSList **values,
 			break;
 		default:
 			g_set_error(error, db_quark(), ACK_ERROR_DATABASE_STEP,
-					"sqlite3_step: %s", sqlite3_errmsg(gdb));
-			sqlite3_finalize(stmt);
+					"sqlite3_step: %s", sqlite3_errmsg(db));
+			sqlite3_reset(stmt);
 			return false;
 		}
 	} while (ret != SQLITE_DONE);
 
-	sqlite3_finalize(stmt);
+	sqlite3_reset(stmt);
 	return true;
 }
 
@@ -1519,19 +1697,18 @@ bool
 db_list_album_expr(const char *expr, GSList **values,
 		GError **error)
 {
+	sqlite3 *db = db_handle();
 	int ret;
 	char *sql;
 	struct db_generic_data *data;
 	sqlite3_stmt *stmt;
 
-	g_assert(gdb != NULL);
+	g_assert(db != NULL);
 	g_assert(expr != NULL);
 	g_assert(values != NULL);
 
 	sql = g_strdup_printf("select id, name, artist from album where %s ;", expr);
-	if (sqlite3_prepare_v2(gdb, sql, -1, &stmt, NULL) != SQLITE_OK) {
-		g_set_error(error, db_quark(), ACK_ERROR_DATABASE_PREPARE,
-				"sqlite3_prepare_v2: %s", sqlite3_errmsg(gdb));
+	if ((stmt = db_prepare(sql, error)) == NULL) {
 		g_free(sql);
 		return false;
 	}
@@ -1554,13 +1731,13 @@ db_list_album_expr(const char *expr, GSList **values,
 			break;
 		default:
 			g_set_error(error, db_quark(), ACK_ERROR_DATABASE_STEP,
-					"sqlite3_step: %s", sqlite3_errmsg(gdb));
-			sqlite3_finalize(stmt);
+					"sqlite3_step: %s", sqlite3_errmsg(db));
+			sqlite3_reset(stmt);
 			return false;
 		}
 	} while (ret != SQLITE_DONE);
 
-	sqlite3_finalize(stmt);
+	sqlite3_reset(stmt);
 	return true;
 }
 
@@ -1568,19 +1745,18 @@ bool
 db_list_genre_expr(const char *expr, GSList **values,
 		GError **error)
 {
+	sqlite3 *db = db_handle();
 	int ret;
 	char *sql;
 	struct db_generic_data *data;
 	sqlite3_stmt *stmt;
 
-	g_assert(gdb != NULL);
+	g_assert(db != NULL);
 	g_assert(expr != NULL);
 	g_assert(values != NULL);
 
 	sql = g_strdup_printf("select id, name from genre where %s ;", expr);
-	if (sqlite3_prepare_v2(gdb, sql, -1, &stmt, NULL) != SQLITE_OK) {
-		g_set_error(error, db_quark(), ACK_ERROR_DATABASE_PREPARE,
-				"sqlite3_prepare_v2: %s", sqlite3_errmsg(gdb));
+	if ((stmt = db_prepare(sql, error)) == NULL) {
 		g_free(sql);
 		return false;
 	}
@@ -1602,13 +1778,13 @@ db_list_genre_expr(const char *expr, GSList **values,
 			break;
 		default:
 			g_set_error(error, db_quark(), ACK_ERROR_DATABASE_STEP,
-					"sqlite3_step: %s", sqlite3_errmsg(gdb));
-			sqlite3_finalize(stmt);
+					"sqlite3_step: %s", sqlite3_errmsg(db));
+			sqlite3_reset(stmt);
 			return false;
 		}
 	} while (ret != SQLITE_DONE);
 
-	sqlite3_finalize(stmt);
+	sqlite3_reset(stmt);
 	return true;
 }
 
@@ -1616,19 +1792,18 @@ bool
 db_list_song_expr(const char *expr, GSList **values,
 		GError **error)
 {
+	sqlite3 *db = db_handle();
 	int ret;
 	char *sql;
 	struct db_song_data *song;
 	sqlite3_stmt *stmt;
 
-	g_assert(gdb != NULL);
+	g_assert(db != NULL);
 	g_assert(expr != NULL);
 	g_assert(values != NULL);
 
 	sql = g_strdup_printf("select id, uri from song where %s ;", expr);
-	if (sqlite3_prepare_v2(gdb, sql, -1, &stmt, NULL) != SQLITE_OK) {
-		g_set_error(error, db_quark(), ACK_ERROR_DATABASE_PREPARE,
-				"sqlite3_prepare_v2: %s", sqlite3_errmsg(gdb));
+	if ((stmt = db_prepare(sql, error)) == NULL) {
 		g_free(sql);
 		return false;
 	}
@@ -1650,13 +1825,13 @@ db_list_song_expr(const char *expr, GSList **values,
 			break;
 		default:
 			g_set_error(error, db_quark(), ACK_ERROR_DATABASE_STEP,
-					"sqlite3_step: %s", sqlite3_errmsg(gdb));
-			sqlite3_finalize(stmt);
+					"sqlite3_step: %s", sqlite3_errmsg(db));
+			sqlite3_reset(stmt);
 			return false;
 		}
 	} while (ret != SQLITE_DONE);
 
-	sqlite3_finalize(stmt);
+	sqlite3_reset(stmt);
 	return true;
 }
 
@@ -1664,21 +1839,20 @@ bool
 db_listinfo_artist_expr(const char *expr, GSList **values,
 		GError **error)
 {
+	sqlite3 *db = db_handle();
 	int ret;
 	char *sql;
 	sqlite3_stmt *stmt;
 	struct db_generic_data *data;
 
-	g_assert(gdb != NULL);
+	g_assert(db != NULL);
 	g_assert(expr != NULL);
 	g_assert(values != NULL);
 
 	sql = g_strdup_printf("select "
 			"id, play_count, name, love, kill, rating "
 			"from artist where %s ;", expr);
-	if (sqlite3_prepare_v2(gdb, sql, -1, &stmt, NULL) != SQLITE_OK) {
-		g_set_error(error, db_quark(), ACK_ERROR_DATABASE_PREPARE,
-				"sqlite3_prepare_v2: %s", sqlite3_errmsg(gdb));
+	if ((stmt = db_prepare(sql, error)) == NULL) {
 		g_free(sql);
 		return false;
 	}
@@ -1704,13 +1878,13 @@ db_listinfo_artist_expr(const char *expr, GSList **values,
 			break;
 		default:
 			g_set_error(error, db_quark(), ACK_ERROR_DATABASE_STEP,
-					"sqlite3_step: %s", sqlite3_errmsg(gdb));
-			sqlite3_finalize(stmt);
+					"sqlite3_step: %s", sqlite3_errmsg(db));
+			sqlite3_reset(stmt);
 			return false;
 		}
 	} while (ret != SQLITE_DONE);
 
-	sqlite3_finalize(stmt);
+	sqlite3_reset(stmt);
 	return true;
 }
 
@@ -1718,21 +1892,20 @@ bool
 db_listinfo_album_expr(const char *expr, GSList **values,
 		GError **error)
 {
+	sqlite3 *db = db_handle();
 	int ret;
 	char *sql;
 	sqlite3_stmt *stmt;
 	struct db_generic_data *data;
 
-	g_assert(gdb != NULL);
+	g_assert(db != NULL);
 	g_assert(expr != NULL);
 	g_assert(values != NULL);
 
 	sql = g_strdup_printf("select "
 			"id, play_count, name, artist, love, kill, rating "
 			"from album where %s ;", expr);
-	if (sqlite3_prepare_v2(gdb, sql, -1, &stmt, NULL) != SQLITE_OK) {
-		g_set_error(error, db_quark(), ACK_ERROR_DATABASE_PREPARE,
-				"sqlite3_prepare_v2: %s", sqlite3_errmsg(gdb));
+	if ((stmt = db_prepare(sql, error)) == NULL) {
 		g_free(sql);
 		return false;
 	}
@@ -1759,13 +1932,13 @@ db_listinfo_album_expr(const char *expr, GSList **values,
 			break;
 		default:
 			g_set_error(error, db_quark(), ACK_ERROR_DATABASE_STEP,
-					"sqlite3_step: %s", sqlite3_errmsg(gdb));
-			sqlite3_finalize(stmt);
+					"sqlite3_step: %s", sqlite3_errmsg(db));
+			sqlite3_reset(stmt);
 			return false;
 		}
 	} while (ret != SQLITE_DONE);
 
-	sqlite3_finalize(stmt);
+	sqlite3_reset(stmt);
 	return true;
 }
 
@@ -1773,21 +1946,20 @@ bool
 db_listinfo_genre_expr(const char *expr, GSList **values,
 		GError **error)
 {
+	sqlite3 *db = db_handle();
 	int ret;
 	char *sql;
 	sqlite3_stmt *stmt;
 	struct db_generic_data *data;
 
-	g_assert(gdb != NULL);
+	g_assert(db != NULL);
 	g_assert(expr != NULL);
 	g_assert(values != NULL);
 
 	sql = g_strdup_printf("select "
 			"id, play_count, name, love, kill, rating "
 			"from genre where %s ;", expr);
-	if (sqlite3_prepare_v2(gdb, sql, -1, &stmt, NULL) != SQLITE_OK) {
-		g_set_error(error, db_quark(), ACK_ERROR_DATABASE_PREPARE,
-				"sqlite3_prepare_v2: %s", sqlite3_errmsg(gdb));
+	if ((stmt = db_prepare(sql, error)) == NULL) {
 		g_free(sql);
 		return false;
 	}
@@ -1813,13 +1985,13 @@ db_listinfo_genre_expr(const char *expr, GSList **values,
 			break;
 		default:
 			g_set_error(error, db_quark(), ACK_ERROR_DATABASE_STEP,
-					"sqlite3_step: %s", sqlite3_errmsg(gdb));
-			sqlite3_finalize(stmt);
+					"sqlite3_step: %s", sqlite3_errmsg(db));
+			sqlite3_reset(stmt);
 			return false;
 		}
 	} while (ret != SQLITE_DONE);
 
-	sqlite3_finalize(stmt);
+	sqlite3_reset(stmt);
 	return true;
 }
 
@@ -1827,12 +1999,13 @@ bool
 db_listinfo_song_expr(const char *expr, GSList **values,
 		GError **error)
 {
+	sqlite3 *db = db_handle();
 	int ret;
 	char *sql;
 	struct db_song_data *song;
 	sqlite3_stmt *stmt;
 
-	g_assert(gdb != NULL);
+	g_assert(db != NULL);
 	g_assert(expr != NULL);
 	g_assert(values != NULL);
 
@@ -1840,9 +2013,7 @@ db_listinfo_song_expr(const char *expr, GSList **values,
 			"id, play_count, love, kill, rating, karma, "
 			"last_played, uri "
 			"from song where %s ;", expr);
-	if (sqlite3_prepare_v2(gdb, sql, -1, &stmt, NULL) != SQLITE_OK) {
-		g_set_error(error, db_quark(), ACK_ERROR_DATABASE_PREPARE,
-				"sqlite3_prepare_v2: %s", sqlite3_errmsg(gdb));
+	if ((stmt = db_prepare(sql, error)) == NULL) {
 		g_free(sql);
 		return false;
 	}
@@ -1870,13 +2041,13 @@ db_listinfo_song_expr(const char *expr, GSList **values,
 			break;
 		default:
 			g_set_error(error, db_quark(), ACK_ERROR_DATABASE_STEP,
-					"sqlite3_step: %s", sqlite3_errmsg(gdb));
-			sqlite3_finalize(stmt);
+					"sqlite3_step: %s", sqlite3_errmsg(db));
+			sqlite3_reset(stmt);
 			return false;
 		}
 	} while (ret != SQLITE_DONE);
 
-	sqlite3_finalize(stmt);
+	sqlite3_reset(stmt);
 	return true;
 }
 
@@ -2342,34 +2513,39 @@ db_rate_absolute_song_expr(const char *expr, int rating, int *changes, GError **
 /**
  * Tags management
  */
-bool
-db_add_artist_tag_expr(const char *expr, const char *tag, int *changes, GError **error)
+static bool
+sql_tag_entry(const char *sql, const char *tag, GError **error)
 {
-	char *stmt;
+	sqlite3_stmt *stmt;
 
 	g_assert(gdb != NULL);
-	g_assert(expr != NULL);
 
-	if (!validate_tag(tag, error))
+	if ((stmt = db_prepare(sql, error)) == NULL)
 		return false;
 
-	stmt = g_strdup_printf("tags = tags || '%s:'", tag);
-	if (!sql_update_artist(stmt, expr, error)) {
-		g_free(stmt);
+	if (sqlite3_bind_text(stmt, 1, tag, -1, SQLITE_STATIC) != SQLITE_OK) {
+		g_set_error(error, db_quark(), ACK_ERROR_DATABASE_BIND,
+				"sqlite3_bind: %s", sqlite3_errmsg(gdb));
+		sqlite3_reset(stmt);
 		return false;
 	}
-	g_free(stmt);
-
-	if (changes != NULL)
-		*changes = sqlite3_changes(gdb);
 
+	if (db_step(stmt) != SQLITE_DONE) {
+		g_set_error(error, db_quark(), ACK_ERROR_DATABASE_STEP,
+				"sqlite3_step: %s", sqlite3_errmsg(gdb));
+		sqlite3_reset(stmt);
+		return false;
+	}
+	sqlite3_reset(stmt);
 	return true;
 }
 
-bool
-db_add_album_tag_expr(const char *expr, const char *tag, int *changes, GError **error)
+static bool
+sql_add_tag(const char *tbl, const char *expr, const char *tag,
+		int *changes, GError **error)
 {
-	char *stmt;
+	bool ret;
+	char *sql;
 
 	g_assert(gdb != NULL);
 	g_assert(expr != NULL);
@@ -2377,23 +2553,27 @@ db_add_album_tag_expr(const char *expr, const char *tag, int *changes, GError **
 	if (!validate_tag(tag, error))
 		return false;
 
-	stmt = g_strdup_printf("tags = tags || '%s:'", tag);
-	if (!sql_update_album(stmt, expr, error)) {
-		g_free(stmt);
+	if (!sql_tag_entry("insert or ignore into tag (name) values (?);", tag, error))
 		return false;
-	}
-	g_free(stmt);
 
-	if (changes != NULL)
+	sql = g_strdup_printf("insert or ignore into %s_tag (%s, tag) "
+			"select id, (select id from tag where name = ?) "
+			"from %s where %s ;", tbl, tbl, tbl, expr);
+	ret = sql_tag_entry(sql, tag, error);
+	g_free(sql);
+
+	if (ret && changes != NULL)
 		*changes = sqlite3_changes(gdb);
 
-	return true;
+	return ret;
 }
 
-bool
-db_add_genre_tag_expr(const char *expr, const char *tag, int *changes, GError **error)
+static bool
+sql_remove_tag(const char *tbl, const char *expr, const char *tag,
+		int *changes, GError **error)
 {
-	char *stmt;
+	bool ret;
+	char *sql;
 
 	g_assert(gdb != NULL);
 	g_assert(expr != NULL);
@@ -2401,387 +2581,83 @@ db_add_genre_tag_expr(const char *expr, const char *tag, int *changes, GError **
 	if (!validate_tag(tag, error))
 		return false;
 
-	stmt = g_strdup_printf("tags = tags || '%s:'", tag);
-	if (!sql_update_genre(stmt, expr, error)) {
-		g_free(stmt);
-		return false;
-	}
-	g_free(stmt);
+	sql = g_strdup_printf("delete from %s_tag "
+			"where tag = (select id from tag where name = ?) "
+			"and %s in (select id from %s where %s) ;",
+			tbl, tbl, tbl, expr);
+	ret = sql_tag_entry(sql, tag, error);
+	g_free(sql);
 
-	if (changes != NULL)
+	if (ret && changes != NULL)
 		*changes = sqlite3_changes(gdb);
 
-	return true;
+	return ret;
 }
 
 bool
-db_add_song_tag_expr(const char *expr, const char *tag, int *changes, GError **error)
+db_add_artist_tag_expr(const char *expr, const char *tag, int *changes, GError **error)
 {
-	char *stmt;
-
-	g_assert(gdb != NULL);
-	g_assert(expr != NULL);
-
-	if (!validate_tag(tag, error))
-		return false;
+	return sql_add_tag("artist", expr, tag, changes, error);
+}
 
-	stmt = g_strdup_printf("tags = tags || '%s:'", tag);
-	if (!sql_update_song(stmt, expr, error)) {
-		g_free(stmt);
-		return false;
-	}
-	g_free(stmt);
+bool
+db_add_album_tag_expr(const char *expr, const char *tag, int *changes, GError **error)
+{
+	return sql_add_tag("album", expr, tag, changes, error);
+}
 
-	if (changes != NULL)
-		*changes = sqlite3_changes(gdb);
+bool
+db_add_genre_tag_expr(const char *expr, const char *tag, int *changes, GError **error)
+{
+	return sql_add_tag("genre", expr, tag, changes, error);
+}
 
-	return true;
+bool
+db_add_song_tag_expr(const char *expr, const char *tag, int *changes, GError **error)
+{
+	return sql_add_tag("song", expr, tag, changes, error);
 }
 
 bool
 db_remove_artist_tag_expr(const char *expr, const char *tag, int *changes, GError **error)
 {
-	int ret;
-	char *stmt, *sql;
-	GSList *ids, *walk;
-	sqlite3_stmt *sql_stmt;
-	struct map {
-		int id;
-		char *tags;
-	} *map;
-
-	g_assert(gdb != NULL);
-	g_assert(expr != NULL);
-
-	if (!validate_tag(tag, error))
-		return false;
-
-	sql = g_strdup_printf("select id, tags from artist where %s ;", expr);
-	if (sqlite3_prepare_v2(gdb, sql, -1, &sql_stmt, NULL) != SQLITE_OK) {
-		g_set_error(error, db_quark(), ACK_ERROR_DATABASE_PREPARE,
-				"sqlite3_prepare_v2: %s", sqlite3_errmsg(gdb));
-		g_free(sql);
-		return false;
-	}
-	g_free(sql);
-
-	ids = NULL;
-	do {
-		ret = sqlite3_step(sql_stmt);
-		switch (ret) {
-		case SQLITE_ROW:
-			map = g_new(struct map, 1);
-			map->id = sqlite3_column_int(sql_stmt, 0);
-			map->tags = remove_tag((const char *)sqlite3_column_text(sql_stmt, 1), tag);
-			ids = g_slist_prepend(ids, map);
-			break;
-		case SQLITE_DONE:
-			break;
-		case SQLITE_BUSY:
-			/* no-op */
-			break;
-		default:
-			g_set_error(error, db_quark(), ACK_ERROR_DATABASE_STEP,
-					"sqlite3_step: %s", sqlite3_errmsg(gdb));
-			sqlite3_finalize(sql_stmt);
-			return false;
-		}
-	} while (ret != SQLITE_DONE);
-
-	sqlite3_finalize(sql_stmt);
-
-	if (changes != NULL)
-		*changes = 0;
-
-	db_set_sync(false, NULL);
-	db_start_transaction(NULL);
-	ret = true;
-	for (walk = ids; walk != NULL; walk = g_slist_next(walk)) {
-		map = (struct map *) walk->data;
-		if (ret) {
-			char *esc_tags = escape_string(map->tags);
-			stmt = g_strdup_printf("tags = %s", esc_tags);
-			g_free(esc_tags);
-
-			sql = g_strdup_printf("id = %d", map->id);
-			ret = sql_update_artist(stmt, sql, error);
-			g_free(sql);
-
-			if (changes != NULL)
-				*changes += sqlite3_changes(gdb);
-		}
-		g_free(map->tags);
-		g_free(map);
-	}
-	g_slist_free(ids);
-	db_end_transaction(NULL);
-	db_set_sync(true, NULL);
-
-	return ret;
+	return sql_remove_tag("artist", expr, tag, changes, error);
 }
 
 bool
 db_remove_album_tag_expr(const char *expr, const char *tag, int *changes, GError **error)
 {
-	int ret;
-	char *stmt, *sql;
-	GSList *ids, *walk;
-	sqlite3_stmt *sql_stmt;
-	struct map {
-		int id;
-		char *tags;
-	} *map;
-
-	g_assert(gdb != NULL);
-	g_assert(expr != NULL);
-
-	if (!validate_tag(tag, error))
-		return false;
-
-	sql = g_strdup_printf("select id, tags from album where %s ;", expr);
-	if (sqlite3_prepare_v2(gdb, sql, -1, &sql_stmt, NULL) != SQLITE_OK) {
-		g_set_error(error, db_quark(), ACK_ERROR_DATABASE_PREPARE,
-				"sqlite3_prepare_v2: %s", sqlite3_errmsg(gdb));
-		g_free(sql);
-		return false;
-	}
-	g_free(sql);
-
-	ids = NULL;
-	do {
-		ret = sqlite3_step(sql_stmt);
-		switch (ret) {
-		case SQLITE_ROW:
-			map = g_new(struct map, 1);
-			map->id = sqlite3_column_int(sql_stmt, 0);
-			map->tags = remove_tag((const char *)sqlite3_column_text(sql_stmt, 1), tag);
-			ids = g_slist_prepend(ids, map);
-			break;
-		case SQLITE_DONE:
-			break;
-		case SQLITE_BUSY:
-			/* no-op */
-			break;
-		default:
-			g_set_error(error, db_quark(), ACK_ERROR_DATABASE_STEP,
-					"sqlite3_step: %s", sqlite3_errmsg(gdb));
-			sqlite3_finalize(sql_stmt);
-			return false;
-		}
-	} while (ret != SQLITE_DONE);
-
-	sqlite3_finalize(sql_stmt);
-
-	if (changes != NULL)
-		*changes = 0;
-
-	db_set_sync(false, NULL);
-	db_start_transaction(NULL);
-	ret = true;
-	for (walk = ids; walk != NULL; walk = g_slist_next(walk)) {
-		map = (struct map *) walk->data;
-		if (ret) {
-			char *esc_tags = escape_string(map->tags);
-			stmt = g_strdup_printf("tags = %s'", esc_tags);
-			g_free(esc_tags);
-
-			sql = g_strdup_printf("id = %d", map->id);
-			ret = sql_update_album(stmt, sql, error);
-			g_free(sql);
-
-			if (changes != NULL)
-				*changes += sqlite3_changes(gdb);
-		}
-		g_free(map->tags);
-		g_free(map);
-	}
-	g_slist_free(ids);
-	db_end_transaction(NULL);
-	db_set_sync(true, NULL);
-
-	return ret;
+	return sql_remove_tag("album", expr, tag, changes, error);
 }
 
 bool
 db_remove_genre_tag_expr(const char *expr, const char *tag, int *changes, GError **error)
 {
-	int ret;
-	char *stmt, *sql;
-	GSList *ids, *walk;
-	sqlite3_stmt *sql_stmt;
-	struct map {
-		int id;
-		char *tags;
-	} *map;
-
-	g_assert(gdb != NULL);
-	g_assert(expr != NULL);
-
-	if (!validate_tag(tag, error))
-		return false;
-
-	sql = g_strdup_printf("select id, tags from genre where %s ;", expr);
-	if (sqlite3_prepare_v2(gdb, sql, -1, &sql_stmt, NULL) != SQLITE_OK) {
-		g_set_error(error, db_quark(), ACK_ERROR_DATABASE_PREPARE,
-				"sqlite3_prepare_v2: %s", sqlite3_errmsg(gdb));
-		g_free(sql);
-		return false;
-	}
-	g_free(sql);
-
-	ids = NULL;
-	do {
-		ret = sqlite3_step(sql_stmt);
-		switch (ret) {
-		case SQLITE_ROW:
-			map = g_new(struct map, 1);
-			map->id = sqlite3_column_int(sql_stmt, 0);
-			map->tags = remove_tag((const char *)sqlite3_column_text(sql_stmt, 1), tag);
-			ids = g_slist_prepend(ids, map);
-			break;
-		case SQLITE_DONE:
-			break;
-		case SQLITE_BUSY:
-			/* no-op */
-			break;
-		default:
-			g_set_error(error, db_quark(), ACK_ERROR_DATABASE_STEP,
-					"sqlite3_step: %s", sqlite3_errmsg(gdb));
-			sqlite3_finalize(sql_stmt);
-			return false;
-		}
-	} while (ret != SQLITE_DONE);
-
-	sqlite3_finalize(sql_stmt);
-
-	if (changes != NULL)
-		*changes = 0;
-
-	db_set_sync(false, NULL);
-	db_start_transaction(NULL);
-	ret = true;
-	for (walk = ids; walk != NULL; walk = g_slist_next(walk)) {
-		map = (struct map *) walk->data;
-		if (ret) {
-			char *esc_tags = escape_string(map->tags);
-			stmt = g_strdup_printf("tags = %s", esc_tags);
-			g_free(esc_tags);
-
-			sql = g_strdup_printf("id = %d", map->id);
-			ret = sql_update_genre(stmt, sql, error);
-			g_free(sql);
-
-			if (changes != NULL)
-				*changes += sqlite3_changes(gdb);
-		}
-		g_free(map->tags);
-		g_free(map);
-	}
-	g_slist_free(ids);
-	db_end_transaction(NULL);
-	db_set_sync(true, NULL);
-
-	return ret;
+	return sql_remove_tag("genre", expr, tag, changes, error);
 }
 
 bool
 db_remove_song_tag_expr(const char *expr, const char *tag, int *changes, GError **error)
 {
-	int ret;
-	char *stmt, *sql;
-	GSList *ids, *walk;
-	sqlite3_stmt *sql_stmt;
-	struct map {
-		int id;
-		char *tags;
-	} *map;
-
-	g_assert(gdb != NULL);
-	g_assert(expr != NULL);
-
-	if (!validate_tag(tag, error))
-		return false;
-
-	sql = g_strdup_printf("select id, tags from song where %s ;", expr);
-	if (sqlite3_prepare_v2(gdb, sql, -1, &sql_stmt, NULL) != SQLITE_OK) {
-		g_set_error(error, db_quark(), ACK_ERROR_DATABASE_PREPARE,
-				"sqlite3_prepare_v2: %s", sqlite3_errmsg(gdb));
-		g_free(sql);
-		return false;
-	}
-	g_free(sql);
-
-	ids = NULL;
-	do {
-		ret = sqlite3_step(sql_stmt);
-		switch (ret) {
-		case SQLITE_ROW:
-			map = g_new(struct map, 1);
-			map->id = sqlite3_column_int(sql_stmt, 0);
-			map->tags = remove_tag((const char *)sqlite3_column_text(sql_stmt, 1), tag);
-			ids = g_slist_prepend(ids, map);
-			break;
-		case SQLITE_DONE:
-			break;
-		case SQLITE_BUSY:
-			/* no-op */
-			break;
-		default:
-			g_set_error(error, db_quark(), ACK_ERROR_DATABASE_STEP,
-					"sqlite3_step: %s", sqlite3_errmsg(gdb));
-			sqlite3_finalize(sql_stmt);
-			return false;
-		}
-	} while (ret != SQLITE_DONE);
-
-	sqlite3_finalize(sql_stmt);
-
-	if (changes != NULL)
-		*changes = 0;
-
-	db_set_sync(false, NULL);
-	db_start_transaction(NULL);
-	ret = true;
-	for (walk = ids; walk != NULL; walk = g_slist_next(walk)) {
-		map = (struct map *) walk->data;
-		if (ret) {
-			char *esc_tags = escape_string(map->tags);
-			stmt = g_strdup_printf("tags = %s", esc_tags);
-			g_free(esc_tags);
-
-			sql = g_strdup_printf("id = %d", map->id);
-			ret = sql_update_song(stmt, sql, error);
-			g_free(sql);
-
-			if (changes != NULL)
-				*changes += sqlite3_changes(gdb);
-		}
-		g_free(map->tags);
-		g_free(map);
-	}
-	g_slist_free(ids);
-	db_end_transaction(NULL);
-	db_set_sync(true, NULL);
-
-	return ret;
+	return sql_remove_tag("song", expr, tag, changes, error);
 }
 
 bool
 db_list_artist_tag_expr(const char *expr, GSList **values, GError **error)
 {
+	sqlite3 *db = db_handle();
 	int ret;
 	char *sql;
 	sqlite3_stmt *stmt;
 	struct db_generic_data *data;
 
-	g_assert(gdb != NULL);
+	g_assert(db != NULL);
 	g_assert(expr != NULL);
 	g_assert(values != NULL);
 
-	sql = g_strdup_printf("select id, name, tags from artist where %s ;", expr);
-	if (sqlite3_prepare_v2(gdb, sql, -1, &stmt, NULL) != SQLITE_OK) {
-		g_set_error(error, db_quark(), ACK_ERROR_DATABASE_PREPARE,
-				"sqlite3_prepare_v2: %s", sqlite3_errmsg(gdb));
+	sql = g_strdup_printf("select id, name, " DB_SQL_TAGS("artist")
+			" from artist where %s ;", expr);
+	if ((stmt = db_prepare(sql, error)) == NULL) {
 		g_free(sql);
 		return false;
 	}
@@ -2804,32 +2680,32 @@ db_list_artist_tag_expr(const char *expr, GSList **values, GError **error)
 			break;
 		default:
 			g_set_error(error, db_quark(), ACK_ERROR_DATABASE_STEP,
-					"sqlite3_step: %s", sqlite3_errmsg(gdb));
-			sqlite3_finalize(stmt);
+					"sqlite3_step: %s", sqlite3_errmsg(db));
+			sqlite3_reset(stmt);
 			return false;
 		}
 	} while (ret != SQLITE_DONE);
 
-	sqlite3_finalize(stmt);
+	sqlite3_reset(stmt);
 	return true;
 }
 
 bool
 db_list_album_tag_expr(const char *expr, GSList **values, GError **error)
 {
+	sqlite3 *db = db_handle();
 	int ret;
 	char *sql;
 	sqlite3_stmt *stmt;
 	struct db_generic_data *data;
 
-	g_assert(gdb != NULL);
+	g_assert(db != NULL);
 	g_assert(expr != NULL);
 	g_assert(values != NULL);
 
-	sql = g_strdup_printf("select id, name, artist, tags from album where %s ;", expr);
-	if (sqlite3_prepare_v2(gdb, sql, -1, &stmt, NULL) != SQLITE_OK) {
-		g_set_error(error, db_quark(), ACK_ERROR_DATABASE_PREPARE,
-				"sqlite3_prepare_v2: %s", sqlite3_errmsg(gdb));
+	sql = g_strdup_printf("select id, name, artist, " DB_SQL_TAGS("album")
+			" from album where %s ;", expr);
+	if ((stmt = db_prepare(sql, error)) == NULL) {
 		g_free(sql);
 		return false;
 	}
@@ -2853,32 +2729,32 @@ db_list_album_tag_expr(const char *expr, GSList **values, GError **error)
 			break;
 		default:
 			g_set_error(error, db_quark(), ACK_ERROR_DATABASE_STEP,
-					"sqlite3_step: %s", sqlite3_errmsg(gdb));
-			sqlite3_finalize(stmt);
+					"sqlite3_step: %s", sqlite3_errmsg(db));
+			sqlite3_reset(stmt);
 			return false;
 		}
 	} while (ret != SQLITE_DONE);
 
-	sqlite3_finalize(stmt);
+	sqlite3_reset(stmt);
 	return true;
 }
 
 bool
 db_list_genre_tag_expr(const char *expr, GSList **values, GError **error)
 {
+	sqlite3 *db = db_handle();
 	int ret;
 	char *sql;
 	sqlite3_stmt *stmt;
 	struct db_generic_data *data;
 
-	g_assert(gdb != NULL);
+	g_assert(db != NULL);
 	g_assert(expr != NULL);
 	g_assert(values != NULL);
 
-	sql = g_strdup_printf("select id, name, tags from genre where %s ;", expr);
-	if (sqlite3_prepare_v2(gdb, sql, -1, &stmt, NULL) != SQLITE_OK) {
-		g_set_error(error, db_quark(), ACK_ERROR_DATABASE_PREPARE,
-				"sqlite3_prepare_v2: %s", sqlite3_errmsg(gdb));
+	sql = g_strdup_printf("select id, name, " DB_SQL_TAGS("genre")
+			" from genre where %s ;", expr);
+	if ((stmt = db_prepare(sql, error)) == NULL) {
 		g_free(sql);
 		return false;
 	}
@@ -2901,32 +2777,32 @@ db_list_genre_tag_expr(const char *expr, GSList **values, GError **error)
 			break;
 		default:
 			g_set_error(error, db_quark(), ACK_ERROR_DATABASE_STEP,
-					"sqlite3_step: %s", sqlite3_errmsg(gdb));
-			sqlite3_finalize(stmt);
+					"sqlite3_step: %s", sqlite3_errmsg(db));
+			sqlite3_reset(stmt);
 			return false;
 		}
 	} while (ret != SQLITE_DONE);
 
-	sqlite3_finalize(stmt);
+	sqlite3_reset(stmt);
 	return true;
 }
 
 bool
 db_list_song_tag_expr(const char *expr, GSList **values, GError **error)
 {
+	sqlite3 *db = db_handle();
 	int ret;
 	char *sql;
 	sqlite3_stmt *stmt;
 	struct db_song_data *song;
 
-	g_assert(gdb != NULL);
+	g_assert(db != NULL);
 	g_assert(expr != NULL);
 	g_assert(values != NULL);
 
-	sql = g_strdup_printf("select id, uri, tags from song where %s ;", expr);
-	if (sqlite3_prepare_v2(gdb, sql, -1, &stmt, NULL) != SQLITE_OK) {
-		g_set_error(error, db_quark(), ACK_ERROR_DATABASE_PREPARE,
-				"sqlite3_prepare_v2: %s", sqlite3_errmsg(gdb));
+	sql = g_strdup_printf("select id, uri, " DB_SQL_TAGS("song")
+			" from song where %s ;", expr);
+	if ((stmt = db_prepare(sql, error)) == NULL) {
 		g_free(sql);
 		return false;
 	}
@@ -2949,12 +2825,12 @@ db_list_song_tag_expr(const char *expr, GSList **values, GError **error)
 			break;
 		default:
 			g_set_error(error, db_quark(), ACK_ERROR_DATABASE_STEP,
-					"sqlite3_step: %s", sqlite3_errmsg(gdb));
-			sqlite3_finalize(stmt);
+					"sqlite3_step: %s", sqlite3_errmsg(db));
+			sqlite3_reset(stmt);
 			return false;
 		}
 	} while (ret != SQLITE_DONE);
 
-	sqlite3_finalize(stmt);
+	sqlite3_reset(stmt);
 	return true;
 }
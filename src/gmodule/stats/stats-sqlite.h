@@ -69,6 +69,18 @@ struct db_song_data {
 	char **tags;
 };
 
+/* A row of sqlite_stat1, the statistics the query planner works with */
+struct db_planner_data {
+	char *table;
+	char *index;
+	char *stat;
+};
+
+/* SQLite authorizer callback, see sqlite3_set_authorizer() */
+typedef int (*db_auth_func)(void *userdata, int what,
+		const char *arg1, const char *arg2,
+		const char *dbname, const char *view);
+
 enum dback {
 	ACK_ERROR_DATABASE_OPEN = 50,
 	ACK_ERROR_DATABASE_CREATE = 51,
@@ -105,8 +117,22 @@ void
 db_close(void);
 
 bool
-db_set_authorizer(int (*xAuth)(void *, int, const char *, const char *, const char *,const char *),
-		void *userdata, GError **error);
+db_readers_open(const char *path, unsigned int count, GError **error);
+
+void
+db_readers_close(void);
+
+void
+db_reader_acquire(void);
+
+void
+db_reader_release(void);
+
+void
+db_stmt_cache_stats(unsigned int *hits, unsigned int *misses);
+
+void
+db_set_authorizer(db_auth_func xAuth, void *userdata);
 
 bool
 db_run_stmt(unsigned int stmt, GError **error);
@@ -126,6 +152,15 @@ db_set_sync(bool on, GError **error);
 bool
 db_vacuum(GError **error);
 
+bool
+db_optimize(GError **error);
+
+bool
+db_list_planner(GSList **values, GError **error);
+
+void
+db_planner_data_free(struct db_planner_data *data);
+
 bool
 db_process(const struct mpd_song *song, bool increment, int percent_played,
 		GError **error);
@@ -0,0 +1,171 @@
+/* vim: set cino= fo=croql sw=8 ts=8 sts=0 noet cin fdm=syntax : */
+
+/*
+ * Copyright (c) 2013 Ali Polatel <alip@exherbo.org>
+ *
+ * This file is part of the mpdcron mpd client. mpdcron is free software;
+ * you can redistribute it and/or modify it under the terms of the GNU General
+ * Public License version 2, as published by the Free Software Foundation.
+ *
+ * mpdcron is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+ * Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+
+#include "replay-defs.h"
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <glib.h>
+
+/* A capture is a text header followed by records, each one is a line
+ * "<connection> <milliseconds> <C|S> <length>" followed by the bytes
+ * and a newline so that captures stay readable with a pager. */
+
+FILE *
+capture_create(const char *path)
+{
+	FILE *fp;
+
+	if ((fp = fopen(path, "w")) == NULL) {
+		g_warning("Failed to open `%s' for writing: %s",
+				path, g_strerror(errno));
+		return NULL;
+	}
+	fprintf(fp, "%s\n", REPLAY_CAPTURE_MAGIC);
+	return fp;
+}
+
+bool
+capture_write(FILE *fp, unsigned id, gint64 ms, char dir,
+		const char *data, size_t len)
+{
+	if (fprintf(fp, "%u %"G_GINT64_FORMAT" %c %zu\n", id, ms, dir, len) < 0 ||
+			fwrite(data, 1, len, fp) != len ||
+			fputc('\n', fp) == EOF ||
+			fflush(fp) == EOF) {
+		g_warning("Failed to write capture: %s", g_strerror(errno));
+		return false;
+	}
+	return true;
+}
+
+static void
+record_free(gpointer data)
+{
+	struct replay_record *rec = data;
+
+	g_string_free(rec->data, TRUE);
+	g_free(rec);
+}
+
+static void
+script_free(gpointer data)
+{
+	struct replay_script *script = data;
+
+	g_ptr_array_free(script->records, TRUE);
+	g_free(script);
+}
+
+static struct replay_script *
+capture_script(GPtrArray *scripts, unsigned id)
+{
+	struct replay_script *script;
+
+	for (unsigned i = 0; i < scripts->len; i++) {
+		script = g_ptr_array_index(scripts, i);
+		if (script->id == id)
+			return script;
+	}
+
+	script = g_new(struct replay_script, 1);
+	script->id = id;
+	script->records = g_ptr_array_new_with_free_func(record_free);
+	g_ptr_array_add(scripts, script);
+	return script;
+}
+
+GPtrArray *
+capture_load(const char *path)
+{
+	char line[128], dir;
+	unsigned id, count;
+	size_t len;
+	gint64 ms;
+	FILE *fp;
+	GString *buf;
+	GPtrArray *scripts, *records;
+	struct replay_record *rec;
+
+	if ((fp = fopen(path, "r")) == NULL) {
+		g_warning("Failed to open `%s': %s", path, g_strerror(errno));
+		return NULL;
+	}
+	if (fgets(line, sizeof(line), fp) == NULL ||
+			strncmp(line, REPLAY_CAPTURE_MAGIC, strlen(REPLAY_CAPTURE_MAGIC)) != 0) {
+		g_warning("`%s' is not a capture", path);
+		fclose(fp);
+		return NULL;
+	}
+
+	/* Scripts are kept in the order the connections were accepted */
+	scripts = g_ptr_array_new_with_free_func(script_free);
+	count = 0;
+	while (fgets(line, sizeof(line), fp) != NULL) {
+		if (sscanf(line, "%u %"G_GINT64_FORMAT" %c %zu", &id, &ms, &dir, &len) != 4 ||
+				(dir != 'C' && dir != 'S')) {
+			g_warning("Malformed record %u in `%s'", count, path);
+			goto fail;
+		}
+		buf = g_string_sized_new(len);
+		g_string_set_size(buf, len);
+		if (fread(buf->str, 1, len, fp) != len || fgetc(fp) != '\n') {
+			g_warning("Truncated record %u in `%s'", count, path);
+			g_string_free(buf, TRUE);
+			goto fail;
+		}
+		count++;
+
+		/* Commands may arrive in pieces, the server matches them
+		 * line by line so keep them together. */
+		records = capture_script(scripts, id)->records;
+		rec = (records->len > 0) ? g_ptr_array_index(records, records->len - 1) : NULL;
+		if (dir == 'C' && rec != NULL && rec->dir == 'C') {
+			g_string_append_len(rec->data, buf->str, buf->len);
+			g_string_free(buf, TRUE);
+			rec->ms = ms;
+			continue;
+		}
+
+		rec = g_new(struct replay_record, 1);
+		rec->ms = ms;
+		rec->dir = dir;
+		rec->data = buf;
+		g_ptr_array_add(records, rec);
+	}
+	fclose(fp);
+
+	g_debug("Loaded %u records of %u connections from `%s'",
+			count, scripts->len, path);
+	return scripts;
+fail:
+	fclose(fp);
+	capture_free(scripts);
+	return NULL;
+}
+
+void
+capture_free(GPtrArray *scripts)
+{
+	g_ptr_array_free(scripts, TRUE);
+}
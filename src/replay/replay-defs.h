@@ -0,0 +1,87 @@
+/* vim: set cino= fo=croql sw=8 ts=8 sts=0 noet cin fdm=syntax : */
+
+/*
+ * Copyright (c) 2013 Ali Polatel <alip@exherbo.org>
+ *
+ * This file is part of the mpdcron mpd client. mpdcron is free software;
+ * you can redistribute it and/or modify it under the terms of the GNU General
+ * Public License version 2, as published by the Free Software Foundation.
+ *
+ * mpdcron is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+ * Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef MPDCRON_GUARD_REPLAY_DEFS_H
+#define MPDCRON_GUARD_REPLAY_DEFS_H 1
+
+#include "../cron-config.h"
+
+#include <stdbool.h>
+#include <stdio.h>
+
+#include <glib.h>
+
+#define REPLAY_CAPTURE_MAGIC	"# mpdcron capture 1"
+
+/* Bytes which went through a connection in one direction.
+ * ms: Milliseconds since the connection was accepted.
+ * dir: 'C' from the client to Mpd, 'S' from Mpd to the client.
+ */
+struct replay_record {
+	gint64 ms;
+	char dir;
+	GString *data;
+};
+
+/* Records of one connection in the order they were seen */
+struct replay_script {
+	unsigned id;
+	GPtrArray *records;
+};
+
+struct replay_config {
+	char *bind;
+	int listen;
+	char *host;
+	int port;
+	double speed;
+};
+
+extern struct replay_config replay_conf;
+extern GMainLoop *loop;
+
+FILE *
+capture_create(const char *path);
+
+bool
+capture_write(FILE *fp, unsigned id, gint64 ms, char dir,
+		const char *data, size_t len);
+
+GPtrArray *
+capture_load(const char *path);
+
+void
+capture_free(GPtrArray *scripts);
+
+int
+net_listen(const char *bind, int port);
+
+int
+net_connect(const char *host, int port);
+
+bool
+net_write(int fd, const char *data, size_t len);
+
+int
+record_run(const char *path);
+
+int
+serve_run(const char *path);
+
+#endif /* !MPDCRON_GUARD_REPLAY_DEFS_H */
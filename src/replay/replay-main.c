@@ -0,0 +1,117 @@
+/* vim: set cino= fo=croql sw=8 ts=8 sts=0 noet cin fdm=syntax : */
+
+/*
+ * Copyright (c) 2013 Ali Polatel <alip@exherbo.org>
+ *
+ * This file is part of the mpdcron mpd client. mpdcron is free software;
+ * you can redistribute it and/or modify it under the terms of the GNU General
+ * Public License version 2, as published by the Free Software Foundation.
+ *
+ * mpdcron is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+ * Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+
+#include "replay-defs.h"
+
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <glib.h>
+#include <glib-unix.h>
+
+struct replay_config replay_conf;
+GMainLoop *loop = NULL;
+
+static char *record_path, *replay_path;
+
+static GOptionEntry options[] = {
+	{"record", 'r', 0, G_OPTION_ARG_FILENAME, &record_path,
+		"Proxy connections to Mpd and record the traffic to FILE", "FILE"},
+	{"replay", 'p', 0, G_OPTION_ARG_FILENAME, &replay_path,
+		"Serve the traffic recorded in FILE as a fake Mpd", "FILE"},
+	{"bind", 'b', 0, G_OPTION_ARG_STRING, &replay_conf.bind,
+		"Address to listen on (default: 127.0.0.1)", "ADDRESS"},
+	{"listen", 'l', 0, G_OPTION_ARG_INT, &replay_conf.listen,
+		"Port to listen on (default: 6601)", "PORT"},
+	{"host", 'H', 0, G_OPTION_ARG_STRING, &replay_conf.host,
+		"Mpd host to record (default: $MPD_HOST or localhost)", "HOST"},
+	{"port", 'P', 0, G_OPTION_ARG_INT, &replay_conf.port,
+		"Mpd port to record (default: $MPD_PORT or 6600)", "PORT"},
+	{"speed", 's', 0, G_OPTION_ARG_DOUBLE, &replay_conf.speed,
+		"Replay speed, 2 is twice as fast, 0 without delays (default: 1)", "FACTOR"},
+	{NULL, 0, 0, 0, NULL, NULL, NULL},
+};
+
+static gboolean
+sig_quit(G_GNUC_UNUSED gpointer userdata)
+{
+	g_main_loop_quit(loop);
+	return TRUE;
+}
+
+int
+main(int argc, char **argv)
+{
+	int ret;
+	const char *env;
+	GOptionContext *ctx;
+	GError *parse_err = NULL;
+
+	replay_conf.listen = 6601;
+	replay_conf.speed = 1;
+
+	ctx = g_option_context_new("");
+	g_option_context_add_main_entries(ctx, options, PACKAGE);
+	g_option_context_set_summary(ctx, "mpdcron-replay-"VERSION
+			" - record and replay Mpd traffic");
+	if (!g_option_context_parse(ctx, &argc, &argv, &parse_err)) {
+		g_printerr("option parsing failed: %s\n", parse_err->message);
+		g_option_context_free(ctx);
+		g_error_free(parse_err);
+		return EXIT_FAILURE;
+	}
+	g_option_context_free(ctx);
+
+	if ((record_path == NULL) == (replay_path == NULL)) {
+		g_printerr("Exactly one of --record and --replay is required\n");
+		return EXIT_FAILURE;
+	}
+	if (replay_conf.speed < 0) {
+		g_printerr("Replay speed smaller than zero\n");
+		return EXIT_FAILURE;
+	}
+
+	if (replay_conf.bind == NULL)
+		replay_conf.bind = g_strdup("127.0.0.1");
+	if (replay_conf.host == NULL)
+		replay_conf.host = g_strdup((env = g_getenv(ENV_MPD_HOST)) != NULL ? env : "localhost");
+	if (replay_conf.port == 0)
+		replay_conf.port = ((env = g_getenv(ENV_MPD_PORT)) != NULL) ? atoi(env) : 6600;
+
+	/* Clients may go away while we're writing to them */
+	signal(SIGPIPE, SIG_IGN);
+
+	loop = g_main_loop_new(NULL, FALSE);
+	g_unix_signal_add(SIGINT, sig_quit, NULL);
+	g_unix_signal_add(SIGTERM, sig_quit, NULL);
+
+	if (record_path != NULL)
+		ret = record_run(record_path);
+	else
+		ret = serve_run(replay_path);
+
+	g_main_loop_unref(loop);
+	g_free(replay_conf.bind);
+	g_free(replay_conf.host);
+	g_free(record_path);
+	g_free(replay_path);
+	return (ret < 0) ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,152 @@
+/* vim: set cino= fo=croql sw=8 ts=8 sts=0 noet cin fdm=syntax : */
+
+/*
+ * Copyright (c) 2013 Ali Polatel <alip@exherbo.org>
+ *
+ * This file is part of the mpdcron mpd client. mpdcron is free software;
+ * you can redistribute it and/or modify it under the terms of the GNU General
+ * Public License version 2, as published by the Free Software Foundation.
+ *
+ * mpdcron is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+ * Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+
+#include "replay-defs.h"
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#include <glib.h>
+
+/* A client of the proxy and its connection to the Mpd server */
+struct record_conn {
+	unsigned id;
+	int client, server;
+	gint64 start;
+	guint client_watch, server_watch;
+};
+
+static FILE *capture;
+static unsigned connections;
+
+static void
+record_close(struct record_conn *rc)
+{
+	g_message("Connection %u closed", rc->id);
+	g_source_remove(rc->client_watch);
+	g_source_remove(rc->server_watch);
+	close(rc->client);
+	close(rc->server);
+	g_free(rc);
+}
+
+static gboolean
+record_relay(GIOChannel *channel, G_GNUC_UNUSED GIOCondition condition,
+		gpointer userdata)
+{
+	int from, to;
+	char buf[4096], dir;
+	ssize_t n;
+	struct record_conn *rc = userdata;
+
+	from = g_io_channel_unix_get_fd(channel);
+	if (from == rc->client) {
+		to = rc->server;
+		dir = 'C';
+	}
+	else {
+		to = rc->client;
+		dir = 'S';
+	}
+
+	if ((n = read(from, buf, sizeof(buf))) < 0 && errno == EINTR)
+		return TRUE;
+	if (n <= 0 ||
+			!capture_write(capture, rc->id,
+				(g_get_monotonic_time() - rc->start) / 1000,
+				dir, buf, n) ||
+			!net_write(to, buf, n)) {
+		record_close(rc);
+		return FALSE;
+	}
+	return TRUE;
+}
+
+static guint
+record_watch(int fd, struct record_conn *rc)
+{
+	guint id;
+	GIOChannel *channel;
+
+	channel = g_io_channel_unix_new(fd);
+	id = g_io_add_watch(channel, G_IO_IN | G_IO_HUP | G_IO_ERR,
+			record_relay, rc);
+	g_io_channel_unref(channel);
+	return id;
+}
+
+static gboolean
+record_accept(GIOChannel *channel, G_GNUC_UNUSED GIOCondition condition,
+		G_GNUC_UNUSED gpointer userdata)
+{
+	int client, server;
+	struct record_conn *rc;
+
+	if ((client = accept(g_io_channel_unix_get_fd(channel), NULL, NULL)) < 0) {
+		if (errno != EINTR)
+			g_warning("Failed to accept connection: %s", g_strerror(errno));
+		return TRUE;
+	}
+	if ((server = net_connect(replay_conf.host, replay_conf.port)) < 0) {
+		close(client);
+		return TRUE;
+	}
+
+	rc = g_new0(struct record_conn, 1);
+	rc->id = connections++;
+	rc->client = client;
+	rc->server = server;
+	rc->start = g_get_monotonic_time();
+	rc->client_watch = record_watch(client, rc);
+	rc->server_watch = record_watch(server, rc);
+	g_message("Connection %u accepted", rc->id);
+	return TRUE;
+}
+
+int
+record_run(const char *path)
+{
+	int fd;
+	GIOChannel *channel;
+
+	if ((fd = net_listen(replay_conf.bind, replay_conf.listen)) < 0)
+		return -1;
+	if ((capture = capture_create(path)) == NULL) {
+		close(fd);
+		return -1;
+	}
+
+	g_message("Recording traffic between %s:%d and %s:%d to `%s'",
+			replay_conf.bind, replay_conf.listen,
+			replay_conf.host, replay_conf.port, path);
+	channel = g_io_channel_unix_new(fd);
+	g_io_add_watch(channel, G_IO_IN, record_accept, NULL);
+	g_io_channel_unref(channel);
+
+	g_main_loop_run(loop);
+
+	fclose(capture);
+	close(fd);
+	g_message("Recorded %u connections", connections);
+	return 0;
+}
@@ -0,0 +1,275 @@
+/* vim: set cino= fo=croql sw=8 ts=8 sts=0 noet cin fdm=syntax : */
+
+/*
+ * Copyright (c) 2013 Ali Polatel <alip@exherbo.org>
+ *
+ * This file is part of the mpdcron mpd client. mpdcron is free software;
+ * you can redistribute it and/or modify it under the terms of the GNU General
+ * Public License version 2, as published by the Free Software Foundation.
+ *
+ * mpdcron is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+ * Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+
+#include "replay-defs.h"
+
+#include <errno.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#include <glib.h>
+
+/* A client replaying one recorded connection.
+ * next: Index of the record to replay next.
+ * input: Bytes received from the client not yet matched to a record.
+ * mark: Monotonic time the previous record was replayed at.
+ */
+struct serve_conn {
+	int fd;
+	const struct replay_script *script;
+	unsigned next;
+	GString *input;
+	gint64 mark;
+	guint watch, timer;
+};
+
+static GPtrArray *scripts;
+static unsigned accepted, finished;
+
+/* Totals printed at exit */
+static struct {
+	guint64 records;
+	guint64 bytes_in, bytes_out;
+	unsigned mismatches;
+	gint64 start;
+} totals;
+
+static unsigned
+count_lines(const char *data, size_t len)
+{
+	unsigned lines = 0;
+
+	for (size_t i = 0; i < len; i++) {
+		if (data[i] == '\n')
+			lines++;
+	}
+	return lines;
+}
+
+static void
+serve_close(struct serve_conn *sc)
+{
+	if (sc->next < sc->script->records->len)
+		g_message("Connection %u closed after %u of %u records",
+				sc->script->id, sc->next, sc->script->records->len);
+	else
+		g_debug("Connection %u replayed", sc->script->id);
+
+	if (sc->watch != 0)
+		g_source_remove(sc->watch);
+	if (sc->timer != 0)
+		g_source_remove(sc->timer);
+	close(sc->fd);
+	g_string_free(sc->input, TRUE);
+	g_free(sc);
+
+	if (++finished == scripts->len)
+		g_main_loop_quit(loop);
+}
+
+/* Consume the lines the client sent for a record, commands differing from
+ * the capture are replayed anyway so that a changed client can still be
+ * measured. Returns false until the client sent enough lines. */
+static bool
+serve_expect(struct serve_conn *sc, const struct replay_record *rec)
+{
+	char *end;
+	size_t len;
+	unsigned lines;
+
+	lines = count_lines(rec->data->str, rec->data->len);
+	end = sc->input->str;
+	for (unsigned i = 0; i < lines; i++) {
+		if ((end = strchr(end, '\n')) == NULL)
+			return false;
+		end++;
+	}
+
+	len = end - sc->input->str;
+	if (len != rec->data->len || memcmp(sc->input->str, rec->data->str, len) != 0) {
+		totals.mismatches++;
+		g_debug("Connection %u expected `%.*s', got `%.*s'", sc->script->id,
+				(int)rec->data->len, rec->data->str,
+				(int)len, sc->input->str);
+	}
+	g_string_erase(sc->input, 0, len);
+	return true;
+}
+
+static gboolean serve_timeout(gpointer userdata);
+
+/* Replay records until the client has to send something or a reply is not
+ * due yet. Returns false if the connection was closed. */
+static bool
+serve_step(struct serve_conn *sc)
+{
+	gint64 now, due, prev;
+	const struct replay_record *rec;
+
+	while (sc->next < sc->script->records->len) {
+		rec = g_ptr_array_index(sc->script->records, sc->next);
+		now = g_get_monotonic_time();
+
+		if (rec->dir == 'C') {
+			if (!serve_expect(sc, rec))
+				return true;
+		}
+		else {
+			/* Keep the delay since the previous record, scaled */
+			prev = (sc->next > 0)
+				? ((struct replay_record *)g_ptr_array_index(sc->script->records, sc->next - 1))->ms
+				: 0;
+			due = sc->mark;
+			if (replay_conf.speed > 0)
+				due += (gint64)((rec->ms - prev) * 1000 / replay_conf.speed);
+			if (due > now) {
+				sc->timer = g_timeout_add((due - now + 999) / 1000,
+						serve_timeout, sc);
+				return true;
+			}
+			if (!net_write(sc->fd, rec->data->str, rec->data->len)) {
+				g_warning("Failed to write to connection %u: %s",
+						sc->script->id, g_strerror(errno));
+				serve_close(sc);
+				return false;
+			}
+			totals.bytes_out += rec->data->len;
+		}
+		sc->mark = now;
+		sc->next++;
+		totals.records++;
+	}
+
+	serve_close(sc);
+	return false;
+}
+
+static gboolean
+serve_timeout(gpointer userdata)
+{
+	struct serve_conn *sc = userdata;
+
+	sc->timer = 0;
+	serve_step(sc);
+	return FALSE;
+}
+
+static gboolean
+serve_read(GIOChannel *channel, G_GNUC_UNUSED GIOCondition condition,
+		gpointer userdata)
+{
+	char buf[4096];
+	ssize_t n;
+	struct serve_conn *sc = userdata;
+
+	if ((n = read(g_io_channel_unix_get_fd(channel), buf, sizeof(buf))) < 0 &&
+			errno == EINTR)
+		return TRUE;
+	if (n <= 0) {
+		sc->watch = 0;
+		serve_close(sc);
+		return FALSE;
+	}
+	totals.bytes_in += n;
+	g_string_append_len(sc->input, buf, n);
+
+	/* A reply is already scheduled */
+	if (sc->timer != 0)
+		return TRUE;
+	return serve_step(sc);
+}
+
+static gboolean
+serve_accept(GIOChannel *channel, G_GNUC_UNUSED GIOCondition condition,
+		G_GNUC_UNUSED gpointer userdata)
+{
+	int fd;
+	GIOChannel *client;
+	struct serve_conn *sc;
+
+	if ((fd = accept(g_io_channel_unix_get_fd(channel), NULL, NULL)) < 0) {
+		if (errno != EINTR)
+			g_warning("Failed to accept connection: %s", g_strerror(errno));
+		return TRUE;
+	}
+	if (accepted == scripts->len) {
+		g_message("No recorded connections left, refusing client");
+		close(fd);
+		return TRUE;
+	}
+	if (accepted == 0)
+		totals.start = g_get_monotonic_time();
+
+	sc = g_new0(struct serve_conn, 1);
+	sc->fd = fd;
+	sc->script = g_ptr_array_index(scripts, accepted++);
+	sc->input = g_string_new("");
+	sc->mark = g_get_monotonic_time();
+	g_debug("Replaying connection %u", sc->script->id);
+
+	client = g_io_channel_unix_new(fd);
+	sc->watch = g_io_add_watch(client, G_IO_IN | G_IO_HUP | G_IO_ERR,
+			serve_read, sc);
+	g_io_channel_unref(client);
+
+	/* Send the greeting */
+	serve_step(sc);
+	return TRUE;
+}
+
+int
+serve_run(const char *path)
+{
+	int fd;
+	double elapsed;
+	GIOChannel *channel;
+
+	if ((scripts = capture_load(path)) == NULL)
+		return -1;
+	if (scripts->len == 0) {
+		g_warning("`%s' has no connections", path);
+		capture_free(scripts);
+		return -1;
+	}
+	if ((fd = net_listen(replay_conf.bind, replay_conf.listen)) < 0) {
+		capture_free(scripts);
+		return -1;
+	}
+
+	g_message("Replaying %u connections from `%s' on %s:%d",
+			scripts->len, path, replay_conf.bind, replay_conf.listen);
+	channel = g_io_channel_unix_new(fd);
+	g_io_add_watch(channel, G_IO_IN, serve_accept, NULL);
+	g_io_channel_unref(channel);
+
+	g_main_loop_run(loop);
+	close(fd);
+
+	elapsed = (g_get_monotonic_time() - totals.start) / 1e6;
+	g_message("Replayed %"G_GUINT64_FORMAT" records of %u connections in %.3fs, "
+			"%"G_GUINT64_FORMAT" bytes in, %"G_GUINT64_FORMAT" bytes out, "
+			"%u mismatched commands",
+			totals.records, finished, elapsed,
+			totals.bytes_in, totals.bytes_out, totals.mismatches);
+	capture_free(scripts);
+	return 0;
+}